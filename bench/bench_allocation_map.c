@@ -0,0 +1,182 @@
+/*
+ * Allocation map micro-benchmarks.
+ *
+ * Calls `bgc_allocation_map_put`, `_get`, `_remove` and `_resize` directly on
+ * synthetic addresses (the map never dereferences the pointers it manages),
+ * for several address patterns:
+ *
+ *     sequential  16 bytes apart, like consecutive small mallocs
+ *     stride8     8 bytes apart, one `bgc_hash` value per address
+ *     stride1     1 byte apart, eight addresses share each `bgc_hash` value
+ *     page        4096 bytes apart, like page-aligned large allocations
+ *     random      random 16-byte aligned addresses in a 47-bit address space
+ *
+ * For each pattern it prints one JSON object per line with ns/op of every
+ * operation, the slowest single put (incremental resizing should keep it
+ * flat as the number of keys grows) and a histogram of the chain lengths after all keys have been
+ * inserted (`chain_histogram[i]` buckets hold `i` entries, the last entry
+ * counts chains of 8 or more), so changes to the hash function or the table
+ * layout can be compared.
+ *
+ * Usage: bench_allocation_map [keys]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/bgc.c"
+
+#define HISTOGRAM_BUCKETS 9
+
+typedef struct {
+    const char *name;
+    uintptr_t stride;
+} Pattern;
+
+static const Pattern PATTERNS[] = {
+    { "sequential", 16 },
+    { "stride8", 8 },
+    { "stride1", 1 },
+    { "page", 4096 },
+    { "random", 0 },
+};
+
+#define PATTERN_COUNT (sizeof(PATTERNS) / sizeof(PATTERNS[0]))
+
+static uint64_t RNG = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void)
+{
+    RNG ^= RNG << 13;
+    RNG ^= RNG >> 7;
+    RNG ^= RNG << 17;
+    return RNG;
+}
+
+static void make_keys(const Pattern *pattern, void **keys, size_t count)
+{
+    uintptr_t base = (uintptr_t) 0x10000000;
+    for (size_t i = 0; i < count; ++i) {
+        if (pattern->stride) {
+            keys[i] = (void *) (base + i * pattern->stride);
+        } else {
+            keys[i] = (void *) (uintptr_t) ((next_random() & 0x7fffffffffffULL) & ~(uint64_t) 0xf);
+        }
+    }
+}
+
+static void shuffle(void **keys, size_t count)
+{
+    for (size_t i = count; i > 1; --i) {
+        size_t j = next_random() % i;
+        void *tmp = keys[i - 1];
+        keys[i - 1] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+static double ns_per_op(uint64_t start, uint64_t end, size_t ops)
+{
+    return ops ? (double) (end - start) / (double) ops : 0.0;
+}
+
+static void run(const Pattern *pattern, size_t count)
+{
+    void **keys = malloc(count * sizeof(void *));
+    make_keys(pattern, keys, count);
+    bgc_AllocationMap *am = bgc_allocation_map_new(1024, 1024, 0.5, 0.2, 0.8);
+
+    uint64_t start = bgc_now_ns();
+    for (size_t i = 0; i < count; ++i) {
+        bgc_allocation_map_put(am, keys[i], 16, NULL);
+    }
+    double put_ns = ns_per_op(start, bgc_now_ns(), count);
+    size_t put_resizes = am->resize_count;
+
+    /* The slowest put, in a map of its own since reading the clock per put adds to put_ns */
+    bgc_AllocationMap *timed = bgc_allocation_map_new(1024, 1024, 0.5, 0.2, 0.8);
+    uint64_t max_put_ns = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t put_start = bgc_now_ns();
+        bgc_allocation_map_put(timed, keys[i], 16, NULL);
+        uint64_t put_end = bgc_now_ns();
+        max_put_ns = put_end - put_start > max_put_ns ? put_end - put_start : max_put_ns;
+    }
+    bgc_allocation_map_delete(timed);
+
+    /* Move what an incremental resize left in the old table */
+    bgc_allocation_map_finish_resize(am);
+
+    /* Chain lengths of the full map */
+    size_t histogram[HISTOGRAM_BUCKETS] = { 0 };
+    size_t max_chain = 0, used_buckets = 0;
+    for (size_t i = 0; i < am->capacity; ++i) {
+        size_t length = 0;
+        for (bgc_Allocation *alloc = am->allocs[i]; alloc; alloc = alloc->next) {
+            length++;
+        }
+        histogram[length < HISTOGRAM_BUCKETS - 1 ? length : HISTOGRAM_BUCKETS - 1]++;
+        max_chain = length > max_chain ? length : max_chain;
+        used_buckets += length > 0;
+    }
+    size_t capacity = am->capacity;
+    size_t size = am->size;
+
+    /* Lookups in random order */
+    shuffle(keys, count);
+    size_t found = 0;
+    start = bgc_now_ns();
+    for (size_t i = 0; i < count; ++i) {
+        found += bgc_allocation_map_get(am, keys[i]) != NULL;
+    }
+    double get_hit_ns = ns_per_op(start, bgc_now_ns(), count);
+
+    size_t missed = 0;
+    start = bgc_now_ns();
+    for (size_t i = 0; i < count; ++i) {
+        /* Odd addresses are never keys of the aligned patterns, nor addresses past the last stride1 key */
+        missed += bgc_allocation_map_get(am, (char *) keys[i] + (pattern->stride == 1 ? count : 1)) == NULL;
+    }
+    double get_miss_ns = ns_per_op(start, bgc_now_ns(), count);
+
+    /* Rehash the full map to twice its size and back */
+    start = bgc_now_ns();
+    bgc_allocation_map_resize(am, next_prime(am->capacity * 2));
+    bgc_allocation_map_finish_resize(am);
+    bgc_allocation_map_resize(am, capacity);
+    bgc_allocation_map_finish_resize(am);
+    double resize_ns = ns_per_op(start, bgc_now_ns(), 2 * size);
+
+    start = bgc_now_ns();
+    for (size_t i = 0; i < count; ++i) {
+        bgc_allocation_map_remove(am, keys[i], true);
+    }
+    double remove_ns = ns_per_op(start, bgc_now_ns(), count);
+
+    if (found != count || am->size != 0) {
+        fprintf(stderr, "bench_allocation_map: %s: map lost keys\n", pattern->name);
+        exit(1);
+    }
+
+    printf("{\"bench\":\"allocation_map\",\"pattern\":\"%s\",\"keys\":%zu,"
+           "\"put_ns\":%.1f,\"max_put_ns\":%llu,\"get_hit_ns\":%.1f,\"get_miss_ns\":%.1f,\"remove_ns\":%.1f,"
+           "\"resize_ns_per_entry\":%.1f,\"put_resizes\":%zu,\"capacity\":%zu,"
+           "\"load_factor\":%.3f,\"used_buckets\":%zu,\"max_chain\":%zu,\"missed\":%zu,\"chain_histogram\":[",
+           pattern->name, count, put_ns, (unsigned long long) max_put_ns, get_hit_ns, get_miss_ns, remove_ns, resize_ns,
+           put_resizes, capacity, (double) size / (double) capacity, used_buckets, max_chain, missed);
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        printf("%s%zu", i ? "," : "", histogram[i]);
+    }
+    printf("]}\n");
+
+    bgc_allocation_map_delete(am);
+    free(keys);
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    for (size_t i = 0; i < PATTERN_COUNT; ++i) {
+        run(&PATTERNS[i], count);
+    }
+    return 0;
+}
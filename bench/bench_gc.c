@@ -0,0 +1,429 @@
+/*
+ * Garbage collector throughput benchmarks.
+ *
+ * Standard GC workloads running against a conservatively scanned heap:
+ *
+ *     binary_trees    GCBench (Boehm, Ellis & Kovac): short-lived binary trees
+ *                     built top-down and bottom-up next to a long-lived tree
+ *                     and a large array of doubles
+ *     list_churn      a fixed-length linked list with nodes removed at the
+ *                     head and appended at the tail
+ *     random_graph    random rewiring of a graph of small nodes
+ *     numeric_arrays  large arrays of doubles filled and reduced
+ *     strings         a ring of strings created by duplication and
+ *                     concatenation
+ *     dead_objects    10M small objects without deconstructors, allocated
+ *                     with the collector disabled and freed by a single
+ *                     collection (see sweep_ms)
+ *
+ * Each workload prints one JSON object per line with its allocation rate,
+ * the number of collections, the total and maximum pause (from
+ * `bgc_get_stats`) split into mark and sweep time, the bytes of huge-page
+ * regions still in use at the end, the time `bgc_stop_ext` takes to tear the
+ * heap down and the peak resident set size of the process. Peak RSS is a
+ * process-wide high-water mark, so run one workload per process to compare
+ * it across workloads.
+ *
+ * Usage: bench_gc [workload|all] [--initial-capacity N] [--min-capacity N]
+ *                 [--downsize-load-factor F] [--upsize-load-factor F]
+ *                 [--sweep-factor F] [--huge-pages 0|1] [--stop-flags N]
+ *                 [--scale N]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../src/bgc.c"
+
+typedef struct {
+    size_t initial_capacity;
+    size_t min_capacity;
+    double downsize_load_factor;
+    double upsize_load_factor;
+    double sweep_factor;
+    /* Backs large allocations with transparent huge pages (`bgc_set_huge_pages`) */
+    int huge_pages;
+    /* The `bgc_StopFlags` the heap is torn down with, 0 for `bgc_stop` */
+    int stop_flags;
+    /* Divides the amount of work of every workload */
+    size_t scale;
+} BenchConfig;
+
+static bgc_GC GC;
+static void *STACK_BP;
+static BenchConfig CONFIG = { 1024, 1024, 0.2, 0.8, 0.5, 0, 0, 1 };
+
+static uint64_t RNG = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void)
+{
+    RNG ^= RNG << 13;
+    RNG ^= RNG >> 7;
+    RNG ^= RNG << 17;
+    return RNG;
+}
+
+/* -------------------------------------------------------------------------
+ * binary_trees
+ */
+typedef struct Node {
+    struct Node *left;
+    struct Node *right;
+    int i, j;
+} Node;
+
+#define STRETCH_TREE_DEPTH 18
+#define LONG_LIVED_TREE_DEPTH 16
+#define ARRAY_SIZE 500000
+#define MIN_TREE_DEPTH 4
+#define MAX_TREE_DEPTH 16
+
+static Node *new_node(Node *left, Node *right)
+{
+    Node *node = bgc_malloc(&GC, sizeof(Node));
+    node->left = left;
+    node->right = right;
+    node->i = 0;
+    node->j = 0;
+    return node;
+}
+
+static size_t tree_size(int depth)
+{
+    return ((size_t) 1 << (depth + 1)) - 1;
+}
+
+static void populate(int depth, Node *node)
+{
+    if (depth <= 0) {
+        return;
+    }
+    depth--;
+    node->left = new_node(NULL, NULL);
+    node->right = new_node(NULL, NULL);
+    populate(depth, node->left);
+    populate(depth, node->right);
+}
+
+static Node *make_tree(int depth)
+{
+    if (depth <= 0) {
+        return new_node(NULL, NULL);
+    }
+    Node *left = make_tree(depth - 1);
+    Node *right = make_tree(depth - 1);
+    return new_node(left, right);
+}
+
+static void binary_trees(void)
+{
+    /* Stretch the heap */
+    Node *volatile temp = make_tree(STRETCH_TREE_DEPTH);
+    temp = NULL;
+
+    Node *volatile long_lived = new_node(NULL, NULL);
+    populate(LONG_LIVED_TREE_DEPTH, long_lived);
+    double *volatile array = bgc_malloc(&GC, ARRAY_SIZE * sizeof(double));
+    for (size_t i = 0; i < ARRAY_SIZE / 2; ++i) {
+        array[i] = 1.0 / (double) (i + 1);
+    }
+
+    for (int depth = MIN_TREE_DEPTH; depth <= MAX_TREE_DEPTH; depth += 2) {
+        size_t iterations = 2 * tree_size(STRETCH_TREE_DEPTH) / tree_size(depth) / CONFIG.scale;
+        for (size_t i = 0; i < iterations; ++i) {
+            temp = new_node(NULL, NULL);
+            populate(depth, temp);
+            temp = NULL;
+        }
+        for (size_t i = 0; i < iterations; ++i) {
+            temp = make_tree(depth);
+            temp = NULL;
+        }
+    }
+    if (!long_lived || array[1000] != 1.0 / 1001.0) {
+        fprintf(stderr, "binary_trees: long-lived data was collected\n");
+        exit(1);
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * list_churn
+ */
+typedef struct ListNode {
+    struct ListNode *next;
+    size_t value;
+} ListNode;
+
+#define LIST_LENGTH 10000
+#define LIST_OPERATIONS 2000000
+
+static void list_churn(void)
+{
+    ListNode *volatile head = bgc_malloc(&GC, sizeof(ListNode));
+    ListNode *volatile tail = head;
+    head->next = NULL;
+    head->value = 0;
+    for (size_t i = 1; i < LIST_LENGTH; ++i) {
+        ListNode *node = bgc_malloc(&GC, sizeof(ListNode));
+        node->next = NULL;
+        node->value = i;
+        tail->next = node;
+        tail = node;
+    }
+    size_t operations = LIST_OPERATIONS / CONFIG.scale;
+    for (size_t i = 0; i < operations; ++i) {
+        ListNode *node = bgc_malloc(&GC, sizeof(ListNode));
+        node->next = NULL;
+        node->value = LIST_LENGTH + i;
+        tail->next = node;
+        tail = node;
+        /* Unlink the old head so that a stale pointer to it cannot retain the rest of the list */
+        ListNode *old = head;
+        head = head->next;
+        old->next = NULL;
+    }
+    if (head->value != operations) {
+        fprintf(stderr, "list_churn: list was corrupted\n");
+        exit(1);
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * random_graph
+ */
+#define GRAPH_EDGES 4
+#define GRAPH_NODES 10000
+#define GRAPH_OPERATIONS 2000000
+
+typedef struct GraphNode {
+    struct GraphNode *edges[GRAPH_EDGES];
+    size_t id;
+} GraphNode;
+
+static void random_graph(void)
+{
+    GraphNode **volatile nodes = bgc_calloc(&GC, GRAPH_NODES, sizeof(GraphNode *));
+    for (size_t i = 0; i < GRAPH_NODES; ++i) {
+        nodes[i] = bgc_calloc(&GC, 1, sizeof(GraphNode));
+        nodes[i]->id = i;
+    }
+    size_t operations = GRAPH_OPERATIONS / CONFIG.scale;
+    for (size_t i = 0; i < operations; ++i) {
+        uint64_t r = next_random();
+        GraphNode *source = nodes[r % GRAPH_NODES];
+        GraphNode *target = nodes[(r >> 16) % GRAPH_NODES];
+        if ((r >> 40) & 1) {
+            /* Replace a node, dropping it unless another node references it */
+            GraphNode *node = bgc_calloc(&GC, 1, sizeof(GraphNode));
+            node->id = i;
+            node->edges[0] = target;
+            nodes[(r >> 32) % GRAPH_NODES] = node;
+        } else {
+            /* Rewire an edge */
+            source->edges[(r >> 48) % GRAPH_EDGES] = target;
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * numeric_arrays
+ */
+#define ARRAY_LENGTH (32 * 1024)
+#define ARRAY_OPERATIONS 2000
+#define ARRAYS_LIVE 4
+
+static void numeric_arrays(void)
+{
+    double **volatile live = bgc_calloc(&GC, ARRAYS_LIVE, sizeof(double *));
+    double sum = 0.0;
+    size_t operations = ARRAY_OPERATIONS / CONFIG.scale;
+    for (size_t i = 0; i < operations; ++i) {
+        size_t length = ARRAY_LENGTH / 2 + next_random() % ARRAY_LENGTH;
+        double *array = bgc_malloc(&GC, length * sizeof(double));
+        for (size_t k = 0; k < length; ++k) {
+            array[k] = (double) (k + i) * 0.5;
+        }
+        for (size_t k = 0; k < length; ++k) {
+            sum += array[k];
+        }
+        live[i % ARRAYS_LIVE] = array;
+    }
+    if (sum <= 0.0) {
+        fprintf(stderr, "numeric_arrays: wrong sum\n");
+        exit(1);
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * strings
+ */
+#define STRING_RING 1000
+#define STRING_OPERATIONS 2000000
+
+static void strings(void)
+{
+    char **volatile ring = bgc_calloc(&GC, STRING_RING, sizeof(char *));
+    static const char *words[] = { "mark", "sweep", "root", "stack", "heap", "bubbly", "garbage", "collector" };
+    for (size_t i = 0; i < STRING_RING; ++i) {
+        ring[i] = bgc_strdup(&GC, words[i % 8]);
+    }
+    size_t operations = STRING_OPERATIONS / CONFIG.scale;
+    for (size_t i = 0; i < operations; ++i) {
+        uint64_t r = next_random();
+        const char *a = ring[r % STRING_RING];
+        const char *b = words[(r >> 20) % 8];
+        size_t la = strlen(a), lb = strlen(b);
+        char *s;
+        if (la + lb < 256) {
+            /* Concatenate */
+            s = bgc_malloc(&GC, la + lb + 1);
+            memcpy(s, a, la);
+            memcpy(s + la, b, lb + 1);
+        } else {
+            /* Start over with a duplicate */
+            s = bgc_strdup(&GC, b);
+        }
+        ring[(r >> 32) % STRING_RING] = s;
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * dead_objects
+ */
+#define DEAD_OBJECTS 10000000
+
+static void dead_objects(void)
+{
+    bgc_disable(&GC);
+    size_t count = DEAD_OBJECTS / CONFIG.scale;
+    for (size_t i = 0; i < count; ++i) {
+        bgc_malloc(&GC, 16);
+    }
+    bgc_enable(&GC);
+    bgc_collect(&GC);
+}
+
+/* -------------------------------------------------------------------------
+ * Driver
+ */
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} Workload;
+
+static const Workload WORKLOADS[] = {
+    { "binary_trees", binary_trees },
+    { "list_churn", list_churn },
+    { "random_graph", random_graph },
+    { "numeric_arrays", numeric_arrays },
+    { "strings", strings },
+    { "dead_objects", dead_objects },
+};
+
+#define WORKLOAD_COUNT (sizeof(WORKLOADS) / sizeof(WORKLOADS[0]))
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+static void run(const Workload *workload)
+{
+    bgc_start_ext(&GC, STACK_BP, CONFIG.initial_capacity, CONFIG.min_capacity,
+                  CONFIG.downsize_load_factor, CONFIG.upsize_load_factor, CONFIG.sweep_factor);
+    bgc_set_huge_pages(&GC, CONFIG.huge_pages != 0);
+    uint64_t start = bgc_now_ns();
+    workload->run();
+    double seconds = (double) (bgc_now_ns() - start) * 1e-9;
+    bgc_Stats stats;
+    bgc_get_stats(&GC, &stats);
+    uint64_t stop = bgc_now_ns();
+    bgc_stop_ext(&GC, CONFIG.stop_flags);
+    double stop_ms = (double) (bgc_now_ns() - stop) * 1e-6;
+
+    printf("{\"bench\":\"gc\",\"workload\":\"%s\",\"seconds\":%.6f,"
+           "\"allocations\":%zu,\"allocated_bytes\":%zu,\"allocations_per_second\":%.0f,"
+           "\"collections\":%zu,\"total_pause_ms\":%.3f,\"max_pause_ms\":%.3f,"
+           "\"mark_ms\":%.3f,\"sweep_ms\":%.3f,\"huge_page_bytes\":%zu,\"stop_ms\":%.3f,"
+           "\"peak_rss_kb\":%ld,\"initial_capacity\":%zu,\"min_capacity\":%zu,"
+           "\"downsize_load_factor\":%g,\"upsize_load_factor\":%g,\"sweep_factor\":%g,"
+           "\"huge_pages\":%d,\"stop_flags\":%d,\"scale\":%zu}\n",
+           workload->name, seconds, stats.total_objects, stats.total_bytes,
+           (double) stats.total_objects / seconds, stats.collections,
+           (double) (stats.mark_time_ns + stats.sweep_time_ns) * 1e-6,
+           (double) stats.max_pause_ns * 1e-6, (double) stats.mark_time_ns * 1e-6,
+           (double) stats.sweep_time_ns * 1e-6, stats.huge_page_bytes, stop_ms, peak_rss_kb(),
+           CONFIG.initial_capacity, CONFIG.min_capacity, CONFIG.downsize_load_factor,
+           CONFIG.upsize_load_factor, CONFIG.sweep_factor, CONFIG.huge_pages, CONFIG.stop_flags, CONFIG.scale);
+    fflush(stdout);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [workload|all] [--initial-capacity N] [--min-capacity N]\n"
+                    "       [--downsize-load-factor F] [--upsize-load-factor F] [--sweep-factor F]\n"
+                    "       [--huge-pages 0|1] [--stop-flags N] [--scale N]\n"
+                    "Workloads:", program);
+    for (size_t i = 0; i < WORKLOAD_COUNT; ++i) {
+        fprintf(stderr, " %s", WORKLOADS[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    STACK_BP = __builtin_frame_address(0);
+    const char *selected = "all";
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (arg[0] != '-') {
+            selected = arg;
+            continue;
+        }
+        if (!value) {
+            usage(argv[0]);
+        }
+        if (strcmp(arg, "--initial-capacity") == 0) {
+            CONFIG.initial_capacity = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--min-capacity") == 0) {
+            CONFIG.min_capacity = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--downsize-load-factor") == 0) {
+            CONFIG.downsize_load_factor = strtod(value, NULL);
+        } else if (strcmp(arg, "--upsize-load-factor") == 0) {
+            CONFIG.upsize_load_factor = strtod(value, NULL);
+        } else if (strcmp(arg, "--sweep-factor") == 0) {
+            CONFIG.sweep_factor = strtod(value, NULL);
+        } else if (strcmp(arg, "--huge-pages") == 0) {
+            CONFIG.huge_pages = atoi(value);
+        } else if (strcmp(arg, "--stop-flags") == 0) {
+            CONFIG.stop_flags = atoi(value);
+        } else if (strcmp(arg, "--scale") == 0) {
+            CONFIG.scale = strtoul(value, NULL, 10);
+            CONFIG.scale = CONFIG.scale ? CONFIG.scale : 1;
+        } else {
+            usage(argv[0]);
+        }
+        ++i;
+    }
+
+    bool found = false;
+    for (size_t i = 0; i < WORKLOAD_COUNT; ++i) {
+        if (strcmp(selected, "all") == 0 || strcmp(selected, WORKLOADS[i].name) == 0) {
+            run(&WORKLOADS[i]);
+            found = true;
+        }
+    }
+    if (!found) {
+        usage(argv[0]);
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * C++ allocation benchmarks: bgc::make_gc against std::make_shared.
+ *
+ *     trees   short-lived binary trees of depth 14 built bottom-up, the
+ *             collector against reference counting for freeing them
+ *     small   small pointer-free objects kept in a ring of 1000 slots, the
+ *             atomic (never scanned) allocation path against make_shared
+ *
+ * Prints one JSON object per line and implementation with the run time, the
+ * time per allocated object and, for bgc, the number of collections.
+ *
+ * Usage: bench_gcxx [scale]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+#include <bgc.hpp>
+
+#define TREE_DEPTH 14
+#define TREE_ITERATIONS 200
+#define SMALL_OBJECTS 5000000
+#define SMALL_RING 1000
+
+struct GcNode {
+    bgc::gc_ptr<GcNode> left;
+    bgc::gc_ptr<GcNode> right;
+};
+
+struct SharedNode {
+    std::shared_ptr<SharedNode> left;
+    std::shared_ptr<SharedNode> right;
+};
+
+struct Point {
+    double x, y, z, w;
+};
+
+template <>
+struct bgc::is_pointer_free<Point> : std::true_type {};
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char *workload, const char *impl, double seconds, std::size_t objects, bgc_GC *gc)
+{
+    std::printf("{\"bench\":\"gcxx\",\"workload\":\"%s\",\"impl\":\"%s\",\"seconds\":%.6f,"
+                "\"ns_per_object\":%.1f,\"objects\":%zu",
+                workload, impl, seconds, seconds * 1e9 / (double) objects, objects);
+    if (gc) {
+        bgc_Stats stats;
+        bgc_get_stats(gc, &stats);
+        std::printf(",\"collections\":%zu,\"max_pause_ms\":%.3f", stats.collections, (double) stats.max_pause_ns * 1e-6);
+    }
+    std::printf("}\n");
+}
+
+static bgc::gc_ptr<GcNode> gc_tree(int depth)
+{
+    if (depth == 0) {
+        return bgc::make_gc<GcNode>();
+    }
+    bgc::gc_ptr<GcNode> left = gc_tree(depth - 1);
+    bgc::gc_ptr<GcNode> right = gc_tree(depth - 1);
+    return bgc::make_gc<GcNode>(GcNode { left, right });
+}
+
+static std::shared_ptr<SharedNode> shared_tree(int depth)
+{
+    if (depth == 0) {
+        return std::make_shared<SharedNode>();
+    }
+    std::shared_ptr<SharedNode> left = shared_tree(depth - 1);
+    std::shared_ptr<SharedNode> right = shared_tree(depth - 1);
+    return std::make_shared<SharedNode>(SharedNode { std::move(left), std::move(right) });
+}
+
+static void trees(std::size_t scale, bgc_GC *gc)
+{
+    std::size_t iterations = TREE_ITERATIONS / scale;
+    std::size_t objects = iterations * ((std::size_t(1) << (TREE_DEPTH + 1)) - 1);
+
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i) {
+        gc_tree(TREE_DEPTH);
+    }
+    report("trees", "make_gc", seconds_since(start), objects, gc);
+
+    start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; ++i) {
+        shared_tree(TREE_DEPTH);
+    }
+    report("trees", "make_shared", seconds_since(start), objects, nullptr);
+}
+
+static void small(std::size_t scale, bgc_GC *gc)
+{
+    std::size_t objects = SMALL_OBJECTS / scale;
+    double sum = 0.0;
+
+    bgc::gc_ptr<Point> *gc_ring = static_cast<bgc::gc_ptr<Point> *>(bgc_calloc(gc, SMALL_RING, sizeof(bgc::gc_ptr<Point>)));
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < objects; ++i) {
+        gc_ring[i % SMALL_RING] = bgc::make_gc<Point>(Point { (double) i, 1.0, 2.0, 3.0 });
+        sum += gc_ring[(i * 7) % SMALL_RING] ? gc_ring[(i * 7) % SMALL_RING]->x : 0.0;
+    }
+    report("small", "make_gc", seconds_since(start), objects, gc);
+
+    std::unique_ptr<std::shared_ptr<Point>[]> shared_ring(new std::shared_ptr<Point>[SMALL_RING]);
+    start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < objects; ++i) {
+        shared_ring[i % SMALL_RING] = std::make_shared<Point>(Point { (double) i, 1.0, 2.0, 3.0 });
+        sum -= shared_ring[(i * 7) % SMALL_RING] ? shared_ring[(i * 7) % SMALL_RING]->x : 0.0;
+    }
+    report("small", "make_shared", seconds_since(start), objects, nullptr);
+
+    if (sum != 0.0) {
+        std::fprintf(stderr, "small: implementations disagree\n");
+        std::exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t scale = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1;
+    if (scale == 0) {
+        scale = 1;
+    }
+    bgc_GC gc;
+    BGC_GLOBAL_GC = &gc;
+    bgc_start(&gc, __builtin_frame_address(0));
+    trees(scale, &gc);
+    small(scale, &gc);
+    bgc_stop(&gc);
+    return 0;
+}
@@ -0,0 +1,346 @@
+/*
+ * Pause latency harness.
+ *
+ * Runs a steady-state, request-like workload: every request allocates a
+ * request object with a few header strings and a body buffer, builds a
+ * response string and stores it in a fixed-size cache that makes up the live
+ * heap. Every collection, explicit or triggered by an allocation, is
+ * timestamped through the COLLECT trace events.
+ *
+ * The harness reports the p50, p90, p99 and p99.9 pause times and the minimum
+ * mutator utilization (MMU) over sliding windows, i.e. the smallest fraction
+ * of any window of that length in which the application was not paused. It
+ * exits with a non-zero status if a configured threshold is exceeded.
+ *
+ * Usage: bench_latency [--requests N] [--cache N] [--collect-every N]
+ *                      [--initial-capacity N] [--sweep-factor F]
+ *                      [--max-p50-ms T] [--max-p99-ms T] [--max-p999-ms T]
+ *                      [--max-pause-ms T] [--min-mmu WINDOW_MS:FRACTION]...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/bgc.c"
+
+#define MAX_MMU_THRESHOLDS 8
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} Pause;
+
+typedef struct {
+    Pause *items;
+    size_t size;
+    size_t capacity;
+    uint64_t begin;
+} PauseLog;
+
+typedef struct {
+    double window_ms;
+    double min_utilization;
+} MmuThreshold;
+
+typedef struct {
+    size_t requests;
+    size_t cache;
+    size_t collect_every;
+    size_t initial_capacity;
+    double sweep_factor;
+    double max_p50_ms;
+    double max_p99_ms;
+    double max_p999_ms;
+    double max_pause_ms;
+    MmuThreshold mmu[MAX_MMU_THRESHOLDS];
+    size_t mmu_count;
+} LatencyConfig;
+
+static bgc_GC GC;
+static uint64_t RNG = 0x2545f4914f6cdd1dULL;
+
+static uint64_t next_random(void)
+{
+    RNG ^= RNG << 13;
+    RNG ^= RNG >> 7;
+    RNG ^= RNG << 17;
+    return RNG;
+}
+
+static void record_pause(const bgc_TraceEvent *event, void *ctx)
+{
+    PauseLog *pauses = ctx;
+    if (event->phase != BGC_PHASE_COLLECT && event->phase != BGC_PHASE_COLLECT_STEP) {
+        return;
+    }
+    if (event->begin) {
+        pauses->begin = event->timestamp_ns;
+        return;
+    }
+    if (pauses->size == pauses->capacity) {
+        pauses->capacity = pauses->capacity ? 2 * pauses->capacity : 1024;
+        pauses->items = realloc(pauses->items, pauses->capacity * sizeof(Pause));
+        if (!pauses->items) {
+            fprintf(stderr, "bench_latency: out of memory\n");
+            exit(2);
+        }
+    }
+    pauses->items[pauses->size].start = pauses->begin;
+    pauses->items[pauses->size].end = event->timestamp_ns;
+    pauses->size++;
+}
+
+/* -------------------------------------------------------------------------
+ * Workload
+ */
+typedef struct {
+    char *headers[8];
+    char *body;
+    size_t body_length;
+} Request;
+
+static const char *HEADERS[] = {
+    "Host: example.org", "Accept: */*", "User-Agent: bench_latency/1.0",
+    "Accept-Encoding: gzip, deflate", "Connection: keep-alive",
+    "Cache-Control: no-cache", "Content-Type: application/json",
+    "X-Request-Id: 7b1f0c2e-5d2a-4c7e-9a51-0f3d6e2b8c11",
+};
+
+static char *handle_request(size_t id)
+{
+    Request *request = bgc_malloc(&GC, sizeof(Request));
+    for (size_t i = 0; i < 8; ++i) {
+        request->headers[i] = bgc_strdup(&GC, HEADERS[(id + i) % 8]);
+    }
+    request->body_length = 256 + next_random() % 3840;
+    request->body = bgc_malloc(&GC, request->body_length);
+    memset(request->body, 'x', request->body_length);
+
+    size_t checksum = 0;
+    for (size_t i = 0; i < request->body_length; i += 64) {
+        checksum += (unsigned char) request->body[i];
+    }
+    char *response = bgc_malloc(&GC, 128);
+    snprintf(response, 128, "{\"id\":%zu,\"status\":200,\"length\":%zu,\"checksum\":%zu}",
+             id, request->body_length, checksum);
+    return response;
+}
+
+static void run_workload(const LatencyConfig *config)
+{
+    char **volatile cache = bgc_calloc(&GC, config->cache, sizeof(char *));
+    for (size_t id = 0; id < config->requests; ++id) {
+        cache[next_random() % config->cache] = handle_request(id);
+        if (config->collect_every && (id + 1) % config->collect_every == 0) {
+            bgc_collect(&GC);
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------
+ * Analysis
+ */
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted durations */
+static double percentile_ms(const uint64_t *sorted, size_t count, double p)
+{
+    if (!count) {
+        return 0.0;
+    }
+    size_t rank = (size_t) (p / 100.0 * (double) count + 0.999999);
+    rank = rank ? rank : 1;
+    rank = rank > count ? count : rank;
+    return (double) sorted[rank - 1] * 1e-6;
+}
+
+/* Total pause time within [t, t + w], using prefix sums over the sorted, disjoint pauses */
+static uint64_t paused_in_window(const PauseLog *pauses, const uint64_t *prefix, uint64_t t, uint64_t w)
+{
+    uint64_t end = t + w;
+    /* First pause that ends after t */
+    size_t lo = 0, hi = pauses->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (pauses->items[mid].end <= t) lo = mid + 1; else hi = mid;
+    }
+    size_t first = lo;
+    /* First pause that starts at or after the end of the window */
+    hi = pauses->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (pauses->items[mid].start < end) lo = mid + 1; else hi = mid;
+    }
+    size_t last = lo;
+    if (first >= last) {
+        return 0;
+    }
+    uint64_t paused = prefix[last] - prefix[first];
+    /* Clip the pauses that straddle the window boundaries */
+    if (pauses->items[first].start < t) {
+        paused -= t - pauses->items[first].start;
+    }
+    if (pauses->items[last - 1].end > end) {
+        paused -= pauses->items[last - 1].end - end;
+    }
+    return paused;
+}
+
+/*
+ * Minimum mutator utilization for windows of `window` ns over [begin, end].
+ * The minimum is attained by a window that starts at the start of a pause or
+ * ends at the end of a pause, so only those windows are checked.
+ */
+static double mmu(const PauseLog *pauses, const uint64_t *prefix, uint64_t begin, uint64_t end, uint64_t window)
+{
+    if (end - begin <= window) {
+        return 1.0 - (double) prefix[pauses->size] / (double) (end - begin);
+    }
+    uint64_t max_paused = 0;
+    for (size_t i = 0; i < pauses->size; ++i) {
+        uint64_t candidates[2] = { pauses->items[i].start, pauses->items[i].end - window };
+        if (pauses->items[i].end < begin + window) candidates[1] = begin;
+        for (size_t c = 0; c < 2; ++c) {
+            uint64_t t = candidates[c];
+            if (t < begin) t = begin;
+            if (t > end - window) t = end - window;
+            uint64_t paused = paused_in_window(pauses, prefix, t, window);
+            if (paused > max_paused) max_paused = paused;
+        }
+    }
+    return 1.0 - (double) max_paused / (double) window;
+}
+
+/* -------------------------------------------------------------------------
+ * Driver
+ */
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [--requests N] [--cache N] [--collect-every N]\n"
+                    "       [--initial-capacity N] [--sweep-factor F]\n"
+                    "       [--max-p50-ms T] [--max-p99-ms T] [--max-p999-ms T]\n"
+                    "       [--max-pause-ms T] [--min-mmu WINDOW_MS:FRACTION]...\n", program);
+    exit(2);
+}
+
+static bool check(const char *name, double value, double limit, bool upper)
+{
+    if (limit <= 0.0) {
+        return true;
+    }
+    bool ok = upper ? value <= limit : value >= limit;
+    if (!ok) {
+        fprintf(stderr, "bench_latency: %s = %.3f exceeds threshold %.3f\n", name, value, limit);
+    }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    LatencyConfig config = { 200000, 10000, 50000, 1024, 0.5, 0, 0, 0, 0, { { 0, 0 } }, 0 };
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[++i] : NULL;
+        if (!value) {
+            usage(argv[0]);
+        }
+        if (strcmp(arg, "--requests") == 0) {
+            config.requests = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--cache") == 0) {
+            config.cache = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--collect-every") == 0) {
+            config.collect_every = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--initial-capacity") == 0) {
+            config.initial_capacity = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--sweep-factor") == 0) {
+            config.sweep_factor = strtod(value, NULL);
+        } else if (strcmp(arg, "--max-p50-ms") == 0) {
+            config.max_p50_ms = strtod(value, NULL);
+        } else if (strcmp(arg, "--max-p99-ms") == 0) {
+            config.max_p99_ms = strtod(value, NULL);
+        } else if (strcmp(arg, "--max-p999-ms") == 0) {
+            config.max_p999_ms = strtod(value, NULL);
+        } else if (strcmp(arg, "--max-pause-ms") == 0) {
+            config.max_pause_ms = strtod(value, NULL);
+        } else if (strcmp(arg, "--min-mmu") == 0 && config.mmu_count < MAX_MMU_THRESHOLDS) {
+            MmuThreshold *threshold = &config.mmu[config.mmu_count++];
+            char *sep;
+            threshold->window_ms = strtod(value, &sep);
+            if (*sep != ':' || threshold->window_ms <= 0.0) {
+                usage(argv[0]);
+            }
+            threshold->min_utilization = strtod(sep + 1, NULL);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (!config.cache) {
+        usage(argv[0]);
+    }
+    /* Always report the usual windows, even without thresholds */
+    static const double default_windows[] = { 1.0, 10.0, 100.0 };
+    for (size_t i = 0; i < 3 && config.mmu_count < MAX_MMU_THRESHOLDS; ++i) {
+        bool present = false;
+        for (size_t k = 0; k < config.mmu_count; ++k) {
+            present |= config.mmu[k].window_ms == default_windows[i];
+        }
+        if (!present) {
+            config.mmu[config.mmu_count].window_ms = default_windows[i];
+            config.mmu[config.mmu_count].min_utilization = 0.0;
+            config.mmu_count++;
+        }
+    }
+
+    PauseLog pauses = { NULL, 0, 0, 0 };
+    bgc_start_ext(&GC, __builtin_frame_address(0), config.initial_capacity, 1024, 0.2, 0.8, config.sweep_factor);
+    bgc_set_tracer(&GC, record_pause, &pauses);
+    uint64_t begin = bgc_now_ns();
+    run_workload(&config);
+    uint64_t end = bgc_now_ns();
+    bgc_set_tracer(&GC, NULL, NULL);
+    bgc_stop(&GC);
+
+    uint64_t *durations = malloc((pauses.size + 1) * sizeof(uint64_t));
+    uint64_t *prefix = malloc((pauses.size + 1) * sizeof(uint64_t));
+    prefix[0] = 0;
+    for (size_t i = 0; i < pauses.size; ++i) {
+        durations[i] = pauses.items[i].end - pauses.items[i].start;
+        prefix[i + 1] = prefix[i] + durations[i];
+    }
+    qsort(durations, pauses.size, sizeof(uint64_t), compare_u64);
+
+    double p50 = percentile_ms(durations, pauses.size, 50.0);
+    double p90 = percentile_ms(durations, pauses.size, 90.0);
+    double p99 = percentile_ms(durations, pauses.size, 99.0);
+    double p999 = percentile_ms(durations, pauses.size, 99.9);
+    double max = pauses.size ? (double) durations[pauses.size - 1] * 1e-6 : 0.0;
+
+    printf("{\"bench\":\"latency\",\"requests\":%zu,\"cache\":%zu,\"seconds\":%.6f,"
+           "\"collections\":%zu,\"total_pause_ms\":%.3f,"
+           "\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f,\"mmu\":{",
+           config.requests, config.cache, (double) (end - begin) * 1e-9, pauses.size,
+           (double) prefix[pauses.size] * 1e-6, p50, p90, p99, p999, max);
+    bool ok = check("p50_ms", p50, config.max_p50_ms, true)
+            & check("p99_ms", p99, config.max_p99_ms, true)
+            & check("p999_ms", p999, config.max_p999_ms, true)
+            & check("max_ms", max, config.max_pause_ms, true);
+    for (size_t i = 0; i < config.mmu_count; ++i) {
+        uint64_t window = (uint64_t) (config.mmu[i].window_ms * 1e6);
+        double utilization = mmu(&pauses, prefix, begin, end, window);
+        printf("%s\"%gms\":%.4f", i ? "," : "", config.mmu[i].window_ms, utilization);
+        char name[64];
+        snprintf(name, sizeof(name), "mmu_%gms", config.mmu[i].window_ms);
+        ok &= check(name, utilization, config.mmu[i].min_utilization, false);
+    }
+    printf("},\"pass\":%s}\n", ok ? "true" : "false");
+
+    free(durations);
+    free(prefix);
+    free(pauses.items);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+/*
+ * Concurrent allocation map benchmark.
+ *
+ * Every thread allocates blocks with the system allocator and registers them
+ * in an allocation map, the way a multi-threaded `bgc_allocate` would. The
+ * baseline is a single `bgc_AllocationMap` behind one mutex, compared against
+ * a `bgc_ShardedAllocationMap`. Results are printed as one JSON object per
+ * line.
+ *
+ * Usage: bench_sharded_map [allocations per thread]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/bgc.c"
+
+#define MAX_THREADS 32
+
+typedef struct {
+    bool sharded;
+    bgc_AllocationMap *map;
+    pthread_mutex_t *map_lock;
+    bgc_ShardedAllocationMap *sam;
+    size_t count;
+    void **ptrs;
+} BenchArgs;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static void *bench_thread(void *arg)
+{
+    BenchArgs *args = arg;
+    for (size_t i = 0; i < args->count; ++i) {
+        void *ptr = malloc(16 + (i & 0x3f));
+        args->ptrs[i] = ptr;
+        if (args->sharded) {
+            bgc_sharded_allocation_map_put(args->sam, ptr, 16, NULL);
+        } else {
+            pthread_mutex_lock(args->map_lock);
+            bgc_allocation_map_put(args->map, ptr, 16, NULL);
+            pthread_mutex_unlock(args->map_lock);
+        }
+    }
+    return NULL;
+}
+
+static void run(bool sharded, size_t thread_count, size_t count)
+{
+    pthread_t threads[MAX_THREADS];
+    BenchArgs args[MAX_THREADS];
+    pthread_mutex_t map_lock;
+    bgc_AllocationMap *map = NULL;
+    bgc_ShardedAllocationMap *sam = NULL;
+
+    if (sharded) {
+        sam = bgc_sharded_allocation_map_new(BGC_DEFAULT_SHARD_COUNT, 1024, 1024, 0.5, 0.2, 0.8);
+    } else {
+        pthread_mutex_init(&map_lock, NULL);
+        map = bgc_allocation_map_new(1024, 1024, 0.5, 0.2, 0.8);
+    }
+
+    for (size_t t = 0; t < thread_count; ++t) {
+        args[t].sharded = sharded;
+        args[t].map = map;
+        args[t].map_lock = &map_lock;
+        args[t].sam = sam;
+        args[t].count = count;
+        args[t].ptrs = malloc(count * sizeof(void *));
+    }
+
+    double start = now_seconds();
+    for (size_t t = 0; t < thread_count; ++t) {
+        pthread_create(&threads[t], NULL, bench_thread, &args[t]);
+    }
+    for (size_t t = 0; t < thread_count; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("{\"bench\":\"allocation_map_concurrency\",\"map\":\"%s\",\"threads\":%zu,"
+           "\"allocations_per_thread\":%zu,\"seconds\":%.6f,"
+           "\"allocations_per_second_per_thread\":%.0f}\n",
+           sharded ? "sharded" : "single", thread_count, count, elapsed,
+           (double) count / elapsed);
+
+    for (size_t t = 0; t < thread_count; ++t) {
+        for (size_t i = 0; i < count; ++i) {
+            free(args[t].ptrs[i]);
+        }
+        free(args[t].ptrs);
+    }
+    if (sharded) {
+        bgc_sharded_allocation_map_delete(sam);
+    } else {
+        bgc_allocation_map_delete(map);
+        pthread_mutex_destroy(&map_lock);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        run(false, threads, count);
+        run(true, threads, count);
+    }
+    return 0;
+}
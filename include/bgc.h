@@ -12,7 +12,9 @@ extern "C" {
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 #if !defined(EXPORT)
 #define BGC__MISSING_EXPORT_IMPORT 1
@@ -57,10 +59,28 @@ extern "C" {
 #define BGC_TAG_NONE 0x0
 #define BGC_TAG_ROOT 0x1
 #define BGC_TAG_MARK 0x2
+#define BGC_TAG_SAMPLED 0x4
+#define BGC_TAG_ATOMIC 0x8      // holds no pointers, the contents are never scanned
+#define BGC_TAG_WEAK 0x10       // a weak reference or weak map, processed after marking
+#define BGC_TAG_INTERNED 0x20   // a string in the intern table
+#define BGC_TAG_HUGE 0x40       // backed by its own huge-page region, freed with munmap
+#define BGC_TAG_WEAKLY_HELD 0x80    // the target of a weak reference or a weak map key, see `bgc_free`
 
 /// @brief A deconstructor to call after freeing managed memory.
 typedef void (*bgc_Deconstructor)(void *);
 
+/// @brief The bits per word of a layout bitmap.
+#define BGC_LAYOUT_BITS (8 * sizeof(uintptr_t))
+
+/// @brief The pointer slots of a type, so that only they are scanned when marking its allocations.
+typedef struct bgc_Layout {
+    /// @brief The size *(in bytes)* of the type. Larger allocations are arrays, the bitmap repeats for every item.
+    size_t size;
+
+    /// @brief One bit per pointer-sized word of the type, set if the word holds a pointer to managed memory.
+    const uintptr_t *bitmap;
+} bgc_Layout;
+
 /**
  * The allocation object.
  *
@@ -72,9 +92,181 @@ typedef struct bgc_Allocation {
     size_t size;                    // allocated size in bytes
     char tag;                       // the tag for mark-and-sweep
     bgc_Deconstructor dtor;         // destructor
+    size_t final_index;             // position in the finalizable list of the map, if dtor is set
+    const bgc_Layout *layout;       // pointer slots to mark, all words if NULL
     struct bgc_Allocation *next;    // separate chaining
 } bgc_Allocation;
 
+/// @brief The phases of the garbage collector reported to trace callbacks.
+typedef enum bgc_Phase {
+    /// @brief A full collection *(`count`: bytes freed)*.
+    BGC_PHASE_COLLECT,
+    /// @brief Marking from tagged roots, root ranges and the shadow stack *(`count`: objects marked)*.
+    BGC_PHASE_MARK_ROOTS,
+    /// @brief Marking from the registers and the C stack *(`count`: objects marked)*.
+    BGC_PHASE_MARK_STACK,
+    /// @brief Sweeping unmarked allocations *(`count`: objects freed)*.
+    BGC_PHASE_SWEEP,
+    /// @brief Rehashing the allocation map *(`count`: old capacity at the start, new capacity at the end)*.
+    BGC_PHASE_MAP_RESIZE,
+    /// @brief Running the deconstructors of swept allocations *(`count`: deconstructors run)*.
+    BGC_PHASE_DTOR_BATCH,
+    /// @brief Processing weak references, weak maps and interned strings after marking *(`count`: references and entries cleared)*.
+    BGC_PHASE_WEAK,
+    /// @brief One call of `bgc_collect_step` or `bgc_idle_hint` that did collector work, a pause *(`count`: bytes freed)*.
+    BGC_PHASE_COLLECT_STEP
+} bgc_Phase;
+
+/// @brief An event reported to a trace callback at the start and at the end of a phase.
+typedef struct bgc_TraceEvent {
+    /// @brief The phase that starts or ends.
+    bgc_Phase phase;
+
+    /// @brief `true` at the start of the phase, `false` at its end.
+    bool begin;
+
+    /// @brief The time of the event *(in nanoseconds, `CLOCK_MONOTONIC` on POSIX systems)*.
+    uint64_t timestamp_ns;
+
+    /// @brief A phase-specific count *(see `bgc_Phase`)*.
+    size_t count;
+} bgc_TraceEvent;
+
+/// @brief A callback that receives trace events.
+typedef void (*bgc_TraceCallback)(const bgc_TraceEvent *event, void *ctx);
+
+/// @brief A registered trace callback and its context.
+typedef struct bgc_Tracer {
+    bgc_TraceCallback callback;
+    void *ctx;
+} bgc_Tracer;
+
+/// @brief A trace sink that writes Chrome trace-event JSON *(viewable in Perfetto or chrome://tracing)*.
+typedef struct bgc_ChromeTrace {
+    /// @brief The stream the JSON is written to.
+    FILE *out;
+
+    /// @brief The number of events written so far.
+    size_t events;
+
+    /// @brief The process id recorded with each event.
+    int pid;
+
+    /// @brief The thread id recorded with each event.
+    int tid;
+} bgc_ChromeTrace;
+
+/// @brief The default mean number of bytes allocated between two profiler samples.
+#define BGC_PROFILE_DEFAULT_INTERVAL (512 * 1024)
+
+/// @brief The maximum number of stack frames recorded per profiler sample.
+#define BGC_PROFILE_MAX_DEPTH 32
+
+/// @brief The output formats of `bgc_profile_dump`.
+typedef enum bgc_ProfileFormat {
+    /// @brief A human-readable report, sorted by live bytes.
+    BGC_PROFILE_TEXT,
+    /// @brief The legacy heap profile format understood by `pprof`.
+    BGC_PROFILE_PPROF
+} bgc_ProfileFormat;
+
+/// @brief An allocation call stack and the estimated allocations made from it.
+typedef struct bgc_ProfileSite {
+    /// @brief The return addresses of the call stack, innermost first.
+    void *stack[BGC_PROFILE_MAX_DEPTH];
+
+    /// @brief The number of valid entries in `stack`.
+    size_t depth;
+
+    /// @brief The estimated number of bytes allocated from this call stack.
+    size_t allocated_bytes;
+
+    /// @brief The estimated number of objects allocated from this call stack.
+    size_t allocated_objects;
+
+    /// @brief The estimated number of allocated bytes that are still alive.
+    size_t live_bytes;
+
+    /// @brief The estimated number of allocated objects that are still alive.
+    size_t live_objects;
+} bgc_ProfileSite;
+
+/// @brief A slot of the profiler's index of call stacks.
+typedef struct bgc_ProfileSiteSlot {
+    /// @brief The index of the site in `sites` plus one, or 0 if the slot is free.
+    size_t site;
+
+    /// @brief The hash of the call stack of the site.
+    size_t hash;
+} bgc_ProfileSiteSlot;
+
+/// @brief A sampled allocation that is still alive.
+typedef struct bgc_ProfileSample {
+    void *ptr;
+    size_t site;
+    size_t bytes;
+    size_t objects;
+} bgc_ProfileSample;
+
+/// @brief The state of the sampling allocation profiler *(see `bgc_profile_start`)*.
+typedef struct bgc_Profiler {
+    /// @brief The mean number of bytes between two samples, or zero if sampling is off.
+    size_t interval;
+
+    /// @brief The number of bytes allocated since the last sample.
+    size_t accumulated;
+
+    /// @brief The number of bytes after which the next sample is taken.
+    size_t threshold;
+
+    /// @brief The state of the random number generator that draws thresholds.
+    uint64_t rng;
+
+    bgc_ProfileSite *sites;
+    size_t site_count;
+    size_t site_capacity;
+
+    /// @brief The sites by call stack *(open addressing, `site_slot_capacity` is a power of two)*.
+    bgc_ProfileSiteSlot *site_slots;
+    size_t site_slot_capacity;
+
+    /// @brief The samples by address *(open addressing, free slots have a `NULL` pointer, `sample_capacity` is a power of two)*.
+    bgc_ProfileSample *samples;
+    size_t sample_count;
+    size_t sample_capacity;
+} bgc_Profiler;
+
+/// @brief The magic bytes at the start of an allocation recording.
+#define BGC_RECORDING_MAGIC "BGCREC01"
+
+/// @brief The events of an allocation recording *(see `bgc_record_start`)*.
+typedef enum bgc_RecordOp {
+    /// @brief An allocation *(address, size, 1 if it has a deconstructor)*.
+    BGC_RECORD_ALLOC = 'A',
+    /// @brief A reallocation *(old address, new address, new size)*.
+    BGC_RECORD_REALLOC = 'R',
+    /// @brief An explicit `bgc_free` *(address)*.
+    BGC_RECORD_FREE = 'F',
+    /// @brief An allocation freed by the collector *(address)*.
+    BGC_RECORD_DIE = 'D',
+    /// @brief A collection *(1 if it was triggered by an allocation, 0 if explicit)*.
+    BGC_RECORD_COLLECT = 'C',
+    /// @brief A pointer stored into an allocation *(address, offset, stored address)*.
+    BGC_RECORD_WRITE = 'W'
+} bgc_RecordOp;
+
+/// @brief The state of the allocation recorder.
+typedef struct bgc_Recorder {
+    /// @brief The stream the recording is written to, or `NULL` if recording is off.
+    FILE *out;
+
+    /// @brief The number of events written so far.
+    size_t events;
+
+    /// @brief Set while an allocation runs a collection, to tell implicit from explicit collections.
+    bool implicit;
+} bgc_Recorder;
+
 /**
  * The allocation hash map.
  *
@@ -90,9 +282,244 @@ typedef struct bgc_AllocationMap {
     double sweep_factor;
     size_t sweep_limit;
     size_t size;
+    size_t resize_count;
+    const bgc_Tracer *tracer;
+    bool frozen;                // resizing is deferred while a lazy sweep walks the buckets
+    bool huge_pages;            // back large bucket arrays with huge-page regions
+    bool huge_allocs;           // `allocs` is a huge-page region
     bgc_Allocation **allocs;
+    bgc_Allocation **old_allocs;    // the table an incremental resize moves away from, or NULL
+    size_t old_capacity;
+    size_t migrate_cursor;      // the next bucket of `old_allocs` to move
+    bool old_huge;              // `old_allocs` is a huge-page region
+    bgc_Allocation **finalizable;   // the allocations with a deconstructor
+    size_t finalizable_count;
+    size_t finalizable_capacity;
+    struct bgc_AllocationSlab *full_slabs;  // the blocks allocation objects are carved from, all in use
+    struct bgc_AllocationSlab *spare_slabs; // the blocks with allocation objects free for reuse
 } bgc_AllocationMap;
 
+/// @brief Runtime statistics of a garbage collector *(see `bgc_get_stats`)*.
+typedef struct bgc_Stats {
+    /// @brief The number of bytes allocated since the garbage collector was started.
+    size_t total_bytes;
+
+    /// @brief The number of bytes currently managed.
+    size_t live_bytes;
+
+    /// @brief The number of objects allocated since the garbage collector was started.
+    size_t total_objects;
+
+    /// @brief The number of objects currently managed.
+    size_t live_objects;
+
+    /// @brief The number of completed collections.
+    size_t collections;
+
+    /// @brief The number of collections triggered by an allocation crossing the sweep limit.
+    size_t allocation_collections;
+
+    /// @brief The number of calls to `bgc_collect_step` and `bgc_idle_hint` that did collector work.
+    size_t collection_steps;
+
+    /// @brief The number of objects marked since the garbage collector was started.
+    size_t marked_objects;
+
+    /// @brief The cumulative time *(in nanoseconds)* spent marking.
+    uint64_t mark_time_ns;
+
+    /// @brief The cumulative time *(in nanoseconds)* spent sweeping.
+    uint64_t sweep_time_ns;
+
+    /// @brief The longest single mark phase *(in nanoseconds)*.
+    uint64_t max_mark_time_ns;
+
+    /// @brief The longest single sweep phase *(in nanoseconds)*.
+    uint64_t max_sweep_time_ns;
+
+    /// @brief The longest single collection pause *(mark and sweep, in nanoseconds)*.
+    uint64_t max_pause_ns;
+
+    /// @brief The number of bytes freed by the collector.
+    size_t collected_bytes;
+
+    /// @brief The number of objects freed by the collector.
+    size_t collected_objects;
+
+    /// @brief The number of deconstructors run *(by the collector and by `bgc_free`)*.
+    size_t dtors_run;
+
+    /// @brief The number of weak references, weak map entries and interned strings cleared by the collector.
+    size_t weak_cleared;
+
+    /// @brief The number of bytes of external memory *(file mappings)* owned by managed objects.
+    size_t external_bytes;
+
+    /// @brief The number of bytes of huge-page regions backing managed memory *(see `bgc_set_huge_pages`)*.
+    size_t huge_page_bytes;
+
+    /// @brief The number of addresses the last mark phase blacklisted *(see `bgc_set_blacklisting`)*.
+    size_t blacklisted_addresses;
+
+    /// @brief The number of bytes of blacklisted blocks held back from the program.
+    size_t blacklisted_bytes;
+
+    /// @brief The number of allocations that got a different block because theirs was blacklisted.
+    size_t blacklist_avoided;
+
+    /// @brief The number of bytes the last collection kept alive only through misaligned stack words *(not a leak metric: retention through aligned but stale words is not counted)*.
+    size_t misaligned_retained_bytes;
+
+    /// @brief The capacity of the allocation map.
+    size_t map_capacity;
+
+    /// @brief The load factor of the allocation map.
+    double map_load_factor;
+
+    /// @brief The number of times the allocation map was resized.
+    size_t map_resize_count;
+} bgc_Stats;
+
+/// @brief The work done by one call of `bgc_collect_step` or `bgc_idle_hint`.
+typedef struct bgc_StepResult {
+    /// @brief Whether the call marked the heap, starting a new collection.
+    bool marked;
+
+    /// @brief Whether the call finished the collection.
+    bool finished;
+
+    /// @brief The fraction of the collection done after the call *(the share of the allocation map swept, 1 once finished)*.
+    double progress;
+
+    /// @brief The number of bytes freed by the call.
+    size_t freed_bytes;
+
+    /// @brief The time spent in the call *(in nanoseconds)*.
+    uint64_t time_ns;
+} bgc_StepResult;
+
+/// @brief The amount of external memory *(in bytes)* that triggers a collection before any has run.
+#define BGC_EXTERNAL_LIMIT (64 * 1024 * 1024)
+
+/// @brief The size and alignment of the regions allocated with `bgc_set_huge_pages` *(a transparent huge page)*.
+#define BGC_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/// @brief The maximum number of blacklisted blocks held back from the program at a time.
+#define BGC_BLACKLIST_HELD 1024
+
+/// @brief The maximum number of bytes of blacklisted blocks held back from the program at a time.
+#define BGC_BLACKLIST_HELD_BYTES (1024 * 1024)
+
+/// @brief A range of foreign *(non-managed)* memory that is scanned for pointers during marking.
+typedef struct bgc_RootRange {
+    /// @brief The first byte of the range.
+    void *begin;
+
+    /// @brief One past the last byte of the range.
+    void *end;
+} bgc_RootRange;
+
+/// @brief A managed weak reference: it does not keep its target alive and is cleared once the target is collected.
+typedef struct bgc_Weak {
+    /// @brief The referenced managed memory, or `NULL` once it was collected.
+    void *target;
+
+    /// @brief The position of the reference in the weak registry.
+    size_t index;
+} bgc_Weak;
+
+/// @brief A key and its value in a weak map.
+typedef struct bgc_WeakMapEntry {
+    void *key;
+    void *value;
+} bgc_WeakMapEntry;
+
+/// @brief A managed hash map that holds its values only while their keys are alive *(an ephemeron table)*.
+typedef struct bgc_WeakMap {
+    /// @brief The slots of the map *(open addressing, free slots have a `NULL` key)*.
+    bgc_WeakMapEntry *entries;
+
+    /// @brief The number of entries in the map.
+    size_t size;
+
+    /// @brief The number of slots in `entries` *(a power of two)*.
+    size_t capacity;
+
+    /// @brief The position of the map in the weak registry.
+    size_t index;
+
+    /// @brief The garbage collector that manages the map.
+    struct bgc_GC *gc;
+} bgc_WeakMap;
+
+/// @brief The weak references and weak maps that are processed after marking.
+typedef struct bgc_WeakRegistry {
+    bgc_Weak **refs;
+    size_t ref_count;
+    size_t ref_capacity;
+
+    bgc_WeakMap **maps;
+    size_t map_count;
+    size_t map_capacity;
+} bgc_WeakRegistry;
+
+/// @brief A canonical string in the intern table.
+typedef struct bgc_InternEntry {
+    /// @brief The managed, null-terminated string, or `NULL` if the slot is free.
+    const char *str;
+
+    /// @brief The length of the string *(in bytes, without the terminator)*.
+    size_t length;
+
+    /// @brief The hash of the string.
+    size_t hash;
+} bgc_InternEntry;
+
+/// @brief The table of interned strings *(see `bgc_intern`)*, which holds its strings weakly.
+typedef struct bgc_InternTable {
+    /// @brief The slots of the table *(open addressing, `NULL` until the first string is interned)*.
+    bgc_InternEntry *entries;
+
+    /// @brief The number of interned strings.
+    size_t size;
+
+    /// @brief The number of slots in `entries` *(a power of two)*.
+    size_t capacity;
+} bgc_InternTable;
+
+/// @brief A block of memory held back from the program because its address is blacklisted.
+typedef struct bgc_HeldBlock {
+    /// @brief The address of the block.
+    void *ptr;
+
+    /// @brief The size of the block.
+    size_t size;
+} bgc_HeldBlock;
+
+/// @brief The addresses that conservative scans found near managed memory *(see `bgc_set_blacklisting`)*.
+typedef struct bgc_Blacklist {
+    /// @brief The slots of the set *(open addressing, 0 marks an empty slot, `NULL` until the first address is blacklisted)*.
+    uintptr_t *entries;
+
+    /// @brief The number of blacklisted addresses.
+    size_t size;
+
+    /// @brief The number of slots in `entries` *(a power of two)*.
+    size_t capacity;
+
+    /// @brief The blocks the allocator got for blacklisted addresses and did not hand out.
+    bgc_HeldBlock *held;
+
+    /// @brief The number of blocks in `held`.
+    size_t held_count;
+
+    /// @brief The number of blocks that fit into `held`.
+    size_t held_capacity;
+
+    /// @brief The total size of the blocks in `held`.
+    size_t held_bytes;
+} bgc_Blacklist;
+
 /// @brief A garbage collector, used to manage memory.
 typedef struct bgc_GC {
     /// @brief The allocation map.
@@ -106,6 +533,75 @@ typedef struct bgc_GC {
 
     /// @brief The minimum size of the managed heap.
     size_t min_size;
+
+    /// @brief Registered root ranges, sorted by address and non-overlapping.
+    bgc_RootRange *roots;
+
+    /// @brief The number of registered root ranges.
+    size_t root_count;
+
+    /// @brief The number of root ranges that fit into `roots`.
+    size_t root_capacity;
+
+    /// @brief Toggling this variable switches between conservative stack scanning and precise (shadow stack) roots.
+    bool precise_roots;
+
+    /// @brief The shadow stack: addresses of the variables that hold roots.
+    void ***shadow_stack;
+
+    /// @brief The number of slots on the shadow stack.
+    size_t shadow_depth;
+
+    /// @brief The number of slots that fit into `shadow_stack`.
+    size_t shadow_capacity;
+
+    /// @brief The runtime statistics, updated as the garbage collector runs.
+    bgc_Stats stats;
+
+    /// @brief The trace callback notified at the start and end of each phase.
+    bgc_Tracer tracer;
+
+    /// @brief The sampling allocation profiler.
+    bgc_Profiler profiler;
+
+    /// @brief The allocation recorder.
+    bgc_Recorder recorder;
+
+    /// @brief The live weak references and weak maps.
+    bgc_WeakRegistry weak;
+
+    /// @brief The interned strings.
+    bgc_InternTable interned;
+
+    /// @brief The amount of external memory *(in bytes)* that triggers the next collection.
+    size_t external_limit;
+
+    /// @brief Toggling this variable backs large allocations with huge-page regions.
+    bool huge_pages;
+
+    /// @brief Whether a collection started by `bgc_collect_step` is still sweeping.
+    bool sweeping;
+
+    /// @brief The next allocation map bucket to sweep while `sweeping`.
+    size_t sweep_cursor;
+
+    /// @brief The number of allocations that survived the last collection.
+    size_t survivors;
+
+    /// @brief The lowest address of an allocation so far, scanned words below it are skipped without a lookup.
+    uintptr_t heap_min;
+
+    /// @brief The highest address of an allocation so far, scanned words above it are skipped without a lookup.
+    uintptr_t heap_max;
+
+    /// @brief Toggling this variable records near misses of conservative scans and keeps the allocator away from them.
+    bool blacklisting;
+
+    /// @brief The addresses the last mark phase blacklisted and the blocks held back for them.
+    bgc_Blacklist blacklist;
+
+    /// @brief Set while marking from a misaligned stack word, to count misaligned-stack retention.
+    bool misaligned_pointer;
 } bgc_GC;
 
 /// @brief A managed buffer of RAM.
@@ -129,6 +625,67 @@ typedef struct bgc_Array {
     const size_t slot_size;
 } bgc_Array;
 
+/*
+ * Arrays and buffers created by `bgc_array_inline` and `bgc_buffer_inline`
+ * store their header and data in a single allocation. `array->buffer` and
+ * `buffer->address` point into that allocation, so only a pointer to the
+ * array *(or buffer)* itself keeps it alive, and the data cannot be passed
+ * to `bgc_free` or `bgc_realloc`.
+ */
+#if defined(__cplusplus)
+#define BGC__FLEXIBLE_ARRAY 1   // ISO C++ has no flexible array members
+#else
+#define BGC__FLEXIBLE_ARRAY
+#endif
+
+/// @brief The single allocation holding a managed array, its buffer and its slots.
+typedef struct bgc_ArrayBlock {
+    bgc_Array array;
+    bgc_Buffer buffer;
+
+    /// @brief The array's slots, aligned for any type.
+    max_align_t data[BGC__FLEXIBLE_ARRAY];
+} bgc_ArrayBlock;
+
+/// @brief The single allocation holding a managed buffer and its data.
+typedef struct bgc_BufferBlock {
+    bgc_Buffer buffer;
+
+    /// @brief The buffer's data, aligned for any type.
+    max_align_t data[BGC__FLEXIBLE_ARRAY];
+} bgc_BufferBlock;
+
+/// @brief A managed, growable array of objects.
+typedef struct bgc_Vector {
+    /// @brief The managed memory holding the vector's items *(`NULL` while the capacity is 0)*.
+    void *data;
+
+    /// @brief The number of items in the vector.
+    size_t size;
+
+    /// @brief The number of items the vector can hold before it has to grow.
+    size_t capacity;
+
+    /// @brief The size *(in bytes)* of each item.
+    size_t item_size;
+} bgc_Vector;
+
+/*
+ * Threading support is only required by the sharded allocation map. Use the
+ * BGC_NO_THREADS flag to build without pthreads.
+ */
+#if !defined(BGC_NO_THREADS) && defined(_MSC_VER)
+#define BGC_NO_THREADS 1
+#endif
+
+#if !defined(BGC_NO_THREADS)
+/// @brief The default number of shards of a sharded allocation map.
+#define BGC_DEFAULT_SHARD_COUNT 16
+
+/// @brief An allocation map partitioned by address hash for allocators that share a heap across threads.
+typedef struct bgc_ShardedAllocationMap bgc_ShardedAllocationMap;
+#endif
+
 /// @brief A global instance of the garbage collector for use by single-threaded applications.
 extern bgc_GC *BGC_GLOBAL_GC;
 
@@ -146,6 +703,91 @@ extern bgc_GC *BGC_GLOBAL_GC;
 /// @return The amount of memory freed (in bytes).
 PUBLIC size_t bgc_collect(bgc_GC *gc);
 
+/// @brief Do a bounded amount of collector work, e.g. between the events of an event loop.
+/// @param gc The garbage collector to run.
+/// @param budget_ns The time to spend *(in nanoseconds)*. A step that starts a collection marks the whole
+///     heap at once, then the heap is swept a few buckets at a time until the budget is used up.
+/// @return The work done *(objects allocated until the collection finishes survive it)*.
+PUBLIC bgc_StepResult bgc_collect_step(bgc_GC *gc, uint64_t budget_ns);
+
+/// @brief Tell the garbage collector that the program is idle until `deadline`.
+/// @param gc The garbage collector to run.
+/// @param deadline The end of the idle period *(a `bgc_now_ns` time)*. A pending collection is continued,
+///     a new one is started if the heap is halfway to its sweep limit and the last marks fit before `deadline`.
+/// @return The work done, nothing if no collection was worth starting.
+PUBLIC bgc_StepResult bgc_idle_hint(bgc_GC *gc, uint64_t deadline);
+
+/// @brief Read the monotonic clock used for pause times and idle deadlines.
+/// @return The current time *(in nanoseconds since an arbitrary epoch)*.
+PUBLIC uint64_t bgc_now_ns(void);
+
+/// @brief Get the runtime statistics of a garbage collector.
+/// @param gc The garbage collector to inspect.
+/// @param stats The statistics to fill in.
+PUBLIC void bgc_get_stats(bgc_GC *gc, bgc_Stats *stats);
+
+/// @brief Register a callback that is notified at the start and at the end of each collector phase.
+/// @param gc The garbage collector to trace.
+/// @param callback The callback to notify, or `NULL` to stop tracing.
+/// @param ctx A context pointer passed to every invocation of `callback`.
+PUBLIC void bgc_set_tracer(bgc_GC *gc, bgc_TraceCallback callback, void *ctx);
+
+/// @brief Start writing Chrome trace-event JSON.
+/// @param trace The trace sink to initialize.
+/// @param out The stream to write the JSON to.
+PUBLIC void bgc_chrome_trace_open(bgc_ChromeTrace *trace, FILE *out);
+
+/// @brief A trace callback that writes events to the `bgc_ChromeTrace` passed as `ctx`.
+/// @param event The event to write.
+/// @param ctx A pointer to an open `bgc_ChromeTrace`.
+PUBLIC void bgc_chrome_trace_callback(const bgc_TraceEvent *event, void *ctx);
+
+/// @brief Finish writing Chrome trace-event JSON *(does not close the stream)*.
+/// @param trace The trace sink to finish.
+PUBLIC void bgc_chrome_trace_close(bgc_ChromeTrace *trace);
+
+/// @brief The magic bytes at the start of a heap snapshot.
+#define BGC_SNAPSHOT_MAGIC "BGCSNAP1"
+
+/// @brief Write a binary snapshot of the managed heap *(see `tools/bgc_heap_analyze.c` for the format)*.
+/// @param gc The garbage collector to inspect.
+/// @param out The stream to write the snapshot to.
+/// @return The number of allocations written, or `(size_t) -1` if writing failed or memory ran out.
+PUBLIC size_t bgc_heap_snapshot(bgc_GC *gc, FILE *out);
+
+/// @brief Start sampling allocations, discarding any previous profile.
+/// @param gc The garbage collector to profile.
+/// @param interval The mean number of bytes between two samples *(`0` for `BGC_PROFILE_DEFAULT_INTERVAL`)*.
+PUBLIC void bgc_profile_start(bgc_GC *gc, size_t interval);
+
+/// @brief Stop sampling new allocations. Already sampled allocations are still tracked until they are freed.
+/// @param gc The profiled garbage collector.
+PUBLIC void bgc_profile_stop(bgc_GC *gc);
+
+/// @brief Write the allocated and live bytes per allocation call stack.
+/// @param gc The profiled garbage collector.
+/// @param out The stream to write the profile to.
+/// @param format The output format.
+/// @return `true` if the profile was written.
+PUBLIC bool bgc_profile_dump(bgc_GC *gc, FILE *out, bgc_ProfileFormat format);
+
+/// @brief Start recording allocations, frees, collections and pointer writes *(see `tools/bgc_replay.c` for the format)*.
+/// @param gc The garbage collector to record.
+/// @param out The stream to write the recording to. It is not closed by the recorder.
+/// @return `true` if the recording was started.
+PUBLIC bool bgc_record_start(bgc_GC *gc, FILE *out);
+
+/// @brief Stop recording and flush the recording.
+/// @param gc The recorded garbage collector.
+PUBLIC void bgc_record_stop(bgc_GC *gc);
+
+/// @brief Record that the pointer `value` was stored at `slot` inside the managed allocation `obj`.
+/// @param gc The recorded garbage collector.
+/// @param obj The managed allocation that was written to.
+/// @param slot The address inside `obj` that was written.
+/// @param value The stored pointer.
+PUBLIC void bgc_record_write(bgc_GC *gc, void *obj, void *slot, void *value);
+
 /// @brief Disable garbage collection.
 PUBLIC void bgc_disable(bgc_GC *gc);
 
@@ -172,6 +814,29 @@ PUBLIC void bgc_start_ext(bgc_GC *gc, void *stack_bp, size_t initial_size, size_
 /// @return The number of bytes freed.
 PUBLIC size_t bgc_stop(bgc_GC *gc);
 
+/// @brief Flags of `bgc_stop_ext`.
+typedef enum bgc_StopFlags {
+    /// @brief Tear down like `bgc_stop`.
+    BGC_STOP_DEFAULT = 0x0,
+    /// @brief Run the registered deconstructors, then free every allocation without sweeping.
+    BGC_STOP_FAST = 0x1,
+    /// @brief Do not run the caller's deconstructors *(implies `BGC_STOP_FAST`; mapped buffers and weak maps are still released)*.
+    BGC_STOP_SKIP_DTORS = 0x2,
+    /// @brief Leave the managed memory to the caller or the OS, only free the collector's own state *(implies `BGC_STOP_FAST`)*.
+    BGC_STOP_KEEP_MEMORY = 0x4
+} bgc_StopFlags;
+
+/// @brief Stop the garbage collector, optionally with a fast teardown.
+///
+/// A fast teardown does not unroot, mark or sweep: it runs the deconstructors
+/// from the finalizable list, frees every allocation in one pass over the
+/// buckets and releases the allocation objects slab by slab. Nothing is
+/// reachability-checked, so every deconstructor runs, reachable or not.
+/// @param gc The garbage collector to stop.
+/// @param flags A combination of `bgc_StopFlags`.
+/// @return The number of bytes freed *(0 with `BGC_STOP_KEEP_MEMORY`)*.
+PUBLIC size_t bgc_stop_ext(bgc_GC *gc, int flags);
+
 /// @brief Allocate managed memory.
 /// @param gc The garbage collector to use.
 /// @param size The size of the managed memory *(in bytes)* to allocate.
@@ -192,6 +857,27 @@ PUBLIC void * bgc_malloc_static(bgc_GC *gc, size_t size, bgc_Deconstructor dtor)
 /// @return A pointer to the allocated managed memory.
 PUBLIC void * bgc_malloc_ext(bgc_GC *gc, size_t size, bgc_Deconstructor dtor);
 
+/// @brief Allocate managed memory that holds no pointers to managed memory *(its contents are never scanned)*.
+/// @param gc The garbage collector to use.
+/// @param size The size of the managed memory *(in bytes)* to allocate.
+/// @return A pointer to the allocated managed memory.
+PUBLIC void * bgc_malloc_atomic(bgc_GC *gc, size_t size);
+
+/// @brief Allocate managed memory that holds no pointers to managed memory *(its contents are never scanned)*.
+/// @param gc The garbage collector to use.
+/// @param size The size of the managed memory *(in bytes)* to allocate.
+/// @param dtor The deconstructor to call after freeing the managed memory.
+/// @return A pointer to the allocated managed memory.
+PUBLIC void * bgc_malloc_atomic_ext(bgc_GC *gc, size_t size, bgc_Deconstructor dtor);
+
+/// @brief Allocate managed memory of which only the pointer slots described by `layout` are scanned.
+/// @param gc The garbage collector to use.
+/// @param size The size of the managed memory *(in bytes)* to allocate.
+/// @param layout The pointer slots of the memory's type. It has to outlive the allocation.
+/// @param dtor The deconstructor to call after freeing the managed memory.
+/// @return A pointer to the allocated managed memory.
+PUBLIC void * bgc_malloc_typed(bgc_GC *gc, size_t size, const bgc_Layout *layout, bgc_Deconstructor dtor);
+
 /// @brief Allocate multiple blocks of managed memory.
 /// @param gc The garbage collector to use.
 /// @param count The number of blocks to allocate.
@@ -207,7 +893,7 @@ PUBLIC void * bgc_calloc(bgc_GC *gc, size_t count, size_t size);
 /// @return A pointer to the allocated blocks of managed memory.
 PUBLIC void * bgc_calloc_ext(bgc_GC *gc, size_t count, size_t size, bgc_Deconstructor dtor);
 
-/// @brief Reallocate (resize) a block of managed memory.
+/// @brief Reallocate (resize) a block of managed memory *(growing blocks get spare capacity on glibc and macOS, so repeated growth is mostly in place)*.
 /// @param gc The garbage collector to use.
 /// @param ptr A pointer to the managed memory.
 /// @param size The number of bytes to allocate.
@@ -219,18 +905,95 @@ PUBLIC void * bgc_realloc(bgc_GC *gc, void *ptr, size_t size);
 /// @param ptr A pointer to the managed memory.
 PUBLIC void bgc_free(bgc_GC *gc, void *ptr);
 
+/// @brief Replace the deconstructor of managed memory.
+/// @param gc The garbage collector to use.
+/// @param ptr A pointer to the managed memory.
+/// @param dtor The deconstructor to call after freeing the managed memory *(may be `NULL`)*.
+/// @return `true` if `ptr` is managed by `gc` *(and the deconstructor could be registered)*.
+PUBLIC bool bgc_set_dtor(bgc_GC *gc, void *ptr, bgc_Deconstructor dtor);
+
 /// @brief Make a block of managed memory become static.
 /// @param gc The garbage collector to use.
 /// @param ptr A pointer to the managed memory.
 /// @return A pointer to the managed memory.
 PUBLIC void * bgc_make_static(bgc_GC *gc, void *ptr);
 
+/// @brief Register a range of foreign memory *(e.g. a static variable or a `malloc`ed structure)* as a root.
+/// @param gc The garbage collector to use.
+/// @param begin The first byte of the range.
+/// @param end One past the last byte of the range.
+/// @return `true` on success, `false` if out of memory *(the range is not rooted and must not hold the only reference to managed memory)*.
+PUBLIC bool bgc_add_roots(bgc_GC *gc, void *begin, void *end);
+
+/// @brief Stop scanning a range of memory that was previously registered as a root.
+/// @param gc The garbage collector to use.
+/// @param begin The first byte of the range.
+/// @param end One past the last byte of the range.
+PUBLIC void bgc_remove_roots(bgc_GC *gc, void *begin, void *end);
+
+/// @brief Register the executable's own data and BSS segments as roots.
+/// @param gc The garbage collector to use.
+/// @return Whether the segments could be located on this platform and registered.
+PUBLIC bool bgc_add_static_roots(bgc_GC *gc);
+
+/// @brief Enable or disable precise-roots mode.
+/// @param gc The garbage collector to use.
+/// @param enabled If `true`, only the shadow stack is scanned instead of the whole C stack.
+PUBLIC void bgc_set_precise_roots(bgc_GC *gc, bool enabled);
+
+/// @brief Back allocations and allocation map buckets of at least `BGC_HUGE_PAGE_SIZE` bytes with 2 MB-aligned regions advised for transparent huge pages.
+/// @param gc The garbage collector to use.
+/// @param enabled If `true`, large allocations get their own huge-page region *(`malloc` is used where huge pages are unavailable)*.
+/// @return Whether huge pages are supported on this platform.
+PUBLIC bool bgc_set_huge_pages(bgc_GC *gc, bool enabled);
+
+/// @brief Blacklist the addresses that conservative scans see near managed memory and keep the allocator from handing them out.
+///
+/// Marking only follows words that equal the address of an allocation. A
+/// word between allocations, e.g. a stale stack slot or an integer, retains
+/// nothing today, but retains whatever `malloc` returns at that address next.
+/// Each mark phase rebuilds the blacklist from such near misses; blocks the
+/// allocator gets for a blacklisted address are held back *(at most
+/// `BGC_BLACKLIST_HELD` blocks of `BGC_BLACKLIST_HELD_BYTES` in total)* and
+/// released once their address is no longer seen. Blacklisting is off by default.
+/// @param gc The garbage collector to use.
+/// @param enabled If `true`, near misses are recorded and avoided.
+PUBLIC void bgc_set_blacklisting(bgc_GC *gc, bool enabled);
+
+/// @brief Push a root slot onto the shadow stack.
+/// @param gc The garbage collector to use.
+/// @param slot The address of a variable that holds a pointer to managed memory.
+/// @return `true` on success, `false` if the shadow stack could not grow *(nothing was pushed)*.
+PUBLIC bool bgc_push_root(bgc_GC *gc, void **slot);
+
+/// @brief Pop root slots off the shadow stack.
+/// @param gc The garbage collector to use.
+/// @param count The number of root slots to pop.
+PUBLIC void bgc_pop_roots(bgc_GC *gc, size_t count);
+
+/// @brief Get the current depth of the shadow stack *(e.g. when entering a scope)*.
+/// @param gc The garbage collector to use.
+/// @return The number of root slots on the shadow stack.
+PUBLIC size_t bgc_get_root_depth(bgc_GC *gc);
+
+/// @brief Pop root slots off the shadow stack until it has the given depth *(e.g. when leaving a scope)*.
+/// @param gc The garbage collector to use.
+/// @param depth The depth previously returned by `bgc_get_root_depth`.
+PUBLIC void bgc_set_root_depth(bgc_GC *gc, size_t depth);
+
 /// @brief Returns a pointer to a null-terminated byte string, which is a duplicate of the string pointed to by `str1`.
 /// @param gc The garbage collector to use.
 /// @param str1 The string to duplicate.
 /// @return A duplicate of `str1`.
 PUBLIC char * bgc_strdup(bgc_GC *gc, const char *str1);
 
+/// @brief Returns the canonical managed copy of a string, so that equal strings can be compared by address *(unreachable copies are still collected)*.
+/// @param gc The garbage collector to use.
+/// @param str The string to intern *(it does not need to be null-terminated)*.
+/// @param len The length of `str` *(in bytes)*.
+/// @return The null-terminated canonical string *(not to be modified; freeing it with `bgc_free` removes it from the table)*, or `NULL` if out of memory.
+PUBLIC const char * bgc_intern(bgc_GC *gc, const char *str, size_t len);
+
 /// @brief Create a managed array.
 /// @param gc The garbage collector to use.
 /// @param tsize The size of an item contained within the array.
@@ -246,19 +1009,198 @@ PUBLIC bgc_Array * bgc_array(bgc_GC *gc, size_t tsize, size_t count);
 /// @return A pointer to the allocated managed array.
 PUBLIC bgc_Array * bgc_array_ext(bgc_GC *gc, size_t tsize, size_t count, bgc_Deconstructor dtor);
 
+/// @brief Create a managed array whose buffer and slots are part of its own allocation *(see `bgc_ArrayBlock`)*.
+/// @param gc The garbage collector to use.
+/// @param tsize The size of an item contained within the array.
+/// @param count The number of items the managed array can hold.
+/// @param dtor The deconstructor to call after freeing the managed memory.
+/// @return A pointer to the allocated managed array, or `NULL` if out of memory.
+PUBLIC bgc_Array * bgc_array_inline(bgc_GC *gc, size_t tsize, size_t count, bgc_Deconstructor dtor);
+
 /// @brief Create a managed buffer.
 /// @param gc The garbage collector to use.
 /// @param size The size of the buffer *(in bytes)* to allocate.
 /// @return A pointer to the allocated managed buffer.
 PUBLIC bgc_Buffer * bgc_buffer(bgc_GC *gc, size_t size);
 
-/// @brief Create a managed buffer.
+/// @brief Create a managed buffer *(the deconstructor is passed the data, not the buffer)*.
 /// @param gc The garbage collector to use.
 /// @param size The size of the buffer *(in bytes)* to allocate.
 /// @param dtor The deconstructor to call after freeing the managed memory.
 /// @return A pointer to the allocated managed buffer.
 PUBLIC bgc_Buffer * bgc_buffer_ext(bgc_GC *gc, size_t size, bgc_Deconstructor dtor);
 
+/// @brief Create a managed buffer whose data is part of its own allocation *(see `bgc_BufferBlock`)*.
+/// @param gc The garbage collector to use.
+/// @param size The size of the buffer *(in bytes)* to allocate.
+/// @return A pointer to the allocated managed buffer, or `NULL` if out of memory.
+PUBLIC bgc_Buffer * bgc_buffer_inline(bgc_GC *gc, size_t size);
+
+/// @brief Create a managed buffer whose data is a shared `mmap` of a file *(never scanned, unmapped when collected)*.
+/// @param gc The garbage collector to use.
+/// @param fd The file to map.
+/// @param offset The position in the file where the buffer starts *(need not be page-aligned)*.
+/// @param length The length of the buffer *(in bytes)*.
+/// @param prot The protection of the mapping *(`PROT_READ`, `PROT_WRITE`)*.
+/// @return A pointer to the managed buffer, or `NULL` if the file could not be mapped.
+PUBLIC bgc_Buffer * bgc_buffer_map_file(bgc_GC *gc, int fd, off_t offset, size_t length, int prot);
+
+/// @brief Create a managed vector.
+/// @param gc The garbage collector to use.
+/// @param tsize The size of an item contained within the vector.
+/// @param capacity The number of items to reserve room for.
+/// @return A pointer to the allocated managed vector, or `NULL` if out of memory.
+PUBLIC bgc_Vector * bgc_vector(bgc_GC *gc, size_t tsize, size_t capacity);
+
+/// @brief Make room for at least `capacity` items without changing the vector's size.
+/// @param gc The garbage collector that manages the vector.
+/// @param vector The vector to grow.
+/// @param capacity The number of items the vector should be able to hold.
+/// @return `true` on success, `false` if out of memory *(the vector is unchanged)*.
+PUBLIC bool bgc_vector_reserve(bgc_GC *gc, bgc_Vector *vector, size_t capacity);
+
+/// @brief Release the capacity the vector does not use.
+/// @param gc The garbage collector that manages the vector.
+/// @param vector The vector to shrink.
+/// @return `true` on success, `false` if out of memory *(the vector is unchanged)*.
+PUBLIC bool bgc_vector_shrink_to_fit(bgc_GC *gc, bgc_Vector *vector);
+
+/// @brief Append an item, doubling the capacity if the vector is full.
+/// @param gc The garbage collector that manages the vector.
+/// @param vector The vector to append to.
+/// @param item The item to copy into the vector, or `NULL` to append a zeroed item.
+/// @return A pointer to the new item in the vector, or `NULL` if out of memory.
+PUBLIC void * bgc_vector_push(bgc_GC *gc, bgc_Vector *vector, const void *item);
+
+/// @brief Remove the last item.
+/// @param vector The vector to remove the item from.
+/// @param item Where to copy the removed item to *(may be `NULL`)*.
+/// @return `true` if an item was removed, `false` if the vector was empty.
+PUBLIC bool bgc_vector_pop(bgc_Vector *vector, void *item);
+
+/// @brief Insert an item at `index`, moving the items after it up by one.
+/// @param gc The garbage collector that manages the vector.
+/// @param vector The vector to insert into.
+/// @param index The position of the new item *(at most the vector's size)*.
+/// @param item The item to copy into the vector, or `NULL` to insert a zeroed item.
+/// @return A pointer to the new item in the vector, or `NULL` if out of memory or `index` is out of range.
+PUBLIC void * bgc_vector_insert(bgc_GC *gc, bgc_Vector *vector, size_t index, const void *item);
+
+/// @brief Remove the item at `index`, moving the items after it down by one.
+/// @param vector The vector to remove the item from.
+/// @param index The position of the item to remove.
+/// @return `true` if an item was removed, `false` if `index` is out of range.
+PUBLIC bool bgc_vector_erase(bgc_Vector *vector, size_t index);
+
+/// @brief Append `count` items in one copy.
+/// @param gc The garbage collector that manages the vector.
+/// @param vector The vector to append to.
+/// @param items The items to copy *(may point into the vector itself)*.
+/// @param count The number of items to append.
+/// @return `true` on success, `false` if out of memory *(the vector is unchanged)*.
+PUBLIC bool bgc_vector_append(bgc_GC *gc, bgc_Vector *vector, const void *items, size_t count);
+
+/// @brief Create a managed copy of a vector with no spare capacity.
+/// @param gc The garbage collector to use.
+/// @param vector The vector to copy.
+/// @return A pointer to the new managed vector, or `NULL` if out of memory.
+PUBLIC bgc_Vector * bgc_vector_copy(bgc_GC *gc, const bgc_Vector *vector);
+
+/// @brief Create a managed weak reference *(it is cleared when its target is collected or freed with `bgc_free`)*.
+/// @param gc The garbage collector to use.
+/// @param target The managed memory to reference, or `NULL`.
+/// @return A pointer to the new weak reference, or `NULL` if out of memory.
+PUBLIC bgc_Weak * bgc_weak(bgc_GC *gc, void *target);
+
+/// @brief Get the target of a weak reference.
+/// @param weak The weak reference.
+/// @return The target, or `NULL` if it was collected.
+PUBLIC void * bgc_weak_get(const bgc_Weak *weak);
+
+/// @brief Create a managed weak map whose entries are dropped once their key is collected or freed with `bgc_free`.
+/// @param gc The garbage collector to use.
+/// @param capacity The number of entries to reserve room for.
+/// @return A pointer to the new weak map, or `NULL` if out of memory.
+PUBLIC bgc_WeakMap * bgc_weak_map(bgc_GC *gc, size_t capacity);
+
+/// @brief Insert or replace an entry; the value is kept alive as long as the key is reachable.
+/// @param map The weak map to insert into.
+/// @param key The managed memory to use as key *(not `NULL`)*.
+/// @param value The value to store.
+/// @return `true` on success, `false` if out of memory *(the map is unchanged)*.
+PUBLIC bool bgc_weak_map_put(bgc_WeakMap *map, void *key, void *value);
+
+/// @brief Look up the value stored for a key.
+/// @param map The weak map to search.
+/// @param key The key to look up.
+/// @return The value, or `NULL` if the map holds no entry for `key`.
+PUBLIC void * bgc_weak_map_get(const bgc_WeakMap *map, const void *key);
+
+/// @brief Remove the entry of a key.
+/// @param map The weak map to remove the entry from.
+/// @param key The key of the entry.
+/// @return `true` if an entry was removed, `false` if the map holds no entry for `key`.
+PUBLIC bool bgc_weak_map_remove(bgc_WeakMap *map, const void *key);
+
+#if !defined(BGC_NO_THREADS)
+/// @brief Create a sharded allocation map.
+/// @param shard_count The number of shards *(rounded up to a power of two)*.
+/// @param min_capacity The minimum capacity of each shard.
+/// @param capacity The initial capacity of each shard.
+/// @param sweep_factor The sweep factor of each shard.
+/// @param downsize_factor The down-size load factor of each shard.
+/// @param upsize_factor The up-size load factor of each shard.
+/// @return A pointer to the new sharded allocation map, or `NULL` if out of memory.
+PUBLIC bgc_ShardedAllocationMap * bgc_sharded_allocation_map_new(size_t shard_count, size_t min_capacity, size_t capacity, double sweep_factor, double downsize_factor, double upsize_factor);
+
+/// @brief Delete a sharded allocation map *(but not the memory it tracks)*.
+/// @param sam The sharded allocation map to delete.
+PUBLIC void bgc_sharded_allocation_map_delete(bgc_ShardedAllocationMap *sam);
+
+/// @brief Insert or update an allocation, locking only the shard that owns `ptr`.
+/// @param sam The sharded allocation map to use.
+/// @param ptr A pointer to the memory to track.
+/// @param size The size of the memory *(in bytes)*.
+/// @param dtor The deconstructor to call after freeing the memory.
+/// @return `true` if `ptr` is tracked, `false` if out of memory.
+PUBLIC bool bgc_sharded_allocation_map_put(bgc_ShardedAllocationMap *sam, void *ptr, size_t size, bgc_Deconstructor dtor);
+
+/// @brief Remove an allocation, locking only the shard that owns `ptr`.
+/// @param sam The sharded allocation map to use.
+/// @param ptr A pointer to the tracked memory.
+/// @param allow_resize Whether the shard may shrink after the removal.
+PUBLIC void bgc_sharded_allocation_map_remove(bgc_ShardedAllocationMap *sam, void *ptr, bool allow_resize);
+
+/// @brief Look up an allocation, locking only the shard that owns `ptr`.
+///
+/// Other threads may remove the allocation and reuse its allocation object as
+/// soon as the lock is released, so the allocation is copied out under the lock.
+/// @param sam The sharded allocation map to use.
+/// @param ptr A pointer to the tracked memory.
+/// @param alloc Set to a copy of the allocation *(its `next` is `NULL`)*, may be `NULL`.
+/// @return `true` if `ptr` is tracked.
+PUBLIC bool bgc_sharded_allocation_map_find(bgc_ShardedAllocationMap *sam, void *ptr, bgc_Allocation *alloc);
+
+/// @brief Look up an allocation without locking *(only while frozen by `bgc_sharded_allocation_map_lock_all`, the result is valid until it is thawed)*.
+/// @param sam The sharded allocation map to use.
+/// @param ptr A pointer to the tracked memory.
+/// @return The allocation object for `ptr`, or `NULL`.
+PUBLIC bgc_Allocation * bgc_sharded_allocation_map_get(bgc_ShardedAllocationMap *sam, void *ptr);
+
+/// @brief Freeze a sharded allocation map by taking every shard lock *(e.g. before marking)*.
+/// @param sam The sharded allocation map to freeze.
+PUBLIC void bgc_sharded_allocation_map_lock_all(bgc_ShardedAllocationMap *sam);
+
+/// @brief Release every shard lock taken by `bgc_sharded_allocation_map_lock_all`.
+/// @param sam The sharded allocation map to thaw.
+PUBLIC void bgc_sharded_allocation_map_unlock_all(bgc_ShardedAllocationMap *sam);
+
+/// @brief Count the allocations in a sharded allocation map.
+/// @param sam The sharded allocation map to use.
+/// @return The number of allocations.
+PUBLIC size_t bgc_sharded_allocation_map_size(bgc_ShardedAllocationMap *sam);
+#endif // BGC_NO_THREADS
+
 /// @brief Create a managed array.
 /// @param gc The garbage collector to use.
 /// @param T The type of an item contained within the array.
@@ -306,6 +1248,23 @@ void bgc_destroy_array(bgc_Array *array);
 /// @return A pointer to the allocated managed object.
 #define bgcx_var(T, name)       bgcx_var_ext(BGC_GLOBAL_GC, T, name, NULL)
 
+/// @brief Store a pointer into a field of a managed object, recording the edge if recording is on.
+/// @param gc The garbage collector to use.
+/// @param obj The managed object that contains the field.
+/// @param field The field *(a pointer lvalue inside `obj`, evaluated once)* to store to.
+/// @param value The pointer to store.
+#define bgcx_store_ext(gc, obj, field, value)   do {\
+                                        void **bgc__slot = (void **) &(field);\
+                                        *bgc__slot = (void *) (value);\
+                                        bgc_record_write(gc, obj, bgc__slot, *bgc__slot);\
+                                        } while (0)
+
+/// @brief Store a pointer into a field of a managed object, recording the edge if recording is on.
+/// @param obj The managed object that contains the field.
+/// @param field The field *(an lvalue inside `obj`)* to store to.
+/// @param value The pointer to store.
+#define bgcx_store(obj, field, value)   bgcx_store_ext(BGC_GLOBAL_GC, obj, field, value)
+
 // Auxilary API macros
 
 /// @brief Begin the global garbage collector for all single-threaded applications.
@@ -325,6 +1284,17 @@ void bgc_destroy_array(bgc_Array *array);
 #define bgcx_free_array(T, array)       bgc_free_array(BGC_GLOBAL_GC, array)
 #define bgcx_malloc_array(T, count)     bgc_malloc_array(BGC_GLOBAL_GC, sizeof(T), count)
 #define bgcx_realloc(ptr, size)         bgc_realloc(BGC_GLOBAL_GC, ptr, size)
+#define bgcx_add_roots(begin, end)      bgc_add_roots(BGC_GLOBAL_GC, begin, end)
+#define bgcx_remove_roots(begin, end)   bgc_remove_roots(BGC_GLOBAL_GC, begin, end)
+
+/// @brief Push the address of the pointer variable `ptr` onto the global garbage collector's shadow stack.
+#define BGCX_ROOT(ptr)                  bgc_push_root(BGC_GLOBAL_GC, (void **) &(ptr))
+/// @brief Pop `count` root slots off the global garbage collector's shadow stack.
+#define BGCX_UNROOT(count)              bgc_pop_roots(BGC_GLOBAL_GC, count)
+/// @brief Remember the shadow stack depth at the start of a scope.
+#define BGCX_ROOT_SCOPE                 size_t bgc__root_depth = bgc_get_root_depth(BGC_GLOBAL_GC)
+/// @brief Pop every root slot pushed since the matching `BGCX_ROOT_SCOPE`.
+#define BGCX_END_ROOT_SCOPE             bgc_set_root_depth(BGC_GLOBAL_GC, bgc__root_depth)
 
 #define bgcx_create_stack()             void *_BGCX_STACK_BP = NULL
 #define BGCX_CREATE_STACK               bgcx_create_stack()
@@ -333,6 +1303,21 @@ void bgc_destroy_array(bgc_Array *array);
 
 #define bgcx_array_get(array, index, T)             (((T *)(array->buffer->address))[index])
 #define bgcx_array_set(array, index, T, value)      (bgcx_array_get(array, index, T) = value)
+/// @brief The slots of an array created by `bgc_array_inline`, found without loading `array->buffer->address`.
+#define bgcx_array_data(array, T)                   ((T *)(((bgc_ArrayBlock *)(array))->data))
+#define bgcx_array_at(array, index, T)              (bgcx_array_data(array, T)[index])
+/// @brief The data of a buffer created by `bgc_buffer_inline`, found without loading `buffer->address`.
+#define bgcx_buffer_data(buffer, T)                 ((T *)(((bgc_BufferBlock *)(buffer))->data))
+
+#define bgcx_vector(T, capacity)                    bgc_vector(BGC_GLOBAL_GC, sizeof(T), capacity)
+#define bgcx_vector_get(vector, index, T)           (((T *)((vector)->data))[index])
+#define bgcx_vector_set(vector, index, T, value)    (bgcx_vector_get(vector, index, T) = value)
+#define bgcx_vector_push(vector, item)              bgc_vector_push(BGC_GLOBAL_GC, vector, item)
+#define bgcx_vector_append(vector, items, count)    bgc_vector_append(BGC_GLOBAL_GC, vector, items, count)
+
+#define bgcx_weak(target)                           bgc_weak(BGC_GLOBAL_GC, target)
+#define bgcx_weak_map(capacity)                     bgc_weak_map(BGC_GLOBAL_GC, capacity)
+#define bgcx_intern(str, len)                       bgc_intern(BGC_GLOBAL_GC, str, len)
 
 // Auxilary API macros (exclusive to C)
 #if !defined(__cplusplus)
@@ -1,8 +1,349 @@
 #if !defined(BGC__BGC_HPP)
 #define BGC__BGC_HPP
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
 #include <bgc.h>
 
-#define bgcxx_new(T)     new (bgc_malloc_ext(BGC_GLOBAL_GC, sizeof(T), ([](void *this_){ std::destroy_at<T>((T *)(this_)); }))) T
+#define BGC__CONCAT_(a, b)      a##b
+#define BGC__CONCAT(a, b)       BGC__CONCAT_(a, b)
+
+#define bgcxx_new(T)     new (::bgc::allocate<T>(BGC_GLOBAL_GC, ::bgc::deconstructor<T>())) T
+
+/*
+ * BGC__FOR_EACH(M, T, a, b, ...) expands to M(T, a) M(T, b) ... for up to 16 arguments.
+ */
+#define BGC__FE_1(M, T, a)          M(T, a)
+#define BGC__FE_2(M, T, a, ...)     M(T, a) BGC__FE_1(M, T, __VA_ARGS__)
+#define BGC__FE_3(M, T, a, ...)     M(T, a) BGC__FE_2(M, T, __VA_ARGS__)
+#define BGC__FE_4(M, T, a, ...)     M(T, a) BGC__FE_3(M, T, __VA_ARGS__)
+#define BGC__FE_5(M, T, a, ...)     M(T, a) BGC__FE_4(M, T, __VA_ARGS__)
+#define BGC__FE_6(M, T, a, ...)     M(T, a) BGC__FE_5(M, T, __VA_ARGS__)
+#define BGC__FE_7(M, T, a, ...)     M(T, a) BGC__FE_6(M, T, __VA_ARGS__)
+#define BGC__FE_8(M, T, a, ...)     M(T, a) BGC__FE_7(M, T, __VA_ARGS__)
+#define BGC__FE_9(M, T, a, ...)     M(T, a) BGC__FE_8(M, T, __VA_ARGS__)
+#define BGC__FE_10(M, T, a, ...)    M(T, a) BGC__FE_9(M, T, __VA_ARGS__)
+#define BGC__FE_11(M, T, a, ...)    M(T, a) BGC__FE_10(M, T, __VA_ARGS__)
+#define BGC__FE_12(M, T, a, ...)    M(T, a) BGC__FE_11(M, T, __VA_ARGS__)
+#define BGC__FE_13(M, T, a, ...)    M(T, a) BGC__FE_12(M, T, __VA_ARGS__)
+#define BGC__FE_14(M, T, a, ...)    M(T, a) BGC__FE_13(M, T, __VA_ARGS__)
+#define BGC__FE_15(M, T, a, ...)    M(T, a) BGC__FE_14(M, T, __VA_ARGS__)
+#define BGC__FE_16(M, T, a, ...)    M(T, a) BGC__FE_15(M, T, __VA_ARGS__)
+#define BGC__FE_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define BGC__FE_COUNT(...)          BGC__FE_COUNT_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
+#define BGC__FOR_EACH(M, T, ...)    BGC__CONCAT(BGC__FE_, BGC__FE_COUNT(__VA_ARGS__))(M, T, __VA_ARGS__)
+
+#define BGC__TRACE_SLOT(T, field)   ::bgc::detail::slot { offsetof(T, field), sizeof(T::field) },
+
+/// @brief Declare the fields of `T` that hold pointers to managed memory *(pointers, `gc_ptr`s or arrays of them)*.
+/// @details Use it at global scope. Objects created by `bgcxx_new` and `make_gc` then only have these fields scanned,
+///          from a bitmap computed at compile time: `BGC_TRACE(Node, left, right);`
+#define BGC_TRACE(T, ...) \
+    template <> \
+    struct bgc::traced<T> : std::true_type { \
+        static const bgc_Layout * layout() { \
+            static constexpr ::bgc::detail::slot slots[] = { BGC__FOR_EACH(BGC__TRACE_SLOT, T, __VA_ARGS__) }; \
+            static constexpr auto bitmap = ::bgc::detail::make_bitmap<sizeof(T)>(slots); \
+            static const bgc_Layout layout = { sizeof(T), bitmap.data() }; \
+            return &layout; \
+        } \
+    }
+
+namespace bgc {
+
+/// @brief Pops every shadow stack slot pushed during its lifetime when it goes out of scope.
+class root_scope {
+public:
+    explicit root_scope(bgc_GC *gc = BGC_GLOBAL_GC) : gc_(gc), depth_(bgc_get_root_depth(gc)) {}
+    ~root_scope() { bgc_set_root_depth(gc_, depth_); }
+
+    root_scope(const root_scope &) = delete;
+    root_scope & operator=(const root_scope &) = delete;
+
+private:
+    bgc_GC *gc_;
+    std::size_t depth_;
+};
+
+/// @brief Keeps a pointer variable on the shadow stack for as long as the guard is in scope.
+/// @details Throws `std::bad_alloc` if the shadow stack cannot grow.
+class root_guard {
+public:
+    explicit root_guard(void **slot, bgc_GC *gc = BGC_GLOBAL_GC) : gc_(gc) {
+        if (!bgc_push_root(gc_, slot)) {
+            throw std::bad_alloc();
+        }
+    }
+    ~root_guard() { bgc_pop_roots(gc_, 1); }
+
+    root_guard(const root_guard &) = delete;
+    root_guard & operator=(const root_guard &) = delete;
+
+private:
+    bgc_GC *gc_;
+};
+
+/// @brief A typed handle to a managed `bgc_Vector`. Copying the handle shares the vector, use `copy()` for a new one.
+/// @details Items are moved with `memcpy`, so `T` has to be trivially copyable. The handle is an ordinary pointer to
+///          the collector: with precise roots enabled, root it with `root_guard(v.root_slot())`.
+template <typename T>
+class vector {
+    static_assert(std::is_trivially_copyable<T>::value, "bgc::vector moves its items with memcpy");
+
+public:
+    using value_type = T;
+    using iterator = T *;
+    using const_iterator = const T *;
+
+    explicit vector(std::size_t capacity = 0, bgc_GC *gc = BGC_GLOBAL_GC)
+        : gc_(gc), vector_(bgc_vector(gc, sizeof(T), capacity)) {
+        if (!vector_) {
+            throw std::bad_alloc();
+        }
+    }
+
+    /// @brief Wrap an existing managed vector of `T`.
+    explicit vector(bgc_Vector *vector, bgc_GC *gc = BGC_GLOBAL_GC) : gc_(gc), vector_(vector) {}
+
+    T * data() { return static_cast<T *>(vector_->data); }
+    const T * data() const { return static_cast<const T *>(vector_->data); }
+    std::size_t size() const { return vector_->size; }
+    std::size_t capacity() const { return vector_->capacity; }
+    bool empty() const { return vector_->size == 0; }
+
+    T & operator[](std::size_t index) { return data()[index]; }
+    const T & operator[](std::size_t index) const { return data()[index]; }
+    T & back() { return data()[size() - 1]; }
+
+    iterator begin() { return data(); }
+    iterator end() { return data() + size(); }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return data() + size(); }
+
+    void reserve(std::size_t capacity) { check(bgc_vector_reserve(gc_, vector_, capacity)); }
+    void shrink_to_fit() { check(bgc_vector_shrink_to_fit(gc_, vector_)); }
+    void push_back(const T &value) { check(bgc_vector_push(gc_, vector_, &value)); }
+    void pop_back() { bgc_vector_pop(vector_, nullptr); }
+    iterator insert(std::size_t index, const T &value) {
+        if (index > size()) {
+            throw std::out_of_range("bgc::vector::insert");
+        }
+        return static_cast<T *>(check(bgc_vector_insert(gc_, vector_, index, &value)));
+    }
+    void erase(std::size_t index) { bgc_vector_erase(vector_, index); }
+    void append(const T *items, std::size_t count) { check(bgc_vector_append(gc_, vector_, items, count)); }
+
+    /// @brief Create a managed copy of the vector.
+    vector copy() const { return vector(check(bgc_vector_copy(gc_, vector_)), gc_); }
+
+    bgc_Vector * get() const { return vector_; }
+    void ** root_slot() { return reinterpret_cast<void **>(&vector_); }
+
+private:
+    template <typename R>
+    static R check(R result) {
+        if (!result) {
+            throw std::bad_alloc();
+        }
+        return result;
+    }
+
+    bgc_GC *gc_;
+    bgc_Vector *vector_;
+};
+
+/// @brief The deconstructor trampoline of `T`, shared by every managed `T`.
+template <typename T>
+void destroy(void *ptr) { std::destroy_at(static_cast<T *>(ptr)); }
+
+/// @brief The deconstructor to register for a managed `T`, `nullptr` if `T` is trivially destructible.
+template <typename T>
+constexpr bgc_Deconstructor deconstructor() {
+    return std::is_trivially_destructible<T>::value ? nullptr : &destroy<T>;
+}
+
+/// @brief Whether a `T` holds no pointers to managed memory, so that its memory never has to be scanned.
+/// @details True for arithmetic and enum types and arrays of them. Specialize it for pointer-free classes.
+template <typename T>
+struct is_pointer_free : std::integral_constant<bool, std::is_arithmetic<T>::value || std::is_enum<T>::value> {};
+
+template <typename T, std::size_t N>
+struct is_pointer_free<T[N]> : is_pointer_free<T> {};
+
+/// @brief The pointer slots of `T` declared with `BGC_TRACE`, a `nullptr` layout scans every word.
+template <typename T>
+struct traced : std::false_type {
+    static const bgc_Layout * layout() { return nullptr; }
+};
+
+namespace detail {
+
+/// @brief A field declared with `BGC_TRACE`.
+struct slot {
+    std::size_t offset;
+    std::size_t size;
+};
+
+/// @brief The layout bitmap of a `Size` bytes type with pointers in `slots`.
+template <std::size_t Size, std::size_t N>
+constexpr std::array<std::uintptr_t, (Size / sizeof(void *) + BGC_LAYOUT_BITS - 1) / BGC_LAYOUT_BITS>
+make_bitmap(const slot (&slots)[N]) {
+    std::array<std::uintptr_t, (Size / sizeof(void *) + BGC_LAYOUT_BITS - 1) / BGC_LAYOUT_BITS> bitmap {};
+    for (const slot &field : slots) {
+        if (field.offset % sizeof(void *) != 0 || field.size % sizeof(void *) != 0) {
+            throw "BGC_TRACE fields have to be aligned pointers";
+        }
+        for (std::size_t word = field.offset / sizeof(void *); word < (field.offset + field.size) / sizeof(void *); ++word) {
+            bitmap[word / BGC_LAYOUT_BITS] |= std::uintptr_t(1) << (word % BGC_LAYOUT_BITS);
+        }
+    }
+    return bitmap;
+}
+
+} // namespace detail
+
+/// @brief Allocate managed memory for a `T`: never scanned if `T` is pointer-free, else only its traced fields.
+template <typename T>
+void * allocate(bgc_GC *gc, bgc_Deconstructor dtor) {
+    if (is_pointer_free<T>::value) {
+        return bgc_malloc_atomic_ext(gc, sizeof(T), dtor);
+    }
+    return bgc_malloc_typed(gc, sizeof(T), traced<T>::layout(), dtor);
+}
+
+/// @brief A pointer to a managed object.
+/// @details A `gc_ptr` is a plain pointer, nothing is counted: the object lives as long as the collector finds a
+///          pointer to it. With precise roots enabled, root local `gc_ptr`s with `root_guard(p.root_slot())`.
+template <typename T>
+class gc_ptr {
+public:
+    using element_type = T;
+
+    constexpr gc_ptr() noexcept : ptr_(nullptr) {}
+    constexpr gc_ptr(std::nullptr_t) noexcept : ptr_(nullptr) {}
+    explicit gc_ptr(T *ptr) noexcept : ptr_(ptr) {}
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+    gc_ptr(const gc_ptr<U> &other) noexcept : ptr_(other.get()) {}
+
+    T * get() const noexcept { return ptr_; }
+    T & operator*() const noexcept { return *ptr_; }
+    T * operator->() const noexcept { return ptr_; }
+    explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+    void ** root_slot() noexcept { return reinterpret_cast<void **>(&ptr_); }
+
+private:
+    T *ptr_;
+};
+
+template <typename T, typename U>
+bool operator==(const gc_ptr<T> &a, const gc_ptr<U> &b) noexcept { return a.get() == b.get(); }
+template <typename T, typename U>
+bool operator!=(const gc_ptr<T> &a, const gc_ptr<U> &b) noexcept { return a.get() != b.get(); }
+template <typename T>
+bool operator==(const gc_ptr<T> &a, std::nullptr_t) noexcept { return !a; }
+template <typename T>
+bool operator!=(const gc_ptr<T> &a, std::nullptr_t) noexcept { return static_cast<bool>(a); }
+
+/// @brief Create a managed `T` from `args` in memory from `allocate<T>`.
+/// @details If the constructor throws, the memory is freed without running the deconstructor. Throws
+///          `std::bad_alloc` if the memory or the shadow stack slot that keeps it alive cannot be allocated.
+template <typename T, typename... Args>
+gc_ptr<T> make_gc_ext(bgc_GC *gc, Args &&... args) {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "bgc only returns malloc-aligned memory");
+    constexpr bgc_Deconstructor dtor = deconstructor<T>();
+    constexpr bool nothrow = std::is_nothrow_constructible<T, Args &&...>::value;
+    // A constructor that may throw gets the deconstructor only once the object exists
+    void *memory = allocate<T>(gc, nothrow ? dtor : nullptr);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+    // The constructor may allocate and collect, keep the memory alive in precise mode
+    root_scope scope(gc);
+    if (!bgc_push_root(gc, &memory)) {
+        // Nothing was constructed yet, free the memory without running the deconstructor
+        bgc_set_dtor(gc, memory, nullptr);
+        bgc_free(gc, memory);
+        throw std::bad_alloc();
+    }
+    if (nothrow) {
+        return gc_ptr<T>(::new (memory) T(std::forward<Args>(args)...));
+    }
+    T *object;
+    try {
+        object = ::new (memory) T(std::forward<Args>(args)...);
+    } catch (...) {
+        bgc_free(gc, memory);
+        throw;
+    }
+    if (!std::is_trivially_destructible<T>::value) {
+        bgc_set_dtor(gc, memory, dtor);
+    }
+    return gc_ptr<T>(object);
+}
+
+/// @brief Create a managed `T` from `args` with the global garbage collector.
+template <typename T, typename... Args>
+gc_ptr<T> make_gc(Args &&... args) {
+    return make_gc_ext<T>(BGC_GLOBAL_GC, std::forward<Args>(args)...);
+}
+
+/// @brief A standard allocator whose storage is scanned for pointers to managed objects.
+/// @details The storage is a root that is never collected, the container frees it. Containers of pointer-free types
+///          use plain `operator new` storage, as nothing in it has to be scanned.
+template <typename T>
+class allocator {
+public:
+    using value_type = T;
+
+    allocator() noexcept : gc_(BGC_GLOBAL_GC) {}
+    explicit allocator(bgc_GC *gc) noexcept : gc_(gc) {}
+    template <typename U>
+    allocator(const allocator<U> &other) noexcept : gc_(other.gc()) {}
+
+    T * allocate(std::size_t n) {
+        if (n > static_cast<std::size_t>(-1) / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        if (is_pointer_free<T>::value) {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+        void *memory = bgc_malloc_static(gc_, n * sizeof(T), nullptr);
+        if (!memory) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(memory);
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept {
+        if (is_pointer_free<T>::value) {
+            ::operator delete(ptr);
+        } else {
+            bgc_free(gc_, ptr);
+        }
+    }
+
+    bgc_GC * gc() const noexcept { return gc_; }
+
+private:
+    bgc_GC *gc_;
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T> &a, const allocator<U> &b) noexcept { return a.gc() == b.gc(); }
+template <typename T, typename U>
+bool operator!=(const allocator<T> &a, const allocator<U> &b) noexcept { return a.gc() != b.gc(); }
+
+} // namespace bgc
+
+/// @brief Root the pointer variable `ptr` until the end of the enclosing C++ scope.
+#define BGCXX_ROOT(ptr)     ::bgc::root_guard BGC__CONCAT(bgc__root_guard_, __COUNTER__)((void **) &(ptr))
 
 #endif // BGC__BGC_HPP
@@ -6,9 +6,57 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "../include/bgc.h"
 
+#if !defined(BGC_NO_THREADS)
+#include <pthread.h>
+#endif
+
+/*
+ * Locating the executable's data and BSS segments for `bgc_add_static_roots`.
+ */
+#if defined(__linux__)
+#include <elf.h>
+#include <sys/auxv.h>
+#elif defined(__APPLE__)
+#include <mach-o/dyld.h>
+#include <mach-o/getsect.h>
+#endif
+
+/*
+ * Mapping files into managed buffers for `bgc_buffer_map_file`.
+ */
+#if defined(__unix__) || defined(__APPLE__)
+#define BGC_HAVE_MMAP 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Transparent huge pages for `bgc_set_huge_pages` (Linux only).
+ */
+#if defined(BGC_HAVE_MMAP) && defined(MADV_HUGEPAGE)
+#define BGC_HAVE_HUGE_PAGES 1
+#endif
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+#define BGC_HAVE_BACKTRACE 1
+#include <execinfo.h>
+#endif
+
+/*
+ * Querying the spare capacity of a malloc'd block for in-place `bgc_realloc`.
+ */
+#if defined(__GLIBC__)
+#define BGC_HAVE_USABLE_SIZE 1
+#include <malloc.h>
+#elif defined(__APPLE__)
+#define BGC_HAVE_USABLE_SIZE 1
+#include <malloc/malloc.h>
+#endif
+
 #define LOGLEVEL LOGLEVEL_DEBUG
 
 typedef enum bgc_LogLevel {
@@ -68,6 +116,44 @@ PRIVATE bgc_LogLevel log(bgc_LogLevel log_level, ...)
 bgc_GC *BGC_GLOBAL_GC;
 #endif
 
+#if !defined(BGC_NO_THREADS)
+
+/// @brief The assumed size of a cache line, used to keep shard locks apart.
+#define BGC_CACHE_LINE 64
+
+/// @brief A single lock-protected partition of a sharded allocation map.
+typedef union bgc_AllocationMapShard {
+    struct {
+        pthread_mutex_t lock;
+        bgc_AllocationMap *map;
+    } s;
+    /* Pad every shard to whole cache lines to avoid false sharing */
+    char pad[((sizeof(pthread_mutex_t) + sizeof(void *)) / BGC_CACHE_LINE + 1) * BGC_CACHE_LINE];
+} bgc_AllocationMapShard;
+
+struct bgc_ShardedAllocationMap {
+    size_t shard_count;
+    size_t shard_bits;
+    bgc_AllocationMapShard *shards;
+};
+
+#endif // BGC_NO_THREADS
+
+/*
+ * Trace events are emitted at the start and at the end of each collector
+ * phase if a callback is registered. Use the BGC_NO_TRACING flag to compile
+ * them out entirely.
+ */
+#if !defined(BGC_NO_TRACING)
+#define BGC_EVENT(tracer, phase, begin, count) \
+    do { if ((tracer) && (tracer)->callback) bgc_trace_emit(tracer, phase, begin, count); } while (0)
+#else
+#define BGC_EVENT(tracer, phase, begin, count) ((void) sizeof(tracer), (void) sizeof(count))
+#endif // BGC_NO_TRACING
+
+#define BGC_EVENT_BEGIN(tracer, phase, count) BGC_EVENT(tracer, phase, true, count)
+#define BGC_EVENT_END(tracer, phase, count) BGC_EVENT(tracer, phase, false, count)
+
 PRIVATE void bgc__array_set_buffer(bgc_Array *array, bgc_Buffer * value);
 
 PRIVATE void bgc__array_set_slot_count(bgc_Array *array, size_t value);
@@ -78,6 +164,8 @@ PRIVATE void bgc__buffer_set_address(bgc_Buffer *buffer, void * value);
 
 PRIVATE void bgc__buffer_set_length(bgc_Buffer *buffer, size_t value);
 
+PUBLIC size_t bgc_sweep(bgc_GC *gc);
+
 PRIVATE bool is_prime(size_t n) {
     /* https://stackoverflow.com/questions/1538644/c-determine-if-a-number-is-prime */
     if (n <= 3)
@@ -98,23 +186,246 @@ PRIVATE size_t next_prime(size_t n) {
     return n;
 }
 
+/**
+ * Read a monotonic clock.
+ *
+ * @returns The current time in nanoseconds since an arbitrary epoch.
+ */
+PUBLIC uint64_t bgc_now_ns(void) {
+    struct timespec ts;
+#if defined(_MSC_VER)
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * UINT64_C(1000000000) + (uint64_t) ts.tv_nsec;
+}
+
+#if !defined(BGC_NO_TRACING)
+PRIVATE void bgc_trace_emit(const bgc_Tracer *tracer, bgc_Phase phase, bool begin, size_t count) {
+    bgc_TraceEvent event;
+    event.phase = phase;
+    event.begin = begin;
+    event.timestamp_ns = bgc_now_ns();
+    event.count = count;
+    tracer->callback(&event, tracer->ctx);
+}
+#endif // BGC_NO_TRACING
+
+/**
+ * Determine the current load factor of an `AllocationMap`.
+ *
+ * Calculates the load factor of the hash map as the quotient of the size and
+ * the capacity of the hash map.
+ *
+ * @param am The allocationo map to calculate the load factor for.
+ * @returns The load factor of the allocation map `am`.
+ */
+PRIVATE double bgc_allocation_map_load_factor(bgc_AllocationMap * am) {
+    return (double) am->size / (double) am->capacity;
+}
+
+/**
+ * Round a size up to a multiple of `BGC_HUGE_PAGE_SIZE`.
+ *
+ * @returns The rounded size, or 0 if it does not fit into a `size_t`.
+ */
+PRIVATE size_t bgc_huge_region_size(size_t size) {
+    if (size > SIZE_MAX - (BGC_HUGE_PAGE_SIZE - 1)) {
+        return 0;
+    }
+    return (size + BGC_HUGE_PAGE_SIZE - 1) & ~((size_t) BGC_HUGE_PAGE_SIZE - 1);
+}
+
+/**
+ * Allocate zeroed memory in its own huge-page region.
+ *
+ * The region is `BGC_HUGE_PAGE_SIZE`-aligned and advised with
+ * `MADV_HUGEPAGE`, so that the kernel can back it with 2 MB pages and
+ * walking it costs one TLB entry per 2 MB instead of per 4 KB.
+ *
+ * @param size The number of bytes to allocate.
+ * @returns The region, or `NULL` if huge pages are unavailable (the caller
+ *          falls back to `malloc`).
+ */
+PRIVATE void * bgc_huge_alloc(size_t size) {
+#if defined(BGC_HAVE_HUGE_PAGES)
+    size_t length = bgc_huge_region_size(size);
+    if (!length || length > SIZE_MAX - BGC_HUGE_PAGE_SIZE) {
+        return NULL;
+    }
+    /* Map one huge page more than needed and trim the ends to the aligned region */
+    char *raw = (char *) mmap(NULL, length + BGC_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *region = (char *) (((uintptr_t) raw + BGC_HUGE_PAGE_SIZE - 1) & ~((uintptr_t) BGC_HUGE_PAGE_SIZE - 1));
+    size_t head = (size_t) (region - raw);
+    if (head) {
+        munmap(raw, head);
+    }
+    if (head < BGC_HUGE_PAGE_SIZE) {
+        munmap(region + length, BGC_HUGE_PAGE_SIZE - head);
+    }
+    if (madvise(region, length, MADV_HUGEPAGE) != 0) {
+        /* THP is compiled out or disabled, plain malloc does as well */
+        munmap(region, length);
+        return NULL;
+    }
+    return region;
+#else
+    (void) size;
+    return NULL;
+#endif
+}
+
+/** Unmap a region allocated by `bgc_huge_alloc(size)`. */
+PRIVATE void bgc_huge_free(void *ptr, size_t size) {
+#if defined(BGC_HAVE_HUGE_PAGES)
+    munmap(ptr, bgc_huge_region_size(size));
+#else
+    (void) ptr, (void) size;
+#endif
+}
+
+/**
+ * Allocate memory aligned to `alignment`, a power of two that divides `size`.
+ *
+ * MSVC has no C11 `aligned_alloc`, its aligned blocks must be released
+ * with `bgc_aligned_free`.
+ */
+PRIVATE void * bgc_aligned_alloc(size_t alignment, size_t size) {
+#if defined(_MSC_VER)
+    return _aligned_malloc(size, alignment);
+#else
+    return aligned_alloc(alignment, size);
+#endif
+}
+
+/** Free a block allocated by `bgc_aligned_alloc`. */
+PRIVATE void bgc_aligned_free(void *ptr) {
+#if defined(_MSC_VER)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+/**
+ * Allocate the zeroed bucket array of an allocation map.
+ *
+ * @param huge_pages Whether a large array may be a huge-page region.
+ * @param capacity The number of buckets.
+ * @param huge Set to whether the array is a huge-page region.
+ * @returns The bucket array, or `NULL` if out of memory.
+ */
+PRIVATE bgc_Allocation ** bgc_allocation_map_buckets_new(bool huge_pages, size_t capacity, bool *huge) {
+    bgc_Allocation **buckets = NULL;
+    if (huge_pages && capacity >= BGC_HUGE_PAGE_SIZE / sizeof(bgc_Allocation *)) {
+        buckets = (bgc_Allocation **) bgc_huge_alloc(capacity * sizeof(bgc_Allocation *));
+    }
+    *huge = buckets != NULL;
+    return buckets ? buckets : (bgc_Allocation **) calloc(capacity, sizeof(bgc_Allocation *));
+}
+
+PRIVATE void bgc_allocation_map_buckets_delete(bgc_Allocation **buckets, size_t capacity, bool huge) {
+    if (huge) {
+        bgc_huge_free(buckets, capacity * sizeof(bgc_Allocation *));
+    } else {
+        free(buckets);
+    }
+}
+
+/** The size and alignment of a slab, so that an allocation object finds its slab by masking. */
+#define BGC_SLAB_SIZE ((size_t) 64 * 1024)
+
+/** A block of allocation objects, owned by one allocation map. */
+typedef struct bgc_AllocationSlab {
+    struct bgc_AllocationSlab *prev;    // in the full or spare list of the map
+    struct bgc_AllocationSlab *next;
+    bgc_Allocation *spare;              // allocation objects free for reuse, linked through `next`
+    size_t live;                        // allocation objects in use
+    bgc_Allocation allocs[];
+} bgc_AllocationSlab;
+
+/** The number of allocation objects carved from one slab. */
+#define BGC_SLAB_ALLOCATIONS ((BGC_SLAB_SIZE - sizeof(bgc_AllocationSlab)) / sizeof(bgc_Allocation))
+
+PRIVATE bgc_AllocationSlab * bgc_allocation_slab(bgc_Allocation *a) {
+    return (bgc_AllocationSlab *) ((uintptr_t) a & ~(uintptr_t) (BGC_SLAB_SIZE - 1));
+}
+
+PRIVATE void bgc_allocation_slab_unlink(bgc_AllocationSlab **list, bgc_AllocationSlab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+PRIVATE void bgc_allocation_slab_link(bgc_AllocationSlab **list, bgc_AllocationSlab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+PRIVATE void bgc_allocation_slabs_delete(bgc_AllocationSlab *slab) {
+    while (slab) {
+        bgc_AllocationSlab *next = slab->next;
+        bgc_aligned_free(slab);
+        slab = next;
+    }
+}
+
 /**
  * Create a new allocation object.
  *
- * Creates a new allocation object using the system `malloc`.
+ * Allocation objects are carved from the slabs of an allocation map and
+ * recycled through a free list per slab, so that a put costs no `malloc` and
+ * deleting the map frees one block per `BGC_SLAB_ALLOCATIONS` objects instead
+ * of every object on its own.
  *
+ * @param[in] am The allocation map that will own the allocation object.
  * @param[in] ptr The pointer to the memory to manage.
  * @param[in] size The size of the memory range pointed to by `ptr`.
  * @param[in] dtor A pointer to a destructor function that should be called
  *                 before freeing the memory pointed to by `ptr`.
- * @returns Pointer to the new allocation instance.
+ * @returns Pointer to the new allocation instance, or `NULL` if out of memory.
  */
-PRIVATE bgc_Allocation * bgc_allocation_new(void *ptr, size_t size, bgc_Deconstructor dtor) {
-    bgc_Allocation *a = (bgc_Allocation*) malloc(sizeof(bgc_Allocation));
+PRIVATE bgc_Allocation * bgc_allocation_new(bgc_AllocationMap * am, void *ptr, size_t size, bgc_Deconstructor dtor) {
+    bgc_AllocationSlab *slab = am->spare_slabs;
+    if (!slab) {
+        slab = (bgc_AllocationSlab *) bgc_aligned_alloc(BGC_SLAB_SIZE, BGC_SLAB_SIZE);
+        if (!slab) {
+            return NULL;
+        }
+        slab->spare = NULL;
+        slab->live = 0;
+        for (size_t i = BGC_SLAB_ALLOCATIONS; i-- > 0;) {
+            slab->allocs[i].next = slab->spare;
+            slab->spare = &slab->allocs[i];
+        }
+        bgc_allocation_slab_link(&am->spare_slabs, slab);
+    }
+    bgc_Allocation *a = slab->spare;
+    slab->spare = a->next;
+    if (++slab->live == BGC_SLAB_ALLOCATIONS) {
+        bgc_allocation_slab_unlink(&am->spare_slabs, slab);
+        bgc_allocation_slab_link(&am->full_slabs, slab);
+    }
     a->ptr = ptr;
     a->size = size;
     a->tag = BGC_TAG_NONE;
     a->dtor = dtor;
+    a->final_index = 0;
+    a->layout = NULL;
     a->next = NULL;
     return a;
 }
@@ -122,26 +433,26 @@ PRIVATE bgc_Allocation * bgc_allocation_new(void *ptr, size_t size, bgc_Deconstr
 /**
  * Delete an allocation object.
  *
- * Deletes the allocation object pointed to by `a`, but does *not*
- * free the memory pointed to by `a->ptr`.
+ * Returns the allocation object pointed to by `a` to its slab, but does
+ * *not* free the memory pointed to by `a->ptr`. A slab left without live
+ * objects is freed unless it is the only slab with spare objects, so the
+ * metadata of a past peak does not stay pinned.
  *
+ * @param am The allocation map that created `a`.
  * @param a The allocation object to delete.
  */
-PRIVATE void bgc_allocation_delete(bgc_Allocation *a) {
-    free(a);
-}
-
-/**
- * Determine the current load factor of an `AllocationMap`.
- *
- * Calculates the load factor of the hash map as the quotient of the size and
- * the capacity of the hash map.
- *
- * @param am The allocationo map to calculate the load factor for.
- * @returns The load factor of the allocation map `am`.
- */
-PRIVATE double bgc_allocation_map_load_factor(bgc_AllocationMap * am) {
-    return (double) am->size / (double) am->capacity;
+PRIVATE void bgc_allocation_delete(bgc_AllocationMap * am, bgc_Allocation *a) {
+    bgc_AllocationSlab *slab = bgc_allocation_slab(a);
+    if (slab->live-- == BGC_SLAB_ALLOCATIONS) {
+        bgc_allocation_slab_unlink(&am->full_slabs, slab);
+        bgc_allocation_slab_link(&am->spare_slabs, slab);
+    }
+    a->next = slab->spare;
+    slab->spare = a;
+    if (!slab->live && (slab->prev || slab->next)) {
+        bgc_allocation_slab_unlink(&am->spare_slabs, slab);
+        bgc_aligned_free(slab);
+    }
 }
 
 PRIVATE bgc_AllocationMap * bgc_allocation_map_new(size_t min_capacity,
@@ -150,6 +461,9 @@ PRIVATE bgc_AllocationMap * bgc_allocation_map_new(size_t min_capacity,
         double downsize_factor,
         double upsize_factor) {
     bgc_AllocationMap * am = (bgc_AllocationMap *) malloc(sizeof(bgc_AllocationMap));
+    if (!am) {
+        return NULL;
+    }
     am->min_capacity = next_prime(min_capacity);
     am->capacity = next_prime(capacity);
     if (am->capacity < am->min_capacity) am->capacity = am->min_capacity;
@@ -157,63 +471,186 @@ PRIVATE bgc_AllocationMap * bgc_allocation_map_new(size_t min_capacity,
     am->sweep_limit = (int) (sweep_factor * am->capacity);
     am->downsize_factor = downsize_factor;
     am->upsize_factor = upsize_factor;
-    am->allocs = (bgc_Allocation**) calloc(am->capacity, sizeof(bgc_Allocation*));
+    am->frozen = false;
+    am->huge_pages = false;
+    am->allocs = bgc_allocation_map_buckets_new(am->huge_pages, am->capacity, &am->huge_allocs);
+    if (!am->allocs) {
+        free(am);
+        return NULL;
+    }
+    am->old_allocs = NULL;
+    am->old_capacity = 0;
+    am->old_huge = false;
+    am->migrate_cursor = 0;
+    am->finalizable = NULL;
+    am->finalizable_count = 0;
+    am->finalizable_capacity = 0;
+    am->full_slabs = NULL;
+    am->spare_slabs = NULL;
     am->size = 0;
+    am->resize_count = 0;
+    am->tracer = NULL;
     LOG_DEBUG("Created allocation map (cap=%lld, siz=%lld)", (uint64_t) am->capacity, (uint64_t) am->size);
     return am;
 }
 
+PRIVATE void bgc_allocation_map_finish_resize(bgc_AllocationMap * am);
+
 PRIVATE void bgc_allocation_map_delete(bgc_AllocationMap * am) {
-    // Iterate over the map
+    bgc_allocation_map_finish_resize(am);
     LOG_DEBUG("Deleting allocation map (cap=%lld, siz=%lld)",
               (uint64_t) am->capacity, (uint64_t) am->size);
-    bgc_Allocation *alloc, *tmp;
-    for (size_t i = 0; i < am->capacity; ++i) {
-        if ((alloc = am->allocs[i])) {
-            // Make sure to follow the chain inside a bucket
-            while (alloc) {
-                tmp = alloc;
-                alloc = alloc->next;
-                // free the management structure
-                bgc_allocation_delete(tmp);
-            }
+    // Every allocation object lives in a slab, so there is no chain to follow
+    bgc_allocation_slabs_delete(am->full_slabs);
+    bgc_allocation_slabs_delete(am->spare_slabs);
+    bgc_allocation_map_buckets_delete(am->allocs, am->capacity, am->huge_allocs);
+    free(am->finalizable);
+    free(am);
+}
+
+/**
+ * Add an allocation with a deconstructor to the finalizable list of a map.
+ *
+ * The sweep runs deconstructors from this list only, so it can free every
+ * other unreachable allocation without looking at its deconstructor.
+ *
+ * @param am The allocation map that holds `alloc`.
+ * @param alloc The allocation to add.
+ * @returns Whether the list could grow to hold `alloc`.
+ */
+PRIVATE bool bgc_allocation_map_track(bgc_AllocationMap * am, bgc_Allocation *alloc) {
+    if (am->finalizable_count == am->finalizable_capacity) {
+        size_t capacity = am->finalizable_capacity ? 2 * am->finalizable_capacity : 64;
+        bgc_Allocation **finalizable = (bgc_Allocation **) realloc(am->finalizable, capacity * sizeof(bgc_Allocation *));
+        if (!finalizable) {
+            return false;
         }
+        am->finalizable = finalizable;
+        am->finalizable_capacity = capacity;
     }
-    free(am->allocs);
-    free(am);
+    alloc->final_index = am->finalizable_count;
+    am->finalizable[am->finalizable_count++] = alloc;
+    return true;
+}
+
+/** Remove an allocation from the finalizable list, the last entry takes its place. */
+PRIVATE void bgc_allocation_map_untrack(bgc_AllocationMap * am, bgc_Allocation *alloc) {
+    bgc_Allocation *last = am->finalizable[--am->finalizable_count];
+    am->finalizable[alloc->final_index] = last;
+    last->final_index = alloc->final_index;
+}
+
+/**
+ * Set the deconstructor of an allocation, keeping the finalizable list up to date.
+ *
+ * @param am The allocation map that holds `alloc`.
+ * @param alloc The allocation to update.
+ * @param dtor The new deconstructor, or `NULL`.
+ * @returns Whether the allocation could be added to the finalizable list.
+ */
+PRIVATE bool bgc_allocation_map_set_dtor(bgc_AllocationMap * am, bgc_Allocation *alloc, bgc_Deconstructor dtor) {
+    if (dtor && !alloc->dtor && !bgc_allocation_map_track(am, alloc)) {
+        return false;
+    }
+    if (!dtor && alloc->dtor) {
+        bgc_allocation_map_untrack(am, alloc);
+    }
+    alloc->dtor = dtor;
+    return true;
 }
 
 PRIVATE size_t bgc_hash(void *ptr) {
     return ((uintptr_t)ptr) >> 3;
 }
 
-PRIVATE void bgc_allocation_map_resize(bgc_AllocationMap * am, size_t new_capacity) {
-    if (new_capacity <= am->min_capacity) {
+/** The number of non-empty buckets an incremental resize moves per put and remove. */
+#define BGC_MIGRATE_BUCKETS 4
+
+/**
+ * Move buckets of an incremental resize from the old into the new table.
+ *
+ * Like Redis' incremental rehashing, every put and remove moves a few
+ * buckets, so no single operation pays for rehashing the whole map. Runs of
+ * empty buckets count as well, ten empty buckets per requested bucket, to
+ * bound the work on a sparse old table. Once the last bucket is moved, the
+ * old table is freed.
+ *
+ * @param am The allocation map to migrate.
+ * @param buckets The number of non-empty buckets to move at most.
+ */
+PRIVATE void bgc_allocation_map_migrate(bgc_AllocationMap * am, size_t buckets) {
+    if (!am->old_allocs) {
         return;
     }
-    // Replaces the existing items array in the hash table
-    // with a resized one and pushes items into the new, correct buckets
-    LOG_DEBUG("Resizing allocation map (cap=%lld, siz=%lld) -> (cap=%lld)",
-              (uint64_t) am->capacity, (uint64_t) am->size, (uint64_t) new_capacity);
-    bgc_Allocation **resized_allocs = (bgc_Allocation**) calloc(new_capacity, sizeof(bgc_Allocation*));
-
-    for (size_t i = 0; i < am->capacity; ++i) {
-        bgc_Allocation *alloc = am->allocs[i];
+    size_t empty = buckets < SIZE_MAX / 10 ? 10 * buckets : SIZE_MAX;
+    while (buckets && am->migrate_cursor < am->old_capacity) {
+        bgc_Allocation *alloc = am->old_allocs[am->migrate_cursor];
+        if (!alloc) {
+            am->migrate_cursor++;
+            if (!--empty) {
+                break;
+            }
+            continue;
+        }
         while (alloc) {
             bgc_Allocation *next_alloc = alloc->next;
-            size_t new_index = bgc_hash(alloc->ptr) % new_capacity;
-            alloc->next = resized_allocs[new_index];
-            resized_allocs[new_index] = alloc;
+            size_t new_index = bgc_hash(alloc->ptr) % am->capacity;
+            alloc->next = am->allocs[new_index];
+            am->allocs[new_index] = alloc;
             alloc = next_alloc;
         }
+        am->old_allocs[am->migrate_cursor++] = NULL;
+        buckets--;
+    }
+    if (am->migrate_cursor == am->old_capacity) {
+        bgc_allocation_map_buckets_delete(am->old_allocs, am->old_capacity, am->old_huge);
+        am->old_allocs = NULL;
+        am->old_capacity = 0;
+        am->migrate_cursor = 0;
+    }
+}
+
+/**
+ * Move every remaining bucket of an incremental resize into the new table.
+ *
+ * Needed before walking all buckets, e.g. when marking and sweeping, which
+ * visit every allocation anyway.
+ *
+ * @param am The allocation map to migrate.
+ */
+PRIVATE void bgc_allocation_map_finish_resize(bgc_AllocationMap * am) {
+    bgc_allocation_map_migrate(am, SIZE_MAX);
+}
+
+PRIVATE void bgc_allocation_map_resize(bgc_AllocationMap * am, size_t new_capacity) {
+    if (new_capacity <= am->min_capacity) {
+        return;
     }
-    free(am->allocs);
+    // Replaces the existing items array in the hash table with a resized
+    // one, the items move into the new buckets with later puts and removes
+    LOG_DEBUG("Resizing allocation map (cap=%lld, siz=%lld) -> (cap=%lld)",
+              (uint64_t) am->capacity, (uint64_t) am->size, (uint64_t) new_capacity);
+    bgc_allocation_map_finish_resize(am);
+    BGC_EVENT_BEGIN(am->tracer, BGC_PHASE_MAP_RESIZE, am->capacity);
+    bool resized_huge = false;
+    bgc_Allocation **resized_allocs = bgc_allocation_map_buckets_new(am->huge_pages, new_capacity, &resized_huge);
+    am->old_allocs = am->allocs;
+    am->old_capacity = am->capacity;
+    am->old_huge = am->huge_allocs;
+    am->migrate_cursor = 0;
+    am->huge_allocs = resized_huge;
     am->capacity = new_capacity;
     am->allocs = resized_allocs;
+    am->resize_count++;
+    BGC_EVENT_END(am->tracer, BGC_PHASE_MAP_RESIZE, am->capacity);
     am->sweep_limit = am->size + am->sweep_factor * (am->capacity - am->size);
 }
 
 PRIVATE bool bgc_allocation_map_resize_to_fit(bgc_AllocationMap * am) {
+    if (am->frozen || am->old_allocs) {
+        /* Resizing waits for the end of a lazy sweep or of a migration */
+        return false;
+    }
     double load_factor = bgc_allocation_map_load_factor(am);
     if (load_factor > am->upsize_factor) {
         LOG_DEBUG("Load factor %0.3g > %0.3g. Triggering upsize.",
@@ -230,57 +667,81 @@ PRIVATE bool bgc_allocation_map_resize_to_fit(bgc_AllocationMap * am) {
     return false;
 }
 
-PRIVATE bgc_Allocation * bgc_allocation_map_get(bgc_AllocationMap * am, void *ptr) {
-    size_t index = bgc_hash(ptr) % am->capacity;
-    bgc_Allocation *cur = am->allocs[index];
-    while(cur) {
-        if (cur->ptr == ptr) {
-            return cur;
+/**
+ * Find the link to the allocation of a pointer.
+ *
+ * Looks into the old table as well while an incremental resize has not
+ * moved the bucket of `ptr` yet.
+ *
+ * @param am The allocation map to search.
+ * @param ptr The pointer to look up.
+ * @returns The bucket or `next` field that points to the allocation, or
+ *          `NULL` if `ptr` is not managed.
+ */
+PRIVATE bgc_Allocation ** bgc_allocation_map_link(bgc_AllocationMap * am, void *ptr) {
+    size_t hash = bgc_hash(ptr);
+    bgc_Allocation **link = &am->allocs[hash % am->capacity];
+    while (*link) {
+        if ((*link)->ptr == ptr) {
+            return link;
+        }
+        link = &(*link)->next;
+    }
+    if (am->old_allocs) {
+        size_t index = hash % am->old_capacity;
+        if (index >= am->migrate_cursor) {
+            link = &am->old_allocs[index];
+            while (*link) {
+                if ((*link)->ptr == ptr) {
+                    return link;
+                }
+                link = &(*link)->next;
+            }
         }
-        cur = cur->next;
     }
     return NULL;
 }
 
+PRIVATE bgc_Allocation * bgc_allocation_map_get(bgc_AllocationMap * am, void *ptr) {
+    /* Scans the new table once, then the old one only while a resize is under way */
+    bgc_Allocation **link = bgc_allocation_map_link(am, ptr);
+    return link ? *link : NULL;
+}
+
 PRIVATE bgc_Allocation * bgc_allocation_map_put(bgc_AllocationMap * am,
         void *ptr,
         size_t size,
         bgc_Deconstructor dtor) {
+    bgc_allocation_map_migrate(am, BGC_MIGRATE_BUCKETS);
     size_t index = bgc_hash(ptr) % am->capacity;
     LOG_DEBUG("PUT request for allocation ix=%lld", (uint64_t) index);
-    bgc_Allocation *alloc = bgc_allocation_new(ptr, size, dtor);
-    bgc_Allocation *cur = am->allocs[index];
-    bgc_Allocation *prev = NULL;
+    bgc_Allocation *alloc = bgc_allocation_new(am, ptr, size, dtor);
+    if (!alloc) {
+        return NULL;
+    }
+    if (dtor && !bgc_allocation_map_track(am, alloc)) {
+        bgc_allocation_delete(am, alloc);
+        return NULL;
+    }
     /* Upsert if ptr is already known (e.g. dtor update). */
-    while(cur != NULL) {
-        if (cur->ptr == ptr) {
-            // found it
-            alloc->next = cur->next;
-            if (!prev) {
-                // position 0
-                am->allocs[index] = alloc;
-            } else {
-                // in the list
-                prev->next = alloc;
-            }
-            bgc_allocation_delete(cur);
-            LOG_DEBUG("AllocationMap Upsert at ix=%lld", (uint64_t) index);
-            return alloc;
-
+    bgc_Allocation **link = bgc_allocation_map_link(am, ptr);
+    if (link) {
+        bgc_Allocation *cur = *link;
+        if (cur->dtor) {
+            bgc_allocation_map_untrack(am, cur);
         }
-        prev = cur;
-        cur = cur->next;
+        alloc->next = cur->next;
+        *link = alloc;
+        bgc_allocation_delete(am, cur);
+        LOG_DEBUG("AllocationMap Upsert at ix=%lld", (uint64_t) index);
+        return alloc;
     }
     /* Insert at the front of the separate chaining list */
-    cur = am->allocs[index];
-    alloc->next = cur;
+    alloc->next = am->allocs[index];
     am->allocs[index] = alloc;
     am->size++;
     LOG_DEBUG("AllocationMap insert at ix=%lld", (uint64_t) index);
-    void *p = alloc->ptr;
-    if (bgc_allocation_map_resize_to_fit(am)) {
-        alloc = bgc_allocation_map_get(am, p);
-    }
+    bgc_allocation_map_resize_to_fit(am);
     return alloc;
 }
 
@@ -288,132 +749,1590 @@ PRIVATE void bgc_allocation_map_remove(bgc_AllocationMap * am,
                                      void *ptr,
                                      bool allow_resize) {
     // ignores unknown keys
-    size_t index = bgc_hash(ptr) % am->capacity;
-    bgc_Allocation *cur = am->allocs[index];
-    bgc_Allocation *prev = NULL;
-    bgc_Allocation *next;
-    while(cur != NULL) {
-        next = cur->next;
-        if (cur->ptr == ptr) {
-            // found it
-            if (!prev) {
-                // first item in list
-                am->allocs[index] = cur->next;
-            } else {
-                // not the first item in the list
-                prev->next = cur->next;
-            }
-            bgc_allocation_delete(cur);
-            am->size--;
-        } else {
-            // move on
-            prev = cur;
+    bgc_allocation_map_migrate(am, BGC_MIGRATE_BUCKETS);
+    bgc_Allocation **link = bgc_allocation_map_link(am, ptr);
+    if (link) {
+        bgc_Allocation *cur = *link;
+        *link = cur->next;
+        if (cur->dtor) {
+            bgc_allocation_map_untrack(am, cur);
         }
-        cur = next;
+        bgc_allocation_delete(am, cur);
+        am->size--;
     }
     if (allow_resize) {
         bgc_allocation_map_resize_to_fit(am);
     }
 }
 
-PRIVATE void * bgc_mcalloc(size_t count, size_t size) {
-    if (!count) return malloc(size);
-    return calloc(count, size);
+/**
+ * Move an allocation to a new address.
+ *
+ * Unlinks `alloc` from the chain of its current address and relinks the same
+ * object under `ptr`, keeping its size, deconstructor and tag. The number of
+ * entries does not change, so the map is never resized. The allocation always
+ * moves into the new table of an incremental resize.
+ *
+ * @param am The allocation map that contains `alloc`.
+ * @param alloc The allocation to move.
+ * @param ptr The new address of the allocation.
+ */
+PRIVATE void bgc_allocation_map_rekey(bgc_AllocationMap * am,
+                                      bgc_Allocation *alloc,
+                                      void *ptr) {
+    bgc_Allocation **link = bgc_allocation_map_link(am, alloc->ptr);
+    *link = alloc->next;
+    size_t index = bgc_hash(ptr) % am->capacity;
+    alloc->ptr = ptr;
+    alloc->next = am->allocs[index];
+    am->allocs[index] = alloc;
 }
 
-PRIVATE bool bgc_needs_sweep(bgc_GC *gc) {
-    return gc->allocs->size > gc->allocs->sweep_limit;
-}
+#if !defined(BGC_NO_THREADS)
 
-PRIVATE void * bgc_allocate(bgc_GC *gc, size_t count, size_t size, bgc_Deconstructor dtor) {
-    /* Allocation logic that generalizes over malloc/calloc. */
+/*
+ * A sharded allocation map for allocators that share a heap across threads.
+ *
+ * Allocations are partitioned over a power-of-two number of shards by a
+ * multiplicative hash of the address. Each shard is a regular
+ * `bgc_AllocationMap` behind its own mutex, so threads allocating at
+ * different addresses rarely contend. The collector freezes the whole map
+ * with `bgc_sharded_allocation_map_lock_all()` before marking; while frozen,
+ * `bgc_sharded_allocation_map_get()` walks the shard chains without taking
+ * any lock. Outside of that, allocations are only ever copied out of a
+ * shard under its lock. The single-threaded `bgc_GC` does not use it.
+ */
+PRIVATE size_t bgc_sharded_allocation_map_index(bgc_ShardedAllocationMap *sam, void *ptr) {
+    /* Fibonacci hashing; uses the high bits so that the shard index does not
+     * correlate with the bucket index inside the shard (`bgc_hash % capacity`). */
+    uint64_t h = (uint64_t) bgc_hash(ptr) * UINT64_C(0x9E3779B97F4A7C15);
+    return sam->shard_bits ? (size_t) (h >> (64 - sam->shard_bits)) : 0;
+}
 
-    /* Check if we reached the high-water mark and need to clean up */
-    if (bgc_needs_sweep(gc) && !gc->disabled) {
-        size_t freed_mem = bgc_collect(gc);
-        LOG_DEBUG("Garbage collection cleaned up %llu bytes.", freed_mem);
+PUBLIC bgc_ShardedAllocationMap * bgc_sharded_allocation_map_new(size_t shard_count,
+        size_t min_capacity,
+        size_t capacity,
+        double sweep_factor,
+        double downsize_factor,
+        double upsize_factor) {
+    bgc_ShardedAllocationMap *sam = (bgc_ShardedAllocationMap *) malloc(sizeof(bgc_ShardedAllocationMap));
+    if (!sam) {
+        return NULL;
     }
-    /* With cleanup out of the way, attempt to allocate memory */
-    void *ptr = bgc_mcalloc(count, size);
-    size_t alloc_size = count ? count * size : size;
-    /* If allocation fails, force an out-of-policy run to free some memory and try again. */
-    if (!ptr && !gc->disabled && (errno == EAGAIN || errno == ENOMEM)) {
-        bgc_collect(gc);
-        ptr = bgc_mcalloc(count, size);
+    /* Round the shard count up to the next power of two */
+    sam->shard_bits = 0;
+    while (((size_t) 1 << sam->shard_bits) < shard_count && sam->shard_bits < 16) {
+        sam->shard_bits++;
     }
-    /* Start managing the memory we received from the system */
-    if (ptr) {
-        LOG_DEBUG("Allocated %zu bytes at %p", alloc_size, (void *) ptr);
-        bgc_Allocation *alloc = bgc_allocation_map_put(gc->allocs, ptr, alloc_size, dtor);
-        /* Deal with metadata allocation failure */
-        if (alloc) {
-            LOG_DEBUG("Managing %zu bytes at %p", alloc_size, (void *) alloc->ptr);
-            ptr = alloc->ptr;
-        } else {
-            /* We failed to allocate the metadata, fail cleanly. */
-            free(ptr);
-            ptr = NULL;
+    sam->shard_count = (size_t) 1 << sam->shard_bits;
+    /* The padding only keeps shards apart if the array starts on a cache line */
+    sam->shards = (bgc_AllocationMapShard *) bgc_aligned_alloc(BGC_CACHE_LINE, sam->shard_count * sizeof(bgc_AllocationMapShard));
+    if (!sam->shards) {
+        free(sam);
+        return NULL;
+    }
+    memset(sam->shards, 0, sam->shard_count * sizeof(bgc_AllocationMapShard));
+    for (size_t i = 0; i < sam->shard_count; ++i) {
+        sam->shards[i].s.map = bgc_allocation_map_new(min_capacity, capacity,
+                               sweep_factor, downsize_factor, upsize_factor);
+        if (!sam->shards[i].s.map) {
+            /* Only the shards before this one are set up */
+            sam->shard_count = i;
+            bgc_sharded_allocation_map_delete(sam);
+            return NULL;
+        }
+        pthread_mutex_init(&sam->shards[i].s.lock, NULL);
+    }
+    LOG_DEBUG("Created sharded allocation map (shards=%lld)", (uint64_t) sam->shard_count);
+    return sam;
+}
+
+PUBLIC void bgc_sharded_allocation_map_delete(bgc_ShardedAllocationMap *sam) {
+    for (size_t i = 0; i < sam->shard_count; ++i) {
+        bgc_allocation_map_delete(sam->shards[i].s.map);
+        pthread_mutex_destroy(&sam->shards[i].s.lock);
+    }
+    bgc_aligned_free(sam->shards);
+    free(sam);
+}
+
+PUBLIC bool bgc_sharded_allocation_map_put(bgc_ShardedAllocationMap *sam,
+        void *ptr,
+        size_t size,
+        bgc_Deconstructor dtor) {
+    bgc_AllocationMapShard *shard = &sam->shards[bgc_sharded_allocation_map_index(sam, ptr)];
+    pthread_mutex_lock(&shard->s.lock);
+    bool tracked = bgc_allocation_map_put(shard->s.map, ptr, size, dtor) != NULL;
+    pthread_mutex_unlock(&shard->s.lock);
+    return tracked;
+}
+
+PUBLIC void bgc_sharded_allocation_map_remove(bgc_ShardedAllocationMap *sam,
+        void *ptr,
+        bool allow_resize) {
+    bgc_AllocationMapShard *shard = &sam->shards[bgc_sharded_allocation_map_index(sam, ptr)];
+    pthread_mutex_lock(&shard->s.lock);
+    bgc_allocation_map_remove(shard->s.map, ptr, allow_resize);
+    pthread_mutex_unlock(&shard->s.lock);
+}
+
+/**
+ * Look up an allocation while other threads may be mutating the map.
+ *
+ * Takes the lock of the shard that owns `ptr` and copies the allocation out
+ * before releasing it: the allocation object is recycled once removed.
+ */
+PUBLIC bool bgc_sharded_allocation_map_find(bgc_ShardedAllocationMap *sam, void *ptr, bgc_Allocation *alloc) {
+    bgc_AllocationMapShard *shard = &sam->shards[bgc_sharded_allocation_map_index(sam, ptr)];
+    pthread_mutex_lock(&shard->s.lock);
+    bgc_Allocation *found = bgc_allocation_map_get(shard->s.map, ptr);
+    if (found && alloc) {
+        *alloc = *found;
+        alloc->next = NULL;
+    }
+    pthread_mutex_unlock(&shard->s.lock);
+    return found != NULL;
+}
+
+/**
+ * Look up an allocation without taking any lock.
+ *
+ * Only valid while the map is frozen by `bgc_sharded_allocation_map_lock_all()`
+ * (i.e. from the marker), or from the thread that holds the owning shard's lock.
+ */
+PUBLIC bgc_Allocation * bgc_sharded_allocation_map_get(bgc_ShardedAllocationMap *sam, void *ptr) {
+    return bgc_allocation_map_get(sam->shards[bgc_sharded_allocation_map_index(sam, ptr)].s.map, ptr);
+}
+
+PUBLIC void bgc_sharded_allocation_map_lock_all(bgc_ShardedAllocationMap *sam) {
+    /* Always lock in index order to avoid lock-order inversions */
+    for (size_t i = 0; i < sam->shard_count; ++i) {
+        pthread_mutex_lock(&sam->shards[i].s.lock);
+    }
+}
+
+PUBLIC void bgc_sharded_allocation_map_unlock_all(bgc_ShardedAllocationMap *sam) {
+    for (size_t i = sam->shard_count; i > 0; --i) {
+        pthread_mutex_unlock(&sam->shards[i - 1].s.lock);
+    }
+}
+
+PUBLIC size_t bgc_sharded_allocation_map_size(bgc_ShardedAllocationMap *sam) {
+    size_t size = 0;
+    for (size_t i = 0; i < sam->shard_count; ++i) {
+        pthread_mutex_lock(&sam->shards[i].s.lock);
+        size += sam->shards[i].s.map->size;
+        pthread_mutex_unlock(&sam->shards[i].s.lock);
+    }
+    return size;
+}
+
+#endif // BGC_NO_THREADS
+
+/*
+ * Open addressing hash tables.
+ *
+ * The weak maps, the intern table, the blacklist and the profiler share one
+ * linear probing implementation. A table is an array of entries whose first
+ * word is zero in free slots, with a power of two capacity and at least one
+ * free slot. The owner of a table keeps its size and decides when it grows,
+ * a `bgc_TableType` describes its entries.
+ */
+
+/** The entries of an open addressing hash table. */
+typedef struct bgc_TableType {
+    /** The size of an entry in bytes. */
+    size_t entry_size;
+
+    /** Hash the key of an entry in use. */
+    size_t (*hash)(const void *entry);
+
+    /** Check whether an entry in use holds `key`. */
+    bool (*match)(const void *entry, const void *key);
+} bgc_TableType;
+
+PRIVATE void * bgc_table_entry(const bgc_TableType *type, const void *entries, size_t i) {
+    return (char *) entries + i * type->entry_size;
+}
+
+PRIVATE bool bgc_table_used(const void *entry) {
+    uintptr_t word;
+    memcpy(&word, entry, sizeof(uintptr_t));
+    return word != 0;
+}
+
+/**
+ * Find the slot of a key, or the free slot where it would be inserted.
+ *
+ * @param type The entries of the table.
+ * @param entries The slots to search.
+ * @param capacity The number of slots.
+ * @param hash The hash of `key`, as `type->hash` computes it for an entry holding `key`.
+ * @param key The key to find.
+ * @returns The index of the slot.
+ */
+PRIVATE size_t bgc_table_find(const bgc_TableType *type, const void *entries, size_t capacity,
+                              size_t hash, const void *key) {
+    size_t mask = capacity - 1;
+    size_t i = hash & mask;
+    for (const void *e = bgc_table_entry(type, entries, i); bgc_table_used(e) && !type->match(e, key);
+         e = bgc_table_entry(type, entries, i)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/**
+ * Clear the entry in slot `i`, the owner decrements the size of the table.
+ *
+ * Moves later entries of the same probe sequence back instead of leaving a
+ * tombstone, so lookups never have to skip removed entries.
+ */
+PRIVATE void bgc_table_remove_at(const bgc_TableType *type, void *entries, size_t capacity, size_t i) {
+    size_t mask = capacity - 1;
+    for (size_t j = (i + 1) & mask; bgc_table_used(bgc_table_entry(type, entries, j)); j = (j + 1) & mask) {
+        size_t home = type->hash(bgc_table_entry(type, entries, j)) & mask;
+        /* Move the entry if its home slot does not lie cyclically within (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            memcpy(bgc_table_entry(type, entries, i), bgc_table_entry(type, entries, j), type->entry_size);
+            i = j;
+        }
+    }
+    memset(bgc_table_entry(type, entries, i), 0, type->entry_size);
+}
+
+/**
+ * Rehash the entries of a table into `new_capacity` slots.
+ *
+ * @returns The new slots, or `NULL` if out of memory. The old slots are left for the owner to free.
+ */
+PRIVATE void * bgc_table_rehash(const bgc_TableType *type, const void *entries, size_t capacity, size_t new_capacity) {
+    void *rehashed = calloc(new_capacity, type->entry_size);
+    if (!rehashed) {
+        return NULL;
+    }
+    size_t mask = new_capacity - 1;
+    for (size_t i = 0; i < capacity; ++i) {
+        const void *e = bgc_table_entry(type, entries, i);
+        if (bgc_table_used(e)) {
+            size_t j = type->hash(e) & mask;
+            while (bgc_table_used(bgc_table_entry(type, rehashed, j))) {
+                j = (j + 1) & mask;
+            }
+            memcpy(bgc_table_entry(type, rehashed, j), e, type->entry_size);
+        }
+    }
+    return rehashed;
+}
+
+/*
+ * Sampling allocation profiler.
+ *
+ * Samples are taken as a Poisson process over the allocated bytes: the gap
+ * between two samples is drawn from an exponential distribution with mean
+ * `interval`, so large allocations are more likely to be sampled than small
+ * ones. Each sample is weighted with the number of bytes allocated since the
+ * previous sample, which makes the per call stack sums unbiased estimates of
+ * the bytes allocated from that call stack.
+ */
+
+/**
+ * Approximate the binary logarithm of a positive double.
+ *
+ * A quadratic fit of the mantissa, accurate to about 0.005. This is good
+ * enough to draw sampling intervals and avoids a dependency on libm.
+ */
+PRIVATE double bgc_fast_log2(double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    int exponent = (int) ((bits >> 52) & 0x7ff) - 1024;
+    bits = (bits & 0xfffffffffffffULL) | 0x3ff0000000000000ULL;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    return exponent + (-0.34484843 * m + 2.02466578) * m - 0.67487759;
+}
+
+/**
+ * Draw the number of bytes until the next sample.
+ */
+PRIVATE size_t bgc_profile_next_threshold(bgc_Profiler *profiler) {
+    /* xorshift64* */
+    profiler->rng ^= profiler->rng >> 12;
+    profiler->rng ^= profiler->rng << 25;
+    profiler->rng ^= profiler->rng >> 27;
+    uint64_t r = profiler->rng * 2685821657736338717ULL;
+    /* Uniform in (0, 1] */
+    double u = (double) ((r >> 11) + 1) / 9007199254740992.0;
+    double t = -bgc_fast_log2(u) * 0.6931471805599453 * (double) profiler->interval;
+    return t < (double) (SIZE_MAX / 2) ? (size_t) t : SIZE_MAX / 2;
+}
+
+/** A call stack to look up in the index of sites. */
+typedef struct bgc_ProfileStack {
+    const bgc_Profiler *profiler;
+    void **stack;
+    size_t depth;
+    size_t hash;
+} bgc_ProfileStack;
+
+PRIVATE size_t bgc_profile_site_hash(const void *entry) {
+    return ((const bgc_ProfileSiteSlot *) entry)->hash;
+}
+
+PRIVATE bool bgc_profile_site_match(const void *entry, const void *key) {
+    const bgc_ProfileSiteSlot *slot = (const bgc_ProfileSiteSlot *) entry;
+    const bgc_ProfileStack *k = (const bgc_ProfileStack *) key;
+    const bgc_ProfileSite *site = &k->profiler->sites[slot->site - 1];
+    return slot->hash == k->hash && site->depth == k->depth && memcmp(site->stack, k->stack, k->depth * sizeof(void *)) == 0;
+}
+
+PRIVATE const bgc_TableType bgc_profile_site_type = { sizeof(bgc_ProfileSiteSlot), bgc_profile_site_hash, bgc_profile_site_match };
+
+PRIVATE size_t bgc_profile_sample_hash(const void *entry) {
+    return bgc_hash(((const bgc_ProfileSample *) entry)->ptr);
+}
+
+PRIVATE bool bgc_profile_sample_match(const void *entry, const void *key) {
+    return ((const bgc_ProfileSample *) entry)->ptr == key;
+}
+
+PRIVATE const bgc_TableType bgc_profile_sample_type = { sizeof(bgc_ProfileSample), bgc_profile_sample_hash, bgc_profile_sample_match };
+
+/**
+ * Find the site of a call stack, adding a site if it is new.
+ *
+ * @returns The index of the site in `profiler->sites`, or `SIZE_MAX` if out of memory.
+ */
+PRIVATE size_t bgc_profile_find_site(bgc_Profiler *profiler, void **stack, size_t depth) {
+    bgc_ProfileStack key = { profiler, stack, depth, 0xcbf29ce484222325ull };
+    for (size_t i = 0; i < depth; ++i) {
+        key.hash = (key.hash ^ (uintptr_t) stack[i]) * 0x100000001b3ull;
+    }
+    if (profiler->site_count) {
+        size_t i = bgc_table_find(&bgc_profile_site_type, profiler->site_slots, profiler->site_slot_capacity, key.hash, &key);
+        if (profiler->site_slots[i].site) {
+            return profiler->site_slots[i].site - 1;
+        }
+    }
+    /* Keep the load factor of the index at or below 3/4 */
+    if (profiler->site_count + 1 > profiler->site_slot_capacity / 4 * 3) {
+        size_t capacity = profiler->site_slot_capacity ? 2 * profiler->site_slot_capacity : 32;
+        bgc_ProfileSiteSlot *slots = (bgc_ProfileSiteSlot *) bgc_table_rehash(&bgc_profile_site_type, profiler->site_slots,
+                                                                              profiler->site_slot_capacity, capacity);
+        if (!slots) {
+            return SIZE_MAX;
+        }
+        free(profiler->site_slots);
+        profiler->site_slots = slots;
+        profiler->site_slot_capacity = capacity;
+    }
+    if (profiler->site_count == profiler->site_capacity) {
+        size_t capacity = profiler->site_capacity ? 2 * profiler->site_capacity : 16;
+        bgc_ProfileSite *sites = realloc(profiler->sites, capacity * sizeof(bgc_ProfileSite));
+        if (!sites) {
+            return SIZE_MAX;
+        }
+        profiler->sites = sites;
+        profiler->site_capacity = capacity;
+    }
+    bgc_ProfileSite *site = &profiler->sites[profiler->site_count];
+    memset(site, 0, sizeof(bgc_ProfileSite));
+    memcpy(site->stack, stack, depth * sizeof(void *));
+    site->depth = depth;
+    bgc_ProfileSiteSlot *slot = &profiler->site_slots[bgc_table_find(&bgc_profile_site_type, profiler->site_slots,
+                                                                     profiler->site_slot_capacity, key.hash, &key)];
+    slot->site = profiler->site_count + 1;
+    slot->hash = key.hash;
+    return profiler->site_count++;
+}
+
+/** Find the slot of a sample, or the free slot where it would be inserted. */
+PRIVATE size_t bgc_profile_sample_slot(const bgc_Profiler *profiler, void *ptr) {
+    return bgc_table_find(&bgc_profile_sample_type, profiler->samples, profiler->sample_capacity, bgc_hash(ptr), ptr);
+}
+
+/**
+ * Record a sample for the allocation `alloc`, weighted with `weight` bytes.
+ */
+PRIVATE void bgc_profile_sample(bgc_GC *gc, bgc_Allocation *alloc, size_t weight) {
+    bgc_Profiler *profiler = &gc->profiler;
+    void *stack[BGC_PROFILE_MAX_DEPTH];
+    size_t depth = 0;
+#if defined(BGC_HAVE_BACKTRACE)
+    int frames = backtrace(stack, BGC_PROFILE_MAX_DEPTH);
+    depth = frames > 0 ? (size_t) frames : 0;
+#endif
+    size_t index = bgc_profile_find_site(profiler, stack, depth);
+    if (index == SIZE_MAX) {
+        return;
+    }
+    /* Keep the load factor at or below 3/4 */
+    if (profiler->sample_count + 1 > profiler->sample_capacity / 4 * 3) {
+        size_t capacity = profiler->sample_capacity ? 2 * profiler->sample_capacity : 64;
+        bgc_ProfileSample *samples = (bgc_ProfileSample *) bgc_table_rehash(&bgc_profile_sample_type, profiler->samples,
+                                                                            profiler->sample_capacity, capacity);
+        if (!samples) {
+            return;
+        }
+        free(profiler->samples);
+        profiler->samples = samples;
+        profiler->sample_capacity = capacity;
+    }
+    size_t objects = alloc->size ? weight / alloc->size : weight;
+    objects = objects ? objects : 1;
+    bgc_ProfileSample *sample = &profiler->samples[bgc_profile_sample_slot(profiler, alloc->ptr)];
+    profiler->sample_count += sample->ptr ? 0 : 1;
+    sample->ptr = alloc->ptr;
+    sample->site = index;
+    sample->bytes = weight;
+    sample->objects = objects;
+    bgc_ProfileSite *site = &profiler->sites[index];
+    site->allocated_bytes += weight;
+    site->allocated_objects += objects;
+    site->live_bytes += weight;
+    site->live_objects += objects;
+    alloc->tag |= BGC_TAG_SAMPLED;
+}
+
+/**
+ * Account for a new allocation, sampling it when its threshold is reached.
+ */
+PRIVATE void bgc_profile_allocation(bgc_GC *gc, bgc_Allocation *alloc) {
+    bgc_Profiler *profiler = &gc->profiler;
+    if (!profiler->interval) {
+        return;
+    }
+    profiler->accumulated += alloc->size;
+    if (profiler->accumulated >= profiler->threshold) {
+        bgc_profile_sample(gc, alloc, profiler->accumulated);
+        profiler->accumulated = 0;
+        profiler->threshold = bgc_profile_next_threshold(profiler);
+    }
+}
+
+PRIVATE bgc_ProfileSample * bgc_profile_find_sample(bgc_GC *gc, void *ptr) {
+    if (!gc->profiler.sample_count) {
+        return NULL;
+    }
+    bgc_ProfileSample *sample = &gc->profiler.samples[bgc_profile_sample_slot(&gc->profiler, ptr)];
+    return sample->ptr ? sample : NULL;
+}
+
+/**
+ * Drop the sample of a sampled allocation that is being freed.
+ */
+PRIVATE void bgc_profile_forget(bgc_GC *gc, void *ptr) {
+    bgc_Profiler *profiler = &gc->profiler;
+    bgc_ProfileSample *sample = bgc_profile_find_sample(gc, ptr);
+    if (sample) {
+        bgc_ProfileSite *site = &profiler->sites[sample->site];
+        site->live_bytes -= sample->bytes;
+        site->live_objects -= sample->objects;
+        bgc_table_remove_at(&bgc_profile_sample_type, profiler->samples, profiler->sample_capacity,
+                            (size_t) (sample - profiler->samples));
+        profiler->sample_count--;
+    }
+}
+
+/**
+ * Move the sample of a sampled allocation to the new address of the allocation.
+ */
+PRIVATE void bgc_profile_move(bgc_GC *gc, void *from, void *to) {
+    bgc_Profiler *profiler = &gc->profiler;
+    bgc_ProfileSample *sample = bgc_profile_find_sample(gc, from);
+    if (sample) {
+        bgc_ProfileSample moved = *sample;
+        moved.ptr = to;
+        /* Removing and inserting one sample leaves the size, no need to grow */
+        bgc_table_remove_at(&bgc_profile_sample_type, profiler->samples, profiler->sample_capacity,
+                            (size_t) (sample - profiler->samples));
+        profiler->samples[bgc_profile_sample_slot(profiler, to)] = moved;
+    }
+}
+
+PUBLIC void bgc_profile_start(bgc_GC *gc, size_t interval) {
+    bgc_Profiler *profiler = &gc->profiler;
+    /* Sampled allocations from a previous profile are no longer tracked */
+    for (size_t i = 0; i < profiler->sample_capacity; ++i) {
+        bgc_Allocation *alloc = profiler->samples[i].ptr ? bgc_allocation_map_get(gc->allocs, profiler->samples[i].ptr) : NULL;
+        if (alloc) {
+            alloc->tag &= ~BGC_TAG_SAMPLED;
+        }
+    }
+    if (profiler->sample_count) {
+        memset(profiler->samples, 0, profiler->sample_capacity * sizeof(bgc_ProfileSample));
+    }
+    if (profiler->site_count) {
+        memset(profiler->site_slots, 0, profiler->site_slot_capacity * sizeof(bgc_ProfileSiteSlot));
+    }
+    profiler->site_count = 0;
+    profiler->sample_count = 0;
+    profiler->interval = interval ? interval : BGC_PROFILE_DEFAULT_INTERVAL;
+    profiler->accumulated = 0;
+    profiler->rng = 0x9e3779b97f4a7c15ULL ^ bgc_now_ns() ^ (uint64_t) (uintptr_t) gc;
+    profiler->rng = profiler->rng ? profiler->rng : 1;
+    profiler->threshold = bgc_profile_next_threshold(profiler);
+}
+
+PUBLIC void bgc_profile_stop(bgc_GC *gc) {
+    gc->profiler.interval = 0;
+}
+
+/*
+ * Allocation recorder.
+ *
+ * A recording starts with BGC_RECORDING_MAGIC, followed by one event per
+ * operation: a `bgc_RecordOp` byte and its arguments as unsigned LEB128
+ * varints. Addresses are recorded as they were in the recorded process.
+ */
+#define BGC_RECORD(gc, op, argc, a, b, c) \
+    ((gc)->recorder.out ? bgc_record(gc, op, argc, (uint64_t) (a), (uint64_t) (b), (uint64_t) (c)) : (void) 0)
+
+PRIVATE void bgc_record_varint(FILE *out, uint64_t value) {
+    while (value >= 0x80) {
+        putc((int) (value & 0x7f) | 0x80, out);
+        value >>= 7;
+    }
+    putc((int) value, out);
+}
+
+PRIVATE void bgc_record(bgc_GC *gc, bgc_RecordOp op, size_t argc, uint64_t a, uint64_t b, uint64_t c) {
+    FILE *out = gc->recorder.out;
+    uint64_t args[3] = { a, b, c };
+    putc(op, out);
+    for (size_t i = 0; i < argc; ++i) {
+        bgc_record_varint(out, args[i]);
+    }
+    gc->recorder.events++;
+}
+
+PUBLIC bool bgc_record_start(bgc_GC *gc, FILE *out) {
+    if (fwrite(BGC_RECORDING_MAGIC, 1, 8, out) != 8) {
+        return false;
+    }
+    gc->recorder.out = out;
+    gc->recorder.events = 0;
+    gc->recorder.implicit = false;
+    return true;
+}
+
+PUBLIC void bgc_record_stop(bgc_GC *gc) {
+    if (gc->recorder.out) {
+        fflush(gc->recorder.out);
+        LOG_DEBUG("Recorded %zu events", gc->recorder.events);
+    }
+    gc->recorder.out = NULL;
+}
+
+PUBLIC void bgc_record_write(bgc_GC *gc, void *obj, void *slot, void *value) {
+    BGC_RECORD(gc, BGC_RECORD_WRITE, 3, (uintptr_t) obj, (char *) slot - (char *) obj, (uintptr_t) value);
+}
+
+PRIVATE void * bgc_mcalloc(size_t count, size_t size) {
+    if (!count) return malloc(size);
+    return calloc(count, size);
+}
+
+/** The number of slots the blacklist starts with. */
+#define BGC_BLACKLIST_MIN_CAPACITY 256
+
+/** The number of slots the blacklist grows to at most, it stops recording once they are half full. */
+#define BGC_BLACKLIST_MAX_CAPACITY 16384
+
+PRIVATE size_t bgc_blacklist_hash(const void *entry) {
+    return bgc_hash((void *) *(const uintptr_t *) entry);
+}
+
+PRIVATE bool bgc_blacklist_match(const void *entry, const void *key) {
+    return *(const uintptr_t *) entry == *(const uintptr_t *) key;
+}
+
+PRIVATE const bgc_TableType bgc_blacklist_type = { sizeof(uintptr_t), bgc_blacklist_hash, bgc_blacklist_match };
+
+/** Find the slot of an address in the blacklist, or the free slot where it would be inserted. */
+PRIVATE size_t bgc_blacklist_find(const bgc_Blacklist *blacklist, uintptr_t addr) {
+    return bgc_table_find(&bgc_blacklist_type, blacklist->entries, blacklist->capacity, bgc_hash((void *) addr), &addr);
+}
+
+PRIVATE bool bgc_blacklist_contains(const bgc_Blacklist *blacklist, void *ptr) {
+    return blacklist->size && blacklist->entries[bgc_blacklist_find(blacklist, (uintptr_t) ptr)];
+}
+
+/**
+ * Blacklist a near miss of a conservative scan.
+ *
+ * A near miss is a word that lies within the heap bounds but is not the
+ * address of an allocation. It retains nothing now, but would retain the
+ * next allocation `malloc` places there.
+ *
+ * @param blacklist The blacklist of the collector that scanned the word.
+ * @param addr The value of the word.
+ */
+PRIVATE void bgc_blacklist_add(bgc_Blacklist *blacklist, uintptr_t addr) {
+    if (blacklist->size >= blacklist->capacity / 2) {
+        if (blacklist->capacity >= BGC_BLACKLIST_MAX_CAPACITY) {
+            return;
+        }
+        size_t capacity = blacklist->capacity ? 2 * blacklist->capacity : BGC_BLACKLIST_MIN_CAPACITY;
+        uintptr_t *entries = (uintptr_t *) bgc_table_rehash(&bgc_blacklist_type, blacklist->entries,
+                                                            blacklist->capacity, capacity);
+        if (!entries) {
+            return;
+        }
+        free(blacklist->entries);
+        blacklist->entries = entries;
+        blacklist->capacity = capacity;
+    }
+    size_t i = bgc_blacklist_find(blacklist, addr);
+    if (!blacklist->entries[i]) {
+        blacklist->entries[i] = addr;
+        blacklist->size++;
+    }
+}
+
+/** Forget every blacklisted address, before a mark phase records them anew. */
+PRIVATE void bgc_blacklist_clear(bgc_Blacklist *blacklist) {
+    if (blacklist->size) {
+        memset(blacklist->entries, 0, blacklist->capacity * sizeof(uintptr_t));
+        blacklist->size = 0;
+    }
+}
+
+/**
+ * Free the blocks held back for blacklisted addresses.
+ *
+ * @param gc The garbage collector that holds the blocks.
+ * @param all If `false`, only the blocks whose address is no longer blacklisted are freed.
+ */
+PRIVATE void bgc_blacklist_release(bgc_GC *gc, bool all) {
+    bgc_Blacklist *blacklist = &gc->blacklist;
+    for (size_t i = blacklist->held_count; i-- > 0;) {
+        bgc_HeldBlock *held = &blacklist->held[i];
+        if (!all && bgc_blacklist_contains(blacklist, held->ptr)) {
+            continue;
+        }
+        free(held->ptr);
+        blacklist->held_bytes -= held->size;
+        gc->stats.blacklisted_bytes -= held->size;
+        *held = blacklist->held[--blacklist->held_count];
+    }
+}
+
+/**
+ * Hold a block back from the program, freeing it would only get it back.
+ *
+ * @returns Whether the block is held, `false` if it would exceed `BGC_BLACKLIST_HELD`
+ *          blocks or `BGC_BLACKLIST_HELD_BYTES` bytes, or out of memory.
+ */
+PRIVATE bool bgc_blacklist_hold(bgc_GC *gc, void *ptr, size_t size) {
+    bgc_Blacklist *blacklist = &gc->blacklist;
+    if (size > BGC_BLACKLIST_HELD_BYTES - blacklist->held_bytes) {
+        return false;
+    }
+    if (blacklist->held_count == blacklist->held_capacity) {
+        size_t capacity = blacklist->held_capacity ? 2 * blacklist->held_capacity : 16;
+        if (capacity > BGC_BLACKLIST_HELD) {
+            return false;
+        }
+        bgc_HeldBlock *held = (bgc_HeldBlock *) realloc(blacklist->held, capacity * sizeof(bgc_HeldBlock));
+        if (!held) {
+            return false;
+        }
+        blacklist->held = held;
+        blacklist->held_capacity = capacity;
+    }
+    blacklist->held[blacklist->held_count].ptr = ptr;
+    blacklist->held[blacklist->held_count].size = size;
+    blacklist->held_count++;
+    blacklist->held_bytes += size;
+    gc->stats.blacklisted_bytes += size;
+    return true;
+}
+
+/** Take back the block held last, to hand it out after all. */
+PRIVATE void * bgc_blacklist_unhold(bgc_GC *gc) {
+    bgc_Blacklist *blacklist = &gc->blacklist;
+    bgc_HeldBlock *held = &blacklist->held[--blacklist->held_count];
+    blacklist->held_bytes -= held->size;
+    gc->stats.blacklisted_bytes -= held->size;
+    return held->ptr;
+}
+
+/** Widen the heap bounds that mark phases check scanned words against to include `ptr`. */
+PRIVATE void bgc_heap_cover(bgc_GC *gc, void *ptr) {
+    uintptr_t addr = (uintptr_t) ptr;
+    if (addr < gc->heap_min) gc->heap_min = addr;
+    if (addr > gc->heap_max) gc->heap_max = addr;
+}
+
+/**
+ * Allocate the memory of a new allocation.
+ *
+ * Large allocations get their own huge-page region if huge pages are
+ * enabled and available, everything else comes from `malloc`/`calloc`.
+ * Blocks at blacklisted addresses are held back and replaced while there is
+ * room to hold them. If no replacement can be had, the last held block is
+ * handed out after all.
+ *
+ * @param gc The garbage collector to allocate for.
+ * @param count The number of items for `calloc`, or 0 for `malloc`.
+ * @param size The size of each item, or of the whole allocation.
+ * @param tag Set to `BGC_TAG_HUGE` for huge-page regions.
+ * @returns The memory, or `NULL` if out of memory.
+ */
+PRIVATE void * bgc_heap_alloc(bgc_GC *gc, size_t count, size_t size, char *tag) {
+    if (gc->huge_pages && (!count || size <= SIZE_MAX / count)) {
+        size_t alloc_size = count ? count * size : size;
+        void *ptr = alloc_size >= BGC_HUGE_PAGE_SIZE ? bgc_huge_alloc(alloc_size) : NULL;
+        if (ptr) {
+            gc->stats.huge_page_bytes += bgc_huge_region_size(alloc_size);
+            *tag |= BGC_TAG_HUGE;
+            bgc_heap_cover(gc, ptr);
+            return ptr;
+        }
+    }
+    void *ptr = bgc_mcalloc(count, size);
+    if (ptr && bgc_blacklist_contains(&gc->blacklist, ptr)) {
+        void *first = ptr;
+        while (bgc_blacklist_contains(&gc->blacklist, ptr) && bgc_blacklist_hold(gc, ptr, count ? count * size : size)) {
+            ptr = bgc_mcalloc(count, size);
+            if (!ptr) {
+                ptr = bgc_blacklist_unhold(gc);
+                break;
+            }
+        }
+        if (ptr != first) {
+            gc->stats.blacklist_avoided++;
+        }
+    }
+    if (ptr) {
+        bgc_heap_cover(gc, ptr);
+    }
+    return ptr;
+}
+
+/**
+ * Return the memory of an allocation to the system.
+ *
+ * @param gc The garbage collector that managed the memory.
+ * @param ptr The memory.
+ * @param size The size of the allocation.
+ * @param tag The tag of the allocation.
+ */
+PRIVATE void bgc_heap_free(bgc_GC *gc, void *ptr, size_t size, char tag) {
+    if (tag & BGC_TAG_HUGE) {
+        bgc_huge_free(ptr, size);
+        gc->stats.huge_page_bytes -= bgc_huge_region_size(size);
+    } else {
+        free(ptr);
+    }
+}
+
+PRIVATE bool bgc_needs_sweep(bgc_GC *gc) {
+    return gc->allocs->size > gc->allocs->sweep_limit || gc->stats.external_bytes > gc->external_limit;
+}
+
+/**
+ * Set the mark bit of a live allocation while a lazy sweep is pending.
+ *
+ * Allocations in buckets the sweep has not reached yet are allocated black,
+ * so that the sweep keeps them. Behind the sweep cursor they are unmarked,
+ * ready for the next mark phase.
+ *
+ * @param gc The garbage collector that manages the allocation.
+ * @param alloc The allocation that was added or moved.
+ */
+PRIVATE void bgc_sweep_shade(bgc_GC *gc, bgc_Allocation *alloc) {
+    if (!gc->sweeping) {
+        return;
+    }
+    if (bgc_hash(alloc->ptr) % gc->allocs->capacity >= gc->sweep_cursor) {
+        alloc->tag |= BGC_TAG_MARK;
+    } else {
+        alloc->tag &= ~BGC_TAG_MARK;
+    }
+}
+
+PRIVATE void * bgc_allocate(bgc_GC *gc, size_t count, size_t size, bgc_Deconstructor dtor, char tag,
+                            const bgc_Layout *layout) {
+    /* Allocation logic that generalizes over malloc/calloc. */
+
+    /* Check if we reached the high-water mark and need to clean up */
+    if (bgc_needs_sweep(gc) && !gc->disabled) {
+        gc->recorder.implicit = true;
+        /* Finishing a pending lazy sweep may free enough already */
+        size_t freed_mem = gc->sweeping ? bgc_sweep(gc) : 0;
+        if (bgc_needs_sweep(gc)) {
+            freed_mem += bgc_collect(gc);
+            gc->stats.allocation_collections++;
+        }
+        gc->recorder.implicit = false;
+        LOG_DEBUG("Garbage collection cleaned up %llu bytes.", freed_mem);
+    }
+    /* With cleanup out of the way, attempt to allocate memory */
+    void *ptr = bgc_heap_alloc(gc, count, size, &tag);
+    size_t alloc_size = count ? count * size : size;
+    /* If allocation fails, force an out-of-policy run to free some memory and try again. */
+    if (!ptr && !gc->disabled && (errno == EAGAIN || errno == ENOMEM)) {
+        gc->recorder.implicit = true;
+        bgc_collect(gc);
+        gc->recorder.implicit = false;
+        ptr = bgc_heap_alloc(gc, count, size, &tag);
+    }
+    /* Start managing the memory we received from the system */
+    if (ptr) {
+        LOG_DEBUG("Allocated %zu bytes at %p", alloc_size, (void *) ptr);
+        bgc_Allocation *alloc = bgc_allocation_map_put(gc->allocs, ptr, alloc_size, dtor);
+        /* Deal with metadata allocation failure */
+        if (alloc) {
+            LOG_DEBUG("Managing %zu bytes at %p", alloc_size, (void *) alloc->ptr);
+            ptr = alloc->ptr;
+            alloc->tag |= tag;
+            alloc->layout = layout;
+            bgc_sweep_shade(gc, alloc);
+            gc->stats.total_bytes += alloc_size;
+            gc->stats.total_objects++;
+            gc->stats.live_bytes += alloc_size;
+            bgc_profile_allocation(gc, alloc);
+            BGC_RECORD(gc, BGC_RECORD_ALLOC, 3, (uintptr_t) ptr, alloc_size, dtor != NULL);
+        } else {
+            /* We failed to allocate the metadata, fail cleanly. */
+            bgc_heap_free(gc, ptr, alloc_size, tag);
+            ptr = NULL;
+        }
+    }
+    return ptr;
+}
+
+PRIVATE void bgc_make_root(bgc_GC *gc, void * const ptr) {
+    bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, ptr);
+    if (alloc) {
+        alloc->tag |= BGC_TAG_ROOT;
+    }
+}
+
+PUBLIC void * bgc_malloc(bgc_GC *gc, size_t const size) {
+    return bgc_malloc_ext(gc, size, NULL);
+}
+
+PUBLIC bgc_Array * bgc_array(bgc_GC *gc, size_t tsize, size_t count) {
+    return bgc_array_ext(gc, tsize, count, NULL);
+}
+
+/** Set the buffer and the shape of a new array. */
+PRIVATE bgc_Array * bgc_array_init(bgc_Array *array, bgc_Buffer *buffer, size_t tsize, size_t count) {
+    // Set the underlying buffer that the array represents.
+    bgc__array_set_buffer(array, buffer);
+
+    // Set the number of slots the array contains.
+    bgc__array_set_slot_count(array, count);
+
+    // Set the size of a single slot in the array.
+    bgc__array_set_slot_size(array, tsize);
+
+    return array;
+}
+
+PUBLIC bgc_Array * bgc_array_ext(bgc_GC *gc, size_t tsize, size_t count, bgc_Deconstructor dtor) {
+    size_t size = count * tsize;
+    if (tsize && size / tsize != count) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Allocate the memory required by the array.
+    bgc_Array *array = bgcx_new_ext(gc, bgc_Array, dtor);
+    if (!array) {
+        return NULL;
+    }
+
+    // Allocate an underlying buffer for the array to store its values, keeping the array alive in precise mode.
+    size_t depth = bgc_get_root_depth(gc);
+    if (!bgc_push_root(gc, (void **) &array)) {
+        return NULL;
+    }
+    bgc_Buffer *buffer = bgc_buffer(gc, size);
+    bgc_set_root_depth(gc, depth);
+    if (!buffer) {
+        return NULL;
+    }
+
+    return bgc_array_init(array, buffer, tsize, count);
+}
+
+PUBLIC bgc_Array * bgc_array_inline(bgc_GC *gc, size_t tsize, size_t count, bgc_Deconstructor dtor) {
+    size_t size = count * tsize;
+    if ((tsize && size / tsize != count) || size > SIZE_MAX - offsetof(bgc_ArrayBlock, data)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Allocate the array, its buffer and its slots in one block.
+    bgc_ArrayBlock *block = (bgc_ArrayBlock *) bgc_malloc_ext(gc, offsetof(bgc_ArrayBlock, data) + size, dtor);
+    if (!block) {
+        return NULL;
+    }
+    // Clear the padding before the slots, the mark phase scans it like any other word.
+    memset(block, 0, offsetof(bgc_ArrayBlock, data));
+    bgc__buffer_set_address(&block->buffer, block->data);
+    bgc__buffer_set_length(&block->buffer, size);
+
+    return bgc_array_init(&block->array, &block->buffer, tsize, count);
+}
+
+PUBLIC bgc_Buffer * bgc_buffer(bgc_GC *gc, size_t size) {
+    return bgc_buffer_ext(gc, size, NULL);
+}
+
+PUBLIC bgc_Buffer * bgc_buffer_ext(bgc_GC *gc, size_t size, bgc_Deconstructor dtor) {
+    // Create a new buffer, the destructor is only passed the buffer's memory.
+    bgc_Buffer *buffer = bgcx_new_ext(gc, bgc_Buffer, NULL);
+    if (!buffer) {
+        return NULL;
+    }
+
+    // Allocate the buffer's memory, keeping the buffer alive in precise mode.
+    size_t depth = bgc_get_root_depth(gc);
+    if (!bgc_push_root(gc, (void **) &buffer)) {
+        return NULL;
+    }
+    void *address = bgc_malloc_ext(gc, size, dtor);
+    bgc_set_root_depth(gc, depth);
+    if (!address) {
+        return NULL;
+    }
+    bgc__buffer_set_address(buffer, address);
+    bgc__buffer_set_length(buffer, size);
+
+    return buffer;
+}
+
+PUBLIC bgc_Buffer * bgc_buffer_inline(bgc_GC *gc, size_t size) {
+    if (size > SIZE_MAX - offsetof(bgc_BufferBlock, data)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Allocate the buffer and its memory in one block.
+    bgc_BufferBlock *block = (bgc_BufferBlock *) bgc_malloc(gc, offsetof(bgc_BufferBlock, data) + size);
+    if (!block) {
+        return NULL;
+    }
+    bgc__buffer_set_address(&block->buffer, block->data);
+    bgc__buffer_set_length(&block->buffer, size);
+
+    return &block->buffer;
+}
+
+#if defined(BGC_HAVE_MMAP)
+/** The managed part of a file-backed buffer: the buffer and the mapping it points into. */
+typedef struct bgc_MappedBuffer {
+    bgc_Buffer buffer;
+    bgc_GC *gc;
+    void *mapping;          // page-aligned start of the mapping
+    size_t mapping_length;
+} bgc_MappedBuffer;
+
+/** Unmap the file of a file-backed buffer, the deconstructor of every `bgc_MappedBuffer`. */
+PRIVATE void bgc_mapped_buffer_delete(void *ptr) {
+    bgc_MappedBuffer *mapped = (bgc_MappedBuffer *) ptr;
+    if (mapped->mapping) {
+        munmap(mapped->mapping, mapped->mapping_length);
+        mapped->gc->stats.external_bytes -= mapped->mapping_length;
+    }
+}
+#endif
+
+PUBLIC bgc_Buffer * bgc_buffer_map_file(bgc_GC *gc, int fd, off_t offset, size_t length, int prot) {
+#if defined(BGC_HAVE_MMAP)
+    if (length == 0 || offset < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    /* mmap wants a page-aligned offset, map from the start of the page */
+    long page = sysconf(_SC_PAGESIZE);
+    size_t shift = (size_t) (offset % page);
+    if (length > SIZE_MAX - shift) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    /* Allocate the block first, so that a failed allocation leaves nothing to unmap */
+    bgc_MappedBuffer *mapped = (bgc_MappedBuffer *) bgc_allocate(gc, 1, sizeof(bgc_MappedBuffer),
+                                                                 bgc_mapped_buffer_delete, BGC_TAG_ATOMIC, NULL);
+    if (!mapped) {
+        return NULL;
+    }
+    void *mapping = mmap(NULL, shift + length, prot, MAP_SHARED, fd, offset - (off_t) shift);
+    if (mapping == MAP_FAILED) {
+        bgc_free(gc, mapped);
+        return NULL;
+    }
+    mapped->gc = gc;
+    mapped->mapping = mapping;
+    mapped->mapping_length = shift + length;
+    gc->stats.external_bytes += mapped->mapping_length;
+    bgc__buffer_set_address(&mapped->buffer, (char *) mapping + shift);
+    bgc__buffer_set_length(&mapped->buffer, length);
+    return &mapped->buffer;
+#else
+    (void) gc, (void) fd, (void) offset, (void) length, (void) prot;
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+/**
+ * Find the offset of `ptr` within the items of a vector.
+ *
+ * @param vector The vector to search.
+ * @param ptr The address to find.
+ * @returns The byte offset of `ptr` from the vector's data, or `SIZE_MAX` if
+ *          `ptr` does not point at one of the vector's items.
+ */
+PRIVATE size_t bgc_vector_offset(const bgc_Vector *vector, const void *ptr) {
+    uintptr_t p = (uintptr_t) ptr;
+    uintptr_t begin = (uintptr_t) vector->data;
+    if (!vector->data || p < begin || p >= begin + vector->size * vector->item_size) {
+        return SIZE_MAX;
+    }
+    return p - begin;
+}
+
+/**
+ * Set the capacity of a vector.
+ *
+ * Reallocates the vector's data to hold exactly `capacity` items and zeroes
+ * new capacity, so that stale bytes are never scanned as pointers.
+ *
+ * @param gc The garbage collector that manages the vector.
+ * @param vector The vector to resize, with at most `capacity` items.
+ * @param capacity The new capacity.
+ * @returns `true` on success, `false` if out of memory.
+ */
+PRIVATE bool bgc_vector_set_capacity(bgc_GC *gc, bgc_Vector *vector, size_t capacity) {
+    if (capacity > SIZE_MAX / vector->item_size) {
+        errno = ENOMEM;
+        return false;
+    }
+    void *data = NULL;
+    if (capacity == 0) {
+        if (vector->data) {
+            bgc_free(gc, vector->data);
+        }
+    } else if (!vector->data) {
+        data = bgc_malloc(gc, capacity * vector->item_size);
+    } else {
+        data = bgc_realloc(gc, vector->data, capacity * vector->item_size);
+    }
+    if (capacity && !data) {
+        return false;
+    }
+    if (capacity > vector->capacity) {
+        memset((char *) data + vector->capacity * vector->item_size, 0,
+               (capacity - vector->capacity) * vector->item_size);
+    }
+    vector->data = data;
+    vector->capacity = capacity;
+    return true;
+}
+
+/**
+ * Make room for `count` items, at least doubling the capacity when it grows.
+ *
+ * @param gc The garbage collector that manages the vector.
+ * @param vector The vector to grow.
+ * @param count The number of items the vector has to hold.
+ * @returns `true` on success, `false` if out of memory.
+ */
+PRIVATE bool bgc_vector_grow(bgc_GC *gc, bgc_Vector *vector, size_t count) {
+    if (count <= vector->capacity) {
+        return true;
+    }
+    size_t capacity = vector->capacity ? 2 * vector->capacity : 4;
+    return bgc_vector_set_capacity(gc, vector, capacity > count ? capacity : count);
+}
+
+PUBLIC bgc_Vector * bgc_vector(bgc_GC *gc, size_t tsize, size_t capacity) {
+    if (tsize == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    bgc_Vector *vector = (bgc_Vector *) bgc_calloc(gc, 1, sizeof(bgc_Vector));
+    if (!vector) {
+        return NULL;
+    }
+    vector->item_size = tsize;
+    if (capacity) {
+        // Allocating the data may collect, keep the vector alive in precise mode
+        size_t depth = bgc_get_root_depth(gc);
+        if (!bgc_push_root(gc, (void **) &vector)) {
+            return NULL;
+        }
+        bool reserved = bgc_vector_set_capacity(gc, vector, capacity);
+        bgc_set_root_depth(gc, depth);
+        if (!reserved) {
+            return NULL;
+        }
+    }
+    return vector;
+}
+
+PUBLIC bool bgc_vector_reserve(bgc_GC *gc, bgc_Vector *vector, size_t capacity) {
+    return capacity <= vector->capacity || bgc_vector_set_capacity(gc, vector, capacity);
+}
+
+PUBLIC bool bgc_vector_shrink_to_fit(bgc_GC *gc, bgc_Vector *vector) {
+    return vector->size == vector->capacity || bgc_vector_set_capacity(gc, vector, vector->size);
+}
+
+PUBLIC void * bgc_vector_push(bgc_GC *gc, bgc_Vector *vector, const void *item) {
+    return bgc_vector_insert(gc, vector, vector->size, item);
+}
+
+PUBLIC bool bgc_vector_pop(bgc_Vector *vector, void *item) {
+    if (vector->size == 0) {
+        return false;
+    }
+    vector->size--;
+    char *slot = (char *) vector->data + vector->size * vector->item_size;
+    if (item) {
+        memcpy(item, slot, vector->item_size);
+    }
+    memset(slot, 0, vector->item_size);
+    return true;
+}
+
+PUBLIC void * bgc_vector_insert(bgc_GC *gc, bgc_Vector *vector, size_t index, const void *item) {
+    if (index > vector->size) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t item_size = vector->item_size;
+    // The item may be one of the vector's own, which growing can move
+    size_t offset = bgc_vector_offset(vector, item);
+    if (!bgc_vector_grow(gc, vector, vector->size + 1)) {
+        return NULL;
+    }
+    char *slot = (char *) vector->data + index * item_size;
+    memmove(slot + item_size, slot, (vector->size - index) * item_size);
+    vector->size++;
+    if (offset != SIZE_MAX) {
+        item = (char *) vector->data + offset + (offset >= index * item_size ? item_size : 0);
+    }
+    if (item) {
+        memcpy(slot, item, item_size);
+    } else {
+        memset(slot, 0, item_size);
+    }
+    return slot;
+}
+
+PUBLIC bool bgc_vector_erase(bgc_Vector *vector, size_t index) {
+    if (index >= vector->size) {
+        return false;
+    }
+    size_t item_size = vector->item_size;
+    char *slot = (char *) vector->data + index * item_size;
+    memmove(slot, slot + item_size, (vector->size - index - 1) * item_size);
+    vector->size--;
+    memset((char *) vector->data + vector->size * item_size, 0, item_size);
+    return true;
+}
+
+PUBLIC bool bgc_vector_append(bgc_GC *gc, bgc_Vector *vector, const void *items, size_t count) {
+    if (count == 0) {
+        return true;
+    }
+    if (count > SIZE_MAX - vector->size) {
+        errno = ENOMEM;
+        return false;
+    }
+    size_t offset = bgc_vector_offset(vector, items);
+    if (!bgc_vector_grow(gc, vector, vector->size + count)) {
+        return false;
+    }
+    if (offset != SIZE_MAX) {
+        items = (char *) vector->data + offset;
+    }
+    // memmove, the items may overlap the vector's own
+    memmove((char *) vector->data + vector->size * vector->item_size, items, count * vector->item_size);
+    vector->size += count;
+    return true;
+}
+
+PUBLIC bgc_Vector * bgc_vector_copy(bgc_GC *gc, const bgc_Vector *vector) {
+    bgc_Vector *copy = bgc_vector(gc, vector->item_size, vector->size);
+    if (!copy) {
+        return NULL;
+    }
+    if (vector->size) {
+        memcpy(copy->data, vector->data, vector->size * vector->item_size);
+    }
+    copy->size = vector->size;
+    return copy;
+}
+
+/*
+ * Weak references and weak maps.
+ *
+ * Both are atomic allocations, so marking never looks at their contents. The
+ * collector keeps them in the weak registry and visits them in
+ * `bgc_process_weak`, after marking and before sweeping.
+ */
+
+PRIVATE bool bgc_weak_register_ref(bgc_GC *gc, bgc_Weak *ref) {
+    bgc_WeakRegistry *weak = &gc->weak;
+    if (weak->ref_count == weak->ref_capacity) {
+        size_t new_capacity = weak->ref_capacity ? weak->ref_capacity * 2 : 16;
+        bgc_Weak **refs = (bgc_Weak **) realloc(weak->refs, new_capacity * sizeof(bgc_Weak *));
+        if (!refs) {
+            return false;
+        }
+        weak->refs = refs;
+        weak->ref_capacity = new_capacity;
+    }
+    ref->index = weak->ref_count;
+    weak->refs[weak->ref_count++] = ref;
+    return true;
+}
+
+PRIVATE bool bgc_weak_register_map(bgc_GC *gc, bgc_WeakMap *map) {
+    bgc_WeakRegistry *weak = &gc->weak;
+    if (weak->map_count == weak->map_capacity) {
+        size_t new_capacity = weak->map_capacity ? weak->map_capacity * 2 : 16;
+        bgc_WeakMap **maps = (bgc_WeakMap **) realloc(weak->maps, new_capacity * sizeof(bgc_WeakMap *));
+        if (!maps) {
+            return false;
+        }
+        weak->maps = maps;
+        weak->map_capacity = new_capacity;
+    }
+    map->index = weak->map_count;
+    weak->maps[weak->map_count++] = map;
+    return true;
+}
+
+/** Remove the weak reference at position `i` from the registry, the last one takes its place. */
+PRIVATE void bgc_weak_remove_ref_at(bgc_WeakRegistry *weak, size_t i) {
+    weak->refs[i] = weak->refs[--weak->ref_count];
+    weak->refs[i]->index = i;
+}
+
+/** Remove the weak map at position `i` from the registry, the last one takes its place. */
+PRIVATE void bgc_weak_remove_map_at(bgc_WeakRegistry *weak, size_t i) {
+    weak->maps[i] = weak->maps[--weak->map_count];
+    weak->maps[i]->index = i;
+}
+
+/**
+ * Remove a weak reference or weak map from the weak registry.
+ *
+ * Only needed for objects that are freed outside of `bgc_process_weak`,
+ * i.e. by `bgc_free` or by a sweep that did not follow a full collection.
+ * Both know their position in the registry, and their sizes tell them apart.
+ *
+ * @param gc The garbage collector that manages the object.
+ * @param ptr The weak reference or weak map.
+ * @param size The size of the allocation at `ptr`.
+ */
+PRIVATE void bgc_weak_unregister(bgc_GC *gc, void *ptr, size_t size) {
+    bgc_WeakRegistry *weak = &gc->weak;
+    if (size == sizeof(bgc_Weak)) {
+        size_t i = ((bgc_Weak *) ptr)->index;
+        if (i < weak->ref_count && weak->refs[i] == ptr) {
+            bgc_weak_remove_ref_at(weak, i);
+        }
+    } else {
+        size_t i = ((bgc_WeakMap *) ptr)->index;
+        if (i < weak->map_count && weak->maps[i] == ptr) {
+            bgc_weak_remove_map_at(weak, i);
         }
     }
-    return ptr;
 }
 
-PRIVATE void bgc_make_root(bgc_GC *gc, void * const ptr) {
-    bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, ptr);
+/** Tag the allocation at `ptr`, if any, so that `bgc_free` and moves look for weak references to it. */
+PRIVATE void bgc_weak_hold(bgc_GC *gc, void *ptr) {
+    bgc_Allocation *alloc = ptr ? bgc_allocation_map_get(gc->allocs, ptr) : NULL;
     if (alloc) {
-        alloc->tag |= BGC_TAG_ROOT;
+        alloc->tag |= BGC_TAG_WEAKLY_HELD;
     }
 }
 
-PUBLIC void * bgc_malloc(bgc_GC *gc, size_t const size) {
-    return bgc_malloc_ext(gc, size, NULL);
+PRIVATE void bgc_weak_registry_delete(bgc_WeakRegistry *weak) {
+    free(weak->refs);
+    free(weak->maps);
+    memset(weak, 0, sizeof(bgc_WeakRegistry));
 }
 
-PUBLIC bgc_Array * bgc_array(bgc_GC *gc, size_t tsize, size_t count) {
-    return bgc_array_ext(gc, tsize, count, NULL);
+/**
+ * Move the weak references to `from` and the weak map entries with the key `from` to `to`.
+ *
+ * For allocations tagged `BGC_TAG_WEAKLY_HELD` that are freed with `bgc_free`
+ * (`to` is `NULL`) or moved by `bgc_realloc`: the next collection cannot tell
+ * the old address apart from a new allocation placed there. Entries that
+ * cannot be moved for lack of memory are dropped.
+ *
+ * @param gc The garbage collector that manages the weak references and weak maps.
+ * @param from The old address of the allocation.
+ * @param to The new address of the allocation, or `NULL` if it is freed.
+ */
+PRIVATE void bgc_weak_move(bgc_GC *gc, void *from, void *to) {
+    bgc_WeakRegistry *weak = &gc->weak;
+    for (size_t i = 0; i < weak->ref_count; ++i) {
+        if (weak->refs[i]->target == from) {
+            weak->refs[i]->target = to;
+            if (!to) {
+                gc->stats.weak_cleared++;
+            }
+        }
+    }
+    for (size_t i = 0; i < weak->map_count; ++i) {
+        bgc_WeakMap *map = weak->maps[i];
+        void *value = bgc_weak_map_get(map, from);
+        if (!bgc_weak_map_remove(map, from)) {
+            continue;
+        }
+        if (!to || !bgc_weak_map_put(map, to, value)) {
+            gc->stats.weak_cleared++;
+        }
+    }
 }
 
-PUBLIC bgc_Array * bgc_array_ext(bgc_GC *gc, size_t tsize, size_t count, bgc_Deconstructor dtor) {
-    // Allocate the memory required by the array.
-    bgc_Array *array = bgcx_new_ext(gc, bgc_Array, dtor);
+PUBLIC bgc_Weak * bgc_weak(bgc_GC *gc, void *target) {
+    bgc_Weak *ref = (bgc_Weak *) bgc_allocate(gc, 0, sizeof(bgc_Weak), NULL, BGC_TAG_ATOMIC | BGC_TAG_WEAK, NULL);
+    if (!ref) {
+        return NULL;
+    }
+    ref->target = target;
+    if (!bgc_weak_register_ref(gc, ref)) {
+        bgc_free(gc, ref);
+        return NULL;
+    }
+    bgc_weak_hold(gc, target);
+    return ref;
+}
 
-    // Allocate an underlying buffer for the array to store its values.
-    bgc_Buffer *buffer = bgc_buffer(gc, count * tsize);
+PUBLIC void * bgc_weak_get(const bgc_Weak *weak) {
+    return weak->target;
+}
 
-    // Set the underlying buffer that the array represents.
-    bgc__array_set_buffer(array, buffer);
+/** Free the slots of a weak map, the deconstructor of every weak map. */
+PRIVATE void bgc_weak_map_delete(void *ptr) {
+    free(((bgc_WeakMap *) ptr)->entries);
+}
 
-    // Set the number of slots the array contains.
-    bgc__array_set_slot_count(array, count);
+PRIVATE size_t bgc_weak_map_hash(const void *entry) {
+    return bgc_hash(((const bgc_WeakMapEntry *) entry)->key);
+}
 
-    // Set the size of a single slot in the array.
-    bgc__array_set_slot_size(array, tsize);
+PRIVATE bool bgc_weak_map_match(const void *entry, const void *key) {
+    return ((const bgc_WeakMapEntry *) entry)->key == key;
+}
 
-    return array;
+PRIVATE const bgc_TableType bgc_weak_map_type = { sizeof(bgc_WeakMapEntry), bgc_weak_map_hash, bgc_weak_map_match };
+
+/** Find the slot of a key, or the free slot where it would be inserted. */
+PRIVATE size_t bgc_weak_map_find(const bgc_WeakMap *map, const void *key) {
+    return bgc_table_find(&bgc_weak_map_type, map->entries, map->capacity, bgc_hash((void *) key), key);
 }
 
-PUBLIC bgc_Buffer * bgc_buffer(bgc_GC *gc, size_t size) {
-    return bgc_buffer_ext(gc, size, NULL);
+/** Remove the entry in slot `i`. */
+PRIVATE void bgc_weak_map_remove_at(bgc_WeakMap *map, size_t i) {
+    bgc_table_remove_at(&bgc_weak_map_type, map->entries, map->capacity, i);
+    map->size--;
 }
 
-PUBLIC bgc_Buffer * bgc_buffer_ext(bgc_GC *gc, size_t size, bgc_Deconstructor dtor) {
-    // Create a new buffer.
-    bgc_Buffer *buffer = bgcx_new_ext(gc, bgc_Buffer, dtor);
+/**
+ * Rehash a weak map into `capacity` slots.
+ *
+ * @returns `true` on success, `false` if out of memory *(the map is unchanged)*.
+ */
+PRIVATE bool bgc_weak_map_resize(bgc_WeakMap *map, size_t capacity) {
+    bgc_WeakMapEntry *entries = (bgc_WeakMapEntry *) bgc_table_rehash(&bgc_weak_map_type, map->entries,
+                                                                      map->capacity, capacity);
+    if (!entries) {
+        return false;
+    }
+    free(map->entries);
+    map->entries = entries;
+    map->capacity = capacity;
+    return true;
+}
 
-    // If a destructor was provided:
-    if (dtor == NULL) {
-        // Allocate the buffer's memory.
-        bgc__buffer_set_address(buffer, bgc_malloc(gc, size));
-        bgc__buffer_set_length(buffer, size);
+PUBLIC bgc_WeakMap * bgc_weak_map(bgc_GC *gc, size_t capacity) {
+    size_t slots = 8;
+    while (slots / 4 * 3 < capacity) {
+        if (slots > SIZE_MAX / 2 / sizeof(bgc_WeakMapEntry)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        slots *= 2;
     }
-    // Otherwise:
-    else {
-        // Allocate the buffer's memory.
-        bgc__buffer_set_address(buffer, bgc_malloc_ext(gc, size, dtor));
-        bgc__buffer_set_length(buffer, size);
+    bgc_WeakMap *map = (bgc_WeakMap *) bgc_allocate(gc, 1, sizeof(bgc_WeakMap), bgc_weak_map_delete,
+                                                    BGC_TAG_ATOMIC | BGC_TAG_WEAK, NULL);
+    if (!map) {
+        return NULL;
+    }
+    map->entries = (bgc_WeakMapEntry *) calloc(slots, sizeof(bgc_WeakMapEntry));
+    map->gc = gc;
+    if (!map->entries || !bgc_weak_register_map(gc, map)) {
+        bgc_free(gc, map);
+        return NULL;
     }
+    map->capacity = slots;
+    return map;
+}
 
-    return buffer;
+PUBLIC bool bgc_weak_map_put(bgc_WeakMap *map, void *key, void *value) {
+    if (!key) {
+        errno = EINVAL;
+        return false;
+    }
+    size_t i = bgc_weak_map_find(map, key);
+    if (!map->entries[i].key) {
+        /* Keep the load factor at or below 3/4 */
+        if ((map->size + 1) > map->capacity / 4 * 3) {
+            if (!bgc_weak_map_resize(map, map->capacity * 2)) {
+                return false;
+            }
+            i = bgc_weak_map_find(map, key);
+        }
+        map->entries[i].key = key;
+        map->size++;
+        bgc_weak_hold(map->gc, key);
+    }
+    map->entries[i].value = value;
+    return true;
+}
+
+PUBLIC void * bgc_weak_map_get(const bgc_WeakMap *map, const void *key) {
+    if (!key) {
+        return NULL;
+    }
+    return map->entries[bgc_weak_map_find(map, key)].value;
+}
+
+PUBLIC bool bgc_weak_map_remove(bgc_WeakMap *map, const void *key) {
+    if (!key) {
+        return false;
+    }
+    size_t i = bgc_weak_map_find(map, key);
+    if (!map->entries[i].key) {
+        return false;
+    }
+    bgc_weak_map_remove_at(map, i);
+    return true;
+}
+
+/*
+ * String interning.
+ *
+ * The intern table maps string contents to one managed copy. Its slots are
+ * plain `malloc`ed memory and never scanned, so the table holds its strings
+ * weakly: `bgc_process_weak` drops the entries of unmarked strings.
+ */
+
+/** Hash a string with 64-bit FNV-1a. */
+PRIVATE size_t bgc_intern_hash(const char *str, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) str[i];
+        hash *= 0x100000001b3ull;
+    }
+    return (size_t) hash;
+}
+
+PRIVATE size_t bgc_intern_entry_hash(const void *entry) {
+    return ((const bgc_InternEntry *) entry)->hash;
+}
+
+/** Compare an entry with a key, an entry of the string to find. */
+PRIVATE bool bgc_intern_match(const void *entry, const void *key) {
+    const bgc_InternEntry *e = (const bgc_InternEntry *) entry;
+    const bgc_InternEntry *k = (const bgc_InternEntry *) key;
+    return e->hash == k->hash && e->length == k->length && memcmp(e->str, k->str, k->length) == 0;
+}
+
+PRIVATE const bgc_TableType bgc_intern_type = { sizeof(bgc_InternEntry), bgc_intern_entry_hash, bgc_intern_match };
+
+/**
+ * Find the slot of a string, or the free slot where it would be inserted.
+ *
+ * @param table The intern table *(with at least one free slot)*.
+ * @param str The string to find.
+ * @param len The length of `str`.
+ * @param hash The hash of `str`.
+ * @returns The index of the slot.
+ */
+PRIVATE size_t bgc_intern_find(const bgc_InternTable *table, const char *str, size_t len, size_t hash) {
+    bgc_InternEntry key = { str, len, hash };
+    return bgc_table_find(&bgc_intern_type, table->entries, table->capacity, hash, &key);
+}
+
+/** Remove the entry in slot `i`. */
+PRIVATE void bgc_intern_remove_at(bgc_InternTable *table, size_t i) {
+    bgc_table_remove_at(&bgc_intern_type, table->entries, table->capacity, i);
+    table->size--;
+}
+
+/**
+ * Remove an interned string that is freed outside of `bgc_process_weak`.
+ *
+ * @param gc The garbage collector that manages the string.
+ * @param str The interned string, still readable.
+ * @param len The length of `str`.
+ */
+PRIVATE void bgc_intern_forget(bgc_GC *gc, const char *str, size_t len) {
+    bgc_InternTable *table = &gc->interned;
+    if (!table->size) {
+        return;
+    }
+    size_t i = bgc_intern_find(table, str, len, bgc_intern_hash(str, len));
+    if (table->entries[i].str == str) {
+        bgc_intern_remove_at(table, i);
+    }
+}
+
+PRIVATE bool bgc_intern_resize(bgc_InternTable *table, size_t capacity) {
+    bgc_InternEntry *entries = (bgc_InternEntry *) bgc_table_rehash(&bgc_intern_type, table->entries,
+                                                                    table->capacity, capacity);
+    if (!entries) {
+        return false;
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+    return true;
+}
+
+PUBLIC const char * bgc_intern(bgc_GC *gc, const char *str, size_t len) {
+    bgc_InternTable *table = &gc->interned;
+    size_t hash = bgc_intern_hash(str, len);
+    if (table->size) {
+        const char *found = table->entries[bgc_intern_find(table, str, len, hash)].str;
+        if (found) {
+            return found;
+        }
+    }
+    /* Allocating may collect and drop entries, so the slot is only searched afterwards */
+    char *copy = (char *) bgc_allocate(gc, 0, len + 1, NULL, BGC_TAG_ATOMIC | BGC_TAG_INTERNED, NULL);
+    if (!copy) {
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    /* Keep the load factor at or below 3/4 */
+    if ((table->size + 1) > table->capacity / 4 * 3
+        && !bgc_intern_resize(table, table->capacity ? table->capacity * 2 : 64)) {
+        bgc_free(gc, copy);
+        return NULL;
+    }
+    bgc_InternEntry *entry = &table->entries[bgc_intern_find(table, copy, len, hash)];
+    entry->str = copy;
+    entry->length = len;
+    entry->hash = hash;
+    table->size++;
+    return copy;
 }
 
 PUBLIC void * bgc_malloc_static(bgc_GC *gc, size_t size, bgc_Deconstructor dtor) {
@@ -428,7 +2347,19 @@ PUBLIC void * bgc_make_static(bgc_GC *gc, void *ptr) {
 }
 
 PUBLIC void * bgc_malloc_ext(bgc_GC *gc, size_t size, bgc_Deconstructor dtor) {
-    return bgc_allocate(gc, 0, size, dtor);
+    return bgc_allocate(gc, 0, size, dtor, BGC_TAG_NONE, NULL);
+}
+
+PUBLIC void * bgc_malloc_atomic(bgc_GC *gc, size_t size) {
+    return bgc_malloc_atomic_ext(gc, size, NULL);
+}
+
+PUBLIC void * bgc_malloc_atomic_ext(bgc_GC *gc, size_t size, bgc_Deconstructor dtor) {
+    return bgc_allocate(gc, 0, size, dtor, BGC_TAG_ATOMIC, NULL);
+}
+
+PUBLIC void * bgc_malloc_typed(bgc_GC *gc, size_t size, const bgc_Layout *layout, bgc_Deconstructor dtor) {
+    return bgc_allocate(gc, 0, size, dtor, BGC_TAG_NONE, layout);
 }
 
 PUBLIC void * bgc_calloc(bgc_GC *gc, size_t count, size_t size) {
@@ -437,9 +2368,53 @@ PUBLIC void * bgc_calloc(bgc_GC *gc, size_t count, size_t size) {
 
 PUBLIC void * bgc_calloc_ext(bgc_GC *gc, size_t count, size_t size,
                     bgc_Deconstructor dtor) {
-    return bgc_allocate(gc, count, size, dtor);
+    return bgc_allocate(gc, count, size, dtor, BGC_TAG_NONE, NULL);
+}
+
+
+/**
+ * Query how many bytes of a malloc'd block are usable.
+ *
+ * @param ptr The block to query.
+ * @returns The usable size of the block, or 0 if the platform cannot tell.
+ */
+PRIVATE size_t bgc_usable_size(void *ptr) {
+#if defined(__GLIBC__)
+    return malloc_usable_size(ptr);
+#elif defined(__APPLE__)
+    return malloc_size(ptr);
+#else
+    (void) ptr;
+    return 0;
+#endif
 }
 
+/**
+ * Resize the memory of an allocation that is, or is about to become, a huge-page region.
+ *
+ * A region keeps its address while the new size rounds up to the same
+ * number of huge pages. Otherwise the contents move to new memory, which is
+ * a huge-page region again if it is large enough.
+ *
+ * @param gc The garbage collector that manages the allocation.
+ * @param alloc The allocation to resize, its tag is updated.
+ * @param size The new size.
+ * @returns The new address of the memory, or `NULL` if out of memory.
+ */
+PRIVATE void * bgc_realloc_huge(bgc_GC *gc, bgc_Allocation *alloc, size_t size) {
+    if ((alloc->tag & BGC_TAG_HUGE) && bgc_huge_region_size(size) == bgc_huge_region_size(alloc->size)) {
+        return alloc->ptr;
+    }
+    char tag = BGC_TAG_NONE;
+    void *q = bgc_heap_alloc(gc, 0, size, &tag);
+    if (!q) {
+        return NULL;
+    }
+    memcpy(q, alloc->ptr, size < alloc->size ? size : alloc->size);
+    bgc_heap_free(gc, alloc->ptr, alloc->size, alloc->tag);
+    alloc->tag = (char) ((alloc->tag & ~BGC_TAG_HUGE) | tag);
+    return q;
+}
 
 PUBLIC void * bgc_realloc(bgc_GC *gc, void *p, size_t size) {
     bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, p);
@@ -448,78 +2423,445 @@ PUBLIC void * bgc_realloc(bgc_GC *gc, void *p, size_t size) {
         errno = EINVAL;
         return NULL;
     }
-    void *q = realloc(p, size);
+    if (alloc && (alloc->tag & BGC_TAG_INTERNED)) {
+        /* The contents may change even in place, the string is no longer canonical */
+        bgc_intern_forget(gc, (const char *) p, alloc->size - 1);
+        alloc->tag &= ~BGC_TAG_INTERNED;
+    }
+    bool huge = alloc && ((alloc->tag & BGC_TAG_HUGE) || (gc->huge_pages && size >= BGC_HUGE_PAGE_SIZE));
+    size_t request = size;
+    if (alloc && size > alloc->size && !huge) {
+        if (size <= bgc_usable_size(p)) {
+            /* Grow into the slack of the block without calling into libc */
+            gc->stats.live_bytes = gc->stats.live_bytes - alloc->size + size;
+            BGC_RECORD(gc, BGC_RECORD_REALLOC, 3, (uintptr_t) p, (uintptr_t) p, size);
+            alloc->size = size;
+            return p;
+        }
+#if defined(BGC_HAVE_USABLE_SIZE)
+        /*
+         * Leave room to grow by half again in place, so that appending to a
+         * buffer one element at a time only moves it O(log n) times.
+         */
+        size_t growth = alloc->size + alloc->size / 2;
+        if (growth > size && growth > alloc->size) {
+            request = growth;
+        }
+#endif
+    }
+    bool sampled = alloc && (alloc->tag & BGC_TAG_SAMPLED);
+    void *q = huge ? bgc_realloc_huge(gc, alloc, size) : realloc(p, request);
     if (!q) {
         // realloc failed but p is still valid
         return NULL;
     }
-    if (!p) {
-        // allocation, not reallocation
-        bgc_Allocation *alloc = bgc_allocation_map_put(gc->allocs, q, size, NULL);
-        return alloc->ptr;
+    bgc_heap_cover(gc, q);
+    if (!p) {
+        // allocation, not reallocation
+        bgc_Allocation *alloc = bgc_allocation_map_put(gc->allocs, q, size, NULL);
+        bgc_sweep_shade(gc, alloc);
+        gc->stats.total_bytes += size;
+        gc->stats.total_objects++;
+        gc->stats.live_bytes += size;
+        bgc_profile_allocation(gc, alloc);
+        BGC_RECORD(gc, BGC_RECORD_ALLOC, 3, (uintptr_t) q, size, 0);
+        return alloc->ptr;
+    }
+    gc->stats.live_bytes = gc->stats.live_bytes - alloc->size + size;
+    BGC_RECORD(gc, BGC_RECORD_REALLOC, 3, (uintptr_t) alloc->ptr, (uintptr_t) q, size);
+    if (q != alloc->ptr) {
+        // successful reallocation w/ copy, the allocation keeps its metadata
+        bgc_allocation_map_rekey(gc->allocs, alloc, q);
+        bgc_sweep_shade(gc, alloc);
+        if (sampled) {
+            /* The sample follows the allocation to its new address */
+            bgc_profile_move(gc, p, q);
+        }
+        if (alloc->tag & BGC_TAG_WEAKLY_HELD) {
+            /* So do weak references and weak map keys */
+            bgc_weak_move(gc, p, q);
+        }
+    }
+    alloc->size = size;
+    return q;
+}
+
+PUBLIC void bgc_free(bgc_GC *gc, void *ptr) {
+    bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, ptr);
+    if (alloc) {
+        if (alloc->dtor) {
+            alloc->dtor(ptr);
+            gc->stats.dtors_run++;
+        }
+        gc->stats.live_bytes -= alloc->size;
+        if (alloc->tag & BGC_TAG_SAMPLED) {
+            bgc_profile_forget(gc, ptr);
+        }
+        if (alloc->tag & BGC_TAG_WEAK) {
+            bgc_weak_unregister(gc, ptr, alloc->size);
+        }
+        if (alloc->tag & BGC_TAG_WEAKLY_HELD) {
+            bgc_weak_move(gc, ptr, NULL);
+        }
+        if (alloc->tag & BGC_TAG_INTERNED) {
+            bgc_intern_forget(gc, (const char *) ptr, alloc->size - 1);
+        }
+        BGC_RECORD(gc, BGC_RECORD_FREE, 1, (uintptr_t) ptr, 0, 0);
+        size_t size = alloc->size;
+        char tag = alloc->tag;
+        bgc_allocation_map_remove(gc->allocs, ptr, true);
+        bgc_heap_free(gc, ptr, size, tag);
+    } else {
+        LOG_WARNING("Ignoring request to free unknown pointer %p", (void *) ptr);
+    }
+}
+
+PUBLIC bool bgc_set_dtor(bgc_GC *gc, void *ptr, bgc_Deconstructor dtor) {
+    bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, ptr);
+    if (!alloc) {
+        return false;
+    }
+    return bgc_allocation_map_set_dtor(gc->allocs, alloc, dtor);
+}
+
+PUBLIC void bgc_start(bgc_GC *gc, void *stack_bp) {
+    bgc_start_ext(gc, stack_bp, 1024, 1024, 0.2, 0.8, 0.5);
+}
+
+PUBLIC void bgc_start_ext(bgc_GC *gc,
+                  void *stack_bp,
+                  size_t initial_capacity,
+                  size_t min_capacity,
+                  double downsize_load_factor,
+                  double upsize_load_factor,
+                  double sweep_factor) {
+    double downsize_limit = downsize_load_factor > 0.0 ? downsize_load_factor : 0.2;
+    double upsize_limit = upsize_load_factor > 0.0 ? upsize_load_factor : 0.8;
+    sweep_factor = sweep_factor > 0.0 ? sweep_factor : 0.5;
+    gc->disabled = false;
+    gc->stack_bp = stack_bp;
+    gc->roots = NULL;
+    gc->root_count = 0;
+    gc->root_capacity = 0;
+    gc->precise_roots = false;
+    gc->shadow_stack = NULL;
+    gc->shadow_depth = 0;
+    gc->shadow_capacity = 0;
+    memset(&gc->stats, 0, sizeof(bgc_Stats));
+    gc->tracer.callback = NULL;
+    gc->tracer.ctx = NULL;
+    memset(&gc->profiler, 0, sizeof(bgc_Profiler));
+    memset(&gc->recorder, 0, sizeof(bgc_Recorder));
+    memset(&gc->weak, 0, sizeof(bgc_WeakRegistry));
+    memset(&gc->interned, 0, sizeof(bgc_InternTable));
+    gc->external_limit = BGC_EXTERNAL_LIMIT;
+    gc->huge_pages = false;
+    gc->sweeping = false;
+    gc->sweep_cursor = 0;
+    gc->survivors = 0;
+    gc->heap_min = UINTPTR_MAX;
+    gc->heap_max = 0;
+    gc->blacklisting = false;
+    memset(&gc->blacklist, 0, sizeof(bgc_Blacklist));
+    gc->misaligned_pointer = false;
+    initial_capacity = initial_capacity < min_capacity ? min_capacity : initial_capacity;
+    gc->allocs = bgc_allocation_map_new(min_capacity, initial_capacity,
+                                       sweep_factor, downsize_limit, upsize_limit);
+    gc->allocs->tracer = &gc->tracer;
+    LOG_DEBUG("Created new garbage collector (cap=%lld, siz=%lld).", (uint64_t)(gc->allocs->capacity),
+              (uint64_t)(gc->allocs->size));
+}
+
+PUBLIC void bgc_set_tracer(bgc_GC *gc, bgc_TraceCallback callback, void *ctx) {
+    gc->tracer.callback = callback;
+    gc->tracer.ctx = ctx;
+}
+
+PRIVATE const char * const bgc_phase_names[] = {
+    "collect", "mark_roots", "mark_stack", "sweep", "map_resize", "dtor_batch", "weak", "collect_step"
+};
+
+PUBLIC void bgc_chrome_trace_open(bgc_ChromeTrace *trace, FILE *out) {
+    trace->out = out;
+    trace->events = 0;
+    trace->pid = 1;
+    trace->tid = 1;
+    fputs("[", out);
+}
+
+PUBLIC void bgc_chrome_trace_callback(const bgc_TraceEvent *event, void *ctx) {
+    bgc_ChromeTrace *trace = (bgc_ChromeTrace *) ctx;
+    /* Duration events ("B"/"E") with microsecond timestamps */
+    fprintf(trace->out,
+            "%s\n{\"name\":\"%s\",\"cat\":\"bgc\",\"ph\":\"%s\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d,\"args\":{\"count\":%llu}}",
+            trace->events ? "," : "",
+            bgc_phase_names[event->phase],
+            event->begin ? "B" : "E",
+            (unsigned long long) (event->timestamp_ns / 1000),
+            (unsigned) (event->timestamp_ns % 1000),
+            trace->pid,
+            trace->tid,
+            (unsigned long long) event->count);
+    trace->events++;
+}
+
+PUBLIC void bgc_chrome_trace_close(bgc_ChromeTrace *trace) {
+    fputs("\n]\n", trace->out);
+    fflush(trace->out);
+}
+
+PUBLIC void bgc_disable(bgc_GC *gc) {
+    gc->disabled = true;
+}
+
+PUBLIC void bgc_enable(bgc_GC *gc) {
+    gc->disabled = false;
+}
+
+/**
+ * Replace the root ranges `[from, to)` with `count` new ranges.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param from The index of the first root range to replace.
+ * @param to The index one past the last root range to replace.
+ * @param ranges The replacement ranges (already sorted).
+ * @param count The number of replacement ranges.
+ * @returns `false` if the set could not grow *(it is unchanged)*.
+ */
+PRIVATE bool bgc_root_ranges_splice(bgc_GC *gc, size_t from, size_t to,
+                                    const bgc_RootRange *ranges, size_t count) {
+    size_t new_count = gc->root_count - (to - from) + count;
+    if (new_count > gc->root_capacity) {
+        size_t new_capacity = gc->root_capacity ? gc->root_capacity * 2 : 8;
+        bgc_RootRange *roots = (bgc_RootRange *) realloc(gc->roots, new_capacity * sizeof(bgc_RootRange));
+        if (!roots) {
+            LOG_CRITICAL("Failed to grow the root range set to %zu entries", new_capacity);
+            return false;
+        }
+        gc->roots = roots;
+        gc->root_capacity = new_capacity;
+    }
+    memmove(gc->roots + from + count, gc->roots + to, (gc->root_count - to) * sizeof(bgc_RootRange));
+    memcpy(gc->roots + from, ranges, count * sizeof(bgc_RootRange));
+    gc->root_count = new_count;
+    return true;
+}
+
+/**
+ * Find the first root range that ends after `ptr`.
+ *
+ * The ranges are sorted and disjoint, so their ends are sorted as well and
+ * we can use binary search.
+ */
+PRIVATE size_t bgc_root_ranges_lower_bound(bgc_GC *gc, char *ptr) {
+    size_t lo = 0, hi = gc->root_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((char *) gc->roots[mid].end <= ptr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+PUBLIC bool bgc_add_roots(bgc_GC *gc, void *begin, void *end) {
+    if ((char *) begin >= (char *) end) {
+        return true;
+    }
+    LOG_DEBUG("Adding root range [%p, %p)", begin, end);
+    /* Merge with every range that overlaps or touches [begin, end) */
+    bgc_RootRange merged = { begin, end };
+    size_t from = bgc_root_ranges_lower_bound(gc, (char *) begin);
+    if (from > 0 && gc->roots[from - 1].end == begin) {
+        --from;
+    }
+    size_t to = from;
+    while (to < gc->root_count && (char *) gc->roots[to].begin <= (char *) end) {
+        if ((char *) gc->roots[to].begin < (char *) merged.begin) merged.begin = gc->roots[to].begin;
+        if ((char *) gc->roots[to].end > (char *) merged.end) merged.end = gc->roots[to].end;
+        ++to;
+    }
+    return bgc_root_ranges_splice(gc, from, to, &merged, 1);
+}
+
+PUBLIC void bgc_remove_roots(bgc_GC *gc, void *begin, void *end) {
+    if ((char *) begin >= (char *) end) {
+        return;
+    }
+    LOG_DEBUG("Removing root range [%p, %p)", begin, end);
+    size_t from = bgc_root_ranges_lower_bound(gc, (char *) begin);
+    size_t to = from;
+    while (to < gc->root_count && (char *) gc->roots[to].begin < (char *) end) {
+        ++to;
+    }
+    if (from == to) {
+        return;
+    }
+    /* Keep whatever sticks out on either side of [begin, end) */
+    bgc_RootRange remnants[2];
+    size_t count = 0;
+    if ((char *) gc->roots[from].begin < (char *) begin) {
+        remnants[count].begin = gc->roots[from].begin;
+        remnants[count++].end = begin;
+    }
+    if ((char *) gc->roots[to - 1].end > (char *) end) {
+        remnants[count].begin = end;
+        remnants[count++].end = gc->roots[to - 1].end;
+    }
+    /* Splitting a range may fail to grow the set, the whole range then stays rooted, which is safe */
+    bgc_root_ranges_splice(gc, from, to, remnants, count);
+}
+
+PUBLIC bool bgc_add_static_roots(bgc_GC *gc) {
+#if defined(__linux__)
+    /* Walk the program headers of the executable and add its writable
+     * PT_LOAD segments, which hold .data and .bss. */
+#if UINTPTR_MAX > 0xffffffffu
+    typedef Elf64_Phdr bgc_Phdr;
+#else
+    typedef Elf32_Phdr bgc_Phdr;
+#endif
+    const bgc_Phdr *phdrs = (const bgc_Phdr *) getauxval(AT_PHDR);
+    size_t phnum = (size_t) getauxval(AT_PHNUM);
+    if (!phdrs || !phnum) {
+        return false;
+    }
+    /* The load bias of position-independent executables */
+    uintptr_t bias = 0;
+    for (size_t i = 0; i < phnum; ++i) {
+        if (phdrs[i].p_type == PT_PHDR) {
+            bias = (uintptr_t) phdrs - (uintptr_t) phdrs[i].p_vaddr;
+        }
+    }
+    bool found = false;
+    for (size_t i = 0; i < phnum; ++i) {
+        if (phdrs[i].p_type == PT_LOAD && (phdrs[i].p_flags & PF_W)) {
+            char *begin = (char *) (bias + phdrs[i].p_vaddr);
+            if (!bgc_add_roots(gc, begin, begin + phdrs[i].p_memsz)) {
+                return false;
+            }
+            found = true;
+        }
+    }
+    return found;
+#elif defined(__APPLE__)
+    unsigned long size = 0;
+    uint8_t *data = getsegmentdata((const struct mach_header_64 *) _dyld_get_image_header(0), "__DATA", &size);
+    if (!data || !size) {
+        return false;
     }
-    if (p == q) {
-        // successful reallocation w/o copy
-        alloc->size = size;
-    } else {
-        // successful reallocation w/ copy
-        bgc_Deconstructor dtor = alloc->dtor;
-        bgc_allocation_map_remove(gc->allocs, p, true);
-        bgc_allocation_map_put(gc->allocs, q, size, dtor);
+    return bgc_add_roots(gc, data, data + size);
+#else
+    (void) gc;
+    return false;
+#endif
+}
+
+PUBLIC void bgc_set_precise_roots(bgc_GC *gc, bool enabled) {
+    gc->precise_roots = enabled;
+}
+
+PUBLIC bool bgc_set_huge_pages(bgc_GC *gc, bool enabled) {
+    /* Allocations and the bucket array move into huge-page regions as they are (re)allocated */
+    gc->huge_pages = enabled;
+    gc->allocs->huge_pages = enabled;
+#if defined(BGC_HAVE_HUGE_PAGES)
+    return true;
+#else
+    return false;
+#endif
+}
+
+PUBLIC void bgc_set_blacklisting(bgc_GC *gc, bool enabled) {
+    gc->blacklisting = enabled;
+    if (!enabled) {
+        bgc_blacklist_clear(&gc->blacklist);
+        bgc_blacklist_release(gc, true);
     }
-    return q;
 }
 
-PUBLIC void bgc_free(bgc_GC *gc, void *ptr) {
-    bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, ptr);
-    if (alloc) {
-        if (alloc->dtor) {
-            alloc->dtor(ptr);
+PUBLIC bool bgc_push_root(bgc_GC *gc, void **slot) {
+    if (gc->shadow_depth == gc->shadow_capacity) {
+        size_t new_capacity = gc->shadow_capacity ? gc->shadow_capacity * 2 : 64;
+        void ***shadow_stack = (void ***) realloc(gc->shadow_stack, new_capacity * sizeof(void **));
+        if (!shadow_stack) {
+            LOG_CRITICAL("Failed to grow the shadow stack to %zu slots", new_capacity);
+            return false;
         }
-        bgc_allocation_map_remove(gc->allocs, ptr, true);
-        free(ptr);
-    } else {
-        LOG_WARNING("Ignoring request to free unknown pointer %p", (void *) ptr);
+        gc->shadow_stack = shadow_stack;
+        gc->shadow_capacity = new_capacity;
     }
+    gc->shadow_stack[gc->shadow_depth++] = slot;
+    return true;
 }
 
-PUBLIC void bgc_start(bgc_GC *gc, void *stack_bp) {
-    bgc_start_ext(gc, stack_bp, 1024, 1024, 0.2, 0.8, 0.5);
+PUBLIC void bgc_pop_roots(bgc_GC *gc, size_t count) {
+    gc->shadow_depth = count < gc->shadow_depth ? gc->shadow_depth - count : 0;
 }
 
-PUBLIC void bgc_start_ext(bgc_GC *gc,
-                  void *stack_bp,
-                  size_t initial_capacity,
-                  size_t min_capacity,
-                  double downsize_load_factor,
-                  double upsize_load_factor,
-                  double sweep_factor) {
-    double downsize_limit = downsize_load_factor > 0.0 ? downsize_load_factor : 0.2;
-    double upsize_limit = upsize_load_factor > 0.0 ? upsize_load_factor : 0.8;
-    sweep_factor = sweep_factor > 0.0 ? sweep_factor : 0.5;
-    gc->disabled = false;
-    gc->stack_bp = stack_bp;
-    initial_capacity = initial_capacity < min_capacity ? min_capacity : initial_capacity;
-    gc->allocs = bgc_allocation_map_new(min_capacity, initial_capacity,
-                                       sweep_factor, downsize_limit, upsize_limit);
-    LOG_DEBUG("Created new garbage collector (cap=%lld, siz=%lld).", (uint64_t)(gc->allocs->capacity),
-              (uint64_t)(gc->allocs->size));
+PUBLIC size_t bgc_get_root_depth(bgc_GC *gc) {
+    return gc->shadow_depth;
 }
 
-PUBLIC void bgc_disable(bgc_GC *gc) {
-    gc->disabled = true;
+PUBLIC void bgc_set_root_depth(bgc_GC *gc, size_t depth) {
+    if (depth < gc->shadow_depth) {
+        gc->shadow_depth = depth;
+    }
 }
 
-PUBLIC void bgc_enable(bgc_GC *gc) {
-    gc->disabled = false;
+/**
+ * Check whether a word of an allocation with a layout holds a pointer.
+ *
+ * @param layout The layout of the allocation.
+ * @param word The index of the pointer-sized word within the allocation.
+ * @returns `true` if the layout declares the word as a pointer slot.
+ */
+PRIVATE bool bgc_layout_has_pointer(const bgc_Layout *layout, size_t word) {
+    size_t words = layout->size / BGC_PTRSIZE;
+    if (!words) {
+        return false;
+    }
+    word %= words;
+    return (layout->bitmap[word / BGC_LAYOUT_BITS] >> (word % BGC_LAYOUT_BITS)) & 1;
 }
 
 PUBLIC void bgc_mark_alloc(bgc_GC *gc, void *ptr) {
+    uintptr_t addr = (uintptr_t) ptr;
+    if (addr < gc->heap_min || addr > gc->heap_max) {
+        /* Most scanned words are small integers or point elsewhere, skip the lookup */
+        return;
+    }
     bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, ptr);
+    if (!alloc && gc->blacklisting && !(addr & (BGC_PTRSIZE - 1))) {
+        /* A near miss, keep the allocator from placing an object here */
+        bgc_blacklist_add(&gc->blacklist, addr);
+    }
     /* Mark if alloc exists and is not tagged already, otherwise skip */
     if (alloc && !(alloc->tag & BGC_TAG_MARK)) {
         LOG_DEBUG("Marking allocation (ptr=%p)", ptr);
         alloc->tag |= BGC_TAG_MARK;
+        gc->stats.marked_objects++;
+        if (gc->misaligned_pointer) {
+            gc->stats.misaligned_retained_bytes += alloc->size;
+        }
+        if (alloc->tag & BGC_TAG_ATOMIC) {
+            return;
+        }
+        if (alloc->layout) {
+            /* Only visit the declared pointer slots, `w` is the word within the current item */
+            const uintptr_t *bitmap = alloc->layout->bitmap;
+            size_t words = alloc->layout->size / BGC_PTRSIZE;
+            size_t count = alloc->size / BGC_PTRSIZE;
+            void **slots = (void **) alloc->ptr;
+            for (size_t i = 0, w = 0; words && i < count; ++i, w = w + 1 == words ? 0 : w + 1) {
+                if ((bitmap[w / BGC_LAYOUT_BITS] >> (w % BGC_LAYOUT_BITS)) & 1) {
+                    bgc_mark_alloc(gc, slots[i]);
+                }
+            }
+            return;
+        }
         /* Iterate over allocation contents and mark them as well */
         LOG_DEBUG("Checking allocation (ptr=%p, size=%llu) contents", ptr, alloc->size);
         for (char *p = (char*) alloc->ptr;
@@ -532,19 +2874,44 @@ PUBLIC void bgc_mark_alloc(bgc_GC *gc, void *ptr) {
     }
 }
 
+/**
+ * Check whether the word at `p` overlaps the collector itself.
+ *
+ * The collector is often a local variable of the scanned frames, or static
+ * data registered as a root range. Its own fields, such as the heap bounds,
+ * hold addresses of allocations but must never retain them, so stack and
+ * root range scans skip it.
+ */
+PRIVATE bool bgc_in_collector(const bgc_GC *gc, const char *p) {
+    return p + BGC_PTRSIZE > (const char *) gc && p < (const char *) (gc + 1);
+}
+
 PUBLIC void bgc_mark_stack(bgc_GC *gc) {
     LOG_DEBUG("Marking the stack (gc@%p) in increments of %lld", (void *) gc, (uint64_t)(sizeof(char)));
     void *stack_sp = __builtin_frame_address(0);
     void *stack_bp = gc->stack_bp;
     /* The stack grows towards smaller memory addresses, hence we scan stack_sp->stack_bp.
      * Stop scanning once the distance between stack_sp & stack_bp is too small to hold a valid pointer */
+    char *aligned = (char *) (((uintptr_t) stack_sp + BGC_PTRSIZE - 1) & ~(uintptr_t) (BGC_PTRSIZE - 1));
+    for (char *p = aligned; p <= (char*) stack_bp - BGC_PTRSIZE; p += BGC_PTRSIZE) {
+        if (!bgc_in_collector(gc, p)) {
+            bgc_mark_alloc(gc, *(void **)p);
+        }
+    }
+    /* Compilers keep pointers aligned, whatever only a misaligned word retains is retained falsely */
+    gc->misaligned_pointer = true;
     for (char *p = (char*) stack_sp; p <= (char*) stack_bp - BGC_PTRSIZE; ++p) {
-        bgc_mark_alloc(gc, *(void **)p);
+        if (((uintptr_t) p & (BGC_PTRSIZE - 1)) && !bgc_in_collector(gc, p)) {
+            bgc_mark_alloc(gc, *(void **)p);
+        }
     }
+    gc->misaligned_pointer = false;
 }
 
 PUBLIC void bgc_mark_roots(bgc_GC *gc) {
     LOG_DEBUG("Marking roots%s", "");
+    /* Marking and sweeping walk every bucket, an incremental resize would hide allocations */
+    bgc_allocation_map_finish_resize(gc->allocs);
     for (size_t i = 0; i < gc->allocs->capacity; ++i) {
         bgc_Allocation *chunk = gc->allocs->allocs[i];
         while (chunk) {
@@ -557,48 +2924,287 @@ PUBLIC void bgc_mark_roots(bgc_GC *gc) {
     }
 }
 
+/**
+ * Scan the registered root ranges for pointers to managed memory.
+ *
+ * Unlike the stack, root ranges are scanned in pointer-sized steps: static
+ * variables and `malloc`ed structures keep their pointers aligned.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+PUBLIC void bgc_mark_root_ranges(bgc_GC *gc) {
+    LOG_DEBUG("Marking %zu root ranges", gc->root_count);
+    for (size_t i = 0; i < gc->root_count; ++i) {
+        uintptr_t begin = ((uintptr_t) gc->roots[i].begin + BGC_PTRSIZE - 1) & ~(uintptr_t) (BGC_PTRSIZE - 1);
+        for (char *p = (char *) begin;
+                p + BGC_PTRSIZE <= (char *) gc->roots[i].end;
+                p += BGC_PTRSIZE) {
+            if (!bgc_in_collector(gc, p)) {
+                bgc_mark_alloc(gc, *(void **)p);
+            }
+        }
+    }
+}
+
+/**
+ * Mark the allocations referenced from the shadow stack.
+ *
+ * Each slot holds the address of a variable; the variable's current value is
+ * the root, so this costs O(live roots) instead of O(stack bytes).
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+PUBLIC void bgc_mark_shadow_stack(bgc_GC *gc) {
+    LOG_DEBUG("Marking %zu shadow stack slots", gc->shadow_depth);
+    for (size_t i = 0; i < gc->shadow_depth; ++i) {
+        bgc_mark_alloc(gc, *gc->shadow_stack[i]);
+    }
+}
+
 PUBLIC void bgc_mark(bgc_GC *gc) {
-    /* Note: We only look at the stack and the heap, and ignore BSS. */
+    /* Note: We only look at the stack, the heap and registered root ranges.
+     * BSS is only scanned if it was registered via bgc_add_static_roots(). */
     LOG_DEBUG("Initiating GC mark (gc@%p)", (void *) gc);
+    size_t marked = gc->stats.marked_objects;
+    /* Near misses are recorded anew, addresses no scan sees any more leave the blacklist */
+    bgc_blacklist_clear(&gc->blacklist);
+    gc->stats.misaligned_retained_bytes = 0;
+    BGC_EVENT_BEGIN(&gc->tracer, BGC_PHASE_MARK_ROOTS, 0);
     /* Scan the heap for roots */
     bgc_mark_roots(gc);
-    /* Dump registers onto stack and scan the stack */
-    void (*volatile _mark_stack)(bgc_GC*) = bgc_mark_stack;
-    jmp_buf ctx;
-    memset(&ctx, 0, sizeof(jmp_buf));
-    setjmp(ctx);
-    _mark_stack(gc);
+    /* Scan foreign memory registered as roots */
+    bgc_mark_root_ranges(gc);
+    /* Scan explicitly pushed root slots */
+    bgc_mark_shadow_stack(gc);
+    BGC_EVENT_END(&gc->tracer, BGC_PHASE_MARK_ROOTS, gc->stats.marked_objects - marked);
+    /* The shadow stack holds every root with precise roots, skip the conservative stack scan */
+    if (!gc->precise_roots) {
+        BGC_EVENT_BEGIN(&gc->tracer, BGC_PHASE_MARK_STACK, 0);
+        /* Dump registers onto stack and scan the stack */
+        void (*volatile _mark_stack)(bgc_GC*) = bgc_mark_stack;
+        jmp_buf ctx;
+        memset(&ctx, 0, sizeof(jmp_buf));
+        setjmp(ctx);
+        marked = gc->stats.marked_objects;
+        _mark_stack(gc);
+        BGC_EVENT_END(&gc->tracer, BGC_PHASE_MARK_STACK, gc->stats.marked_objects - marked);
+    }
+    bgc_blacklist_release(gc, false);
 }
 
-PUBLIC size_t bgc_sweep(bgc_GC *gc) {
-    LOG_DEBUG("Initiating GC sweep (gc@%p)", (void *) gc);
+PRIVATE bool bgc_is_marked(bgc_GC *gc, void *ptr) {
+    bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, ptr);
+    return alloc && (alloc->tag & BGC_TAG_MARK);
+}
+
+/**
+ * Process weak maps, weak references and interned strings after marking.
+ *
+ * The values of weak maps are ephemerons: a value is marked only once its
+ * key and its map are marked. Marking a value can make further keys (or
+ * maps) reachable, so the maps are visited until a pass marks nothing new.
+ * Afterwards entries with unmarked keys are dropped and weak references to
+ * unmarked targets are cleared, before the sweep frees them. Weak maps and
+ * references that are unmarked themselves leave the registry, and unmarked
+ * strings leave the intern table.
+ *
+ * @param gc A pointer to a garbage collector instance, after `bgc_mark`.
+ */
+PUBLIC void bgc_process_weak(bgc_GC *gc) {
+    bgc_WeakRegistry *weak = &gc->weak;
+    if (!weak->ref_count && !weak->map_count && !gc->interned.size) {
+        return;
+    }
+    BGC_EVENT_BEGIN(&gc->tracer, BGC_PHASE_WEAK, 0);
+    size_t cleared = gc->stats.weak_cleared;
+    size_t marked;
+    do {
+        marked = gc->stats.marked_objects;
+        for (size_t i = 0; i < weak->map_count; ++i) {
+            bgc_WeakMap *map = weak->maps[i];
+            if (!bgc_is_marked(gc, map)) {
+                continue;
+            }
+            for (size_t j = 0; j < map->capacity; ++j) {
+                if (map->entries[j].key && bgc_is_marked(gc, map->entries[j].key)) {
+                    bgc_mark_alloc(gc, map->entries[j].value);
+                }
+            }
+        }
+    } while (gc->stats.marked_objects != marked);
+
+    for (size_t i = 0; i < weak->map_count;) {
+        bgc_WeakMap *map = weak->maps[i];
+        bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, map);
+        if (!(alloc->tag & BGC_TAG_MARK)) {
+            alloc->tag &= ~BGC_TAG_WEAK;
+            bgc_weak_remove_map_at(weak, i);
+            continue;
+        }
+        for (size_t j = 0; j < map->capacity; ++j) {
+            /* Removing moves a later entry into slot j, check it again */
+            while (map->entries[j].key && !bgc_is_marked(gc, map->entries[j].key)) {
+                bgc_weak_map_remove_at(map, j);
+                gc->stats.weak_cleared++;
+            }
+        }
+        ++i;
+    }
+
+    for (size_t i = 0; i < weak->ref_count;) {
+        bgc_Weak *ref = weak->refs[i];
+        bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, ref);
+        if (!(alloc->tag & BGC_TAG_MARK)) {
+            alloc->tag &= ~BGC_TAG_WEAK;
+            bgc_weak_remove_ref_at(weak, i);
+            continue;
+        }
+        if (ref->target && !bgc_is_marked(gc, ref->target)) {
+            ref->target = NULL;
+            gc->stats.weak_cleared++;
+        }
+        ++i;
+    }
+
+    bgc_InternTable *table = &gc->interned;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        while (table->entries[i].str) {
+            bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, (void *) table->entries[i].str);
+            if (alloc->tag & BGC_TAG_MARK) {
+                break;
+            }
+            alloc->tag &= ~BGC_TAG_INTERNED;
+            bgc_intern_remove_at(table, i);
+            gc->stats.weak_cleared++;
+        }
+    }
+    BGC_EVENT_END(&gc->tracer, BGC_PHASE_WEAK, gc->stats.weak_cleared - cleared);
+}
+
+/**
+ * Run the deconstructors of the unmarked allocations in the finalizable list.
+ *
+ * Runs before the sweep frees anything, so a deconstructor may still read
+ * other unreachable objects. Finalized allocations leave the list and lose
+ * their deconstructor, the sweep then frees them like any other.
+ *
+ * @param gc A pointer to a garbage collector instance, after `bgc_mark`.
+ */
+PRIVATE void bgc_finalize(bgc_GC *gc) {
+    bgc_AllocationMap *am = gc->allocs;
+    size_t dtors = gc->stats.dtors_run;
+    /* Walk backwards: removing an entry moves an already visited one into its place */
+    for (size_t i = am->finalizable_count; i-- > 0;) {
+        if (i >= am->finalizable_count) {
+            /* A deconstructor freed entries at the end of the list */
+            continue;
+        }
+        bgc_Allocation *alloc = am->finalizable[i];
+        if (alloc->tag & BGC_TAG_MARK) {
+            continue;
+        }
+        if (gc->stats.dtors_run == dtors) {
+            BGC_EVENT_BEGIN(&gc->tracer, BGC_PHASE_DTOR_BATCH, 0);
+        }
+        bgc_Deconstructor dtor = alloc->dtor;
+        bgc_allocation_map_set_dtor(am, alloc, NULL);
+        dtor(alloc->ptr);
+        gc->stats.dtors_run++;
+    }
+    if (gc->stats.dtors_run != dtors) {
+        BGC_EVENT_END(&gc->tracer, BGC_PHASE_DTOR_BATCH, gc->stats.dtors_run - dtors);
+    }
+}
+
+/**
+ * Sweep the allocation map buckets from the sweep cursor up to `end`.
+ *
+ * Unmarked allocations are freed, marked ones are unmarked. Deconstructors
+ * run for the whole map when the sweep starts, so the buckets are walked
+ * once, unlinking dead allocations in place. The map is not resized, so a
+ * lazy sweep can continue where the last call stopped.
+ *
+ * @param gc A pointer to a garbage collector instance, after `bgc_mark`.
+ * @param end The bucket to stop at, the sweep cursor moves there.
+ * @returns The number of bytes freed.
+ */
+PRIVATE size_t bgc_sweep_buckets(bgc_GC *gc, size_t end) {
+    bgc_AllocationMap *am = gc->allocs;
+    bgc_allocation_map_finish_resize(am);
+    if (!gc->sweep_cursor) {
+        bgc_finalize(gc);
+    }
     size_t total = 0;
-    for (size_t i = 0; i < gc->allocs->capacity; ++i) {
-        bgc_Allocation *chunk = gc->allocs->allocs[i];
-        bgc_Allocation *next = NULL;
+    size_t objects = 0;
+    for (size_t i = gc->sweep_cursor; i < end; ++i) {
+        bgc_Allocation **link = &am->allocs[i];
+        bgc_Allocation *chunk;
         /* Iterate over separate chaining */
-        while (chunk) {
+        while ((chunk = *link)) {
             if (chunk->tag & BGC_TAG_MARK) {
                 LOG_DEBUG("Found used allocation %p (ptr=%p)", (void *) chunk, (void *) chunk->ptr);
                 /* unmark */
                 chunk->tag &= ~BGC_TAG_MARK;
-                chunk = chunk->next;
-            } else {
-                LOG_DEBUG("Found unused allocation %p (%llu bytes @ ptr=%p)", (void *) chunk, chunk->size, (void *) chunk->ptr);
-                /* no reference to this chunk, hence delete it */
-                total += chunk->size;
-                if (chunk->dtor) {
-                    chunk->dtor(chunk->ptr);
+                link = &chunk->next;
+                continue;
+            }
+            LOG_DEBUG("Found unused allocation %p (%llu bytes @ ptr=%p)", (void *) chunk, chunk->size, (void *) chunk->ptr);
+            /* no reference to this chunk, unlink it from the chain and delete it */
+            *link = chunk->next;
+            total += chunk->size;
+            objects++;
+            if (chunk->tag & (BGC_TAG_SAMPLED | BGC_TAG_WEAK | BGC_TAG_INTERNED)) {
+                if (chunk->tag & BGC_TAG_SAMPLED) {
+                    bgc_profile_forget(gc, chunk->ptr);
+                }
+                if (chunk->tag & BGC_TAG_WEAK) {
+                    bgc_weak_unregister(gc, chunk->ptr, chunk->size);
+                }
+                if (chunk->tag & BGC_TAG_INTERNED) {
+                    bgc_intern_forget(gc, (const char *) chunk->ptr, chunk->size - 1);
                 }
-                free(chunk->ptr);
-                /* and remove it from the bookkeeping */
-                next = chunk->next;
-                bgc_allocation_map_remove(gc->allocs, chunk->ptr, false);
-                chunk = next;
             }
+            BGC_RECORD(gc, BGC_RECORD_DIE, 1, (uintptr_t) chunk->ptr, 0, 0);
+            bgc_heap_free(gc, chunk->ptr, chunk->size, chunk->tag);
+            bgc_allocation_delete(am, chunk);
         }
     }
-    bgc_allocation_map_resize_to_fit(gc->allocs);
+    am->size -= objects;
+    gc->sweep_cursor = end;
+    gc->stats.collected_objects += objects;
+    gc->stats.collected_bytes += total;
+    gc->stats.live_bytes -= total;
+    return total;
+}
+
+/**
+ * Finish a sweep: resize the allocation map and pace the next collection.
+ *
+ * @param gc A pointer to a garbage collector instance, after sweeping every bucket.
+ */
+PRIVATE void bgc_sweep_finish(bgc_GC *gc) {
+    bgc_AllocationMap *am = gc->allocs;
+    gc->sweeping = false;
+    gc->sweep_cursor = 0;
+    am->frozen = false;
+    if (!bgc_allocation_map_resize_to_fit(am)) {
+        /* Pace the next collection from the surviving heap, not from the heap at the last resize */
+        am->sweep_limit = am->size + am->sweep_factor * (am->capacity - am->size);
+    }
+    gc->survivors = am->size;
+    /* Let external memory double before it triggers the next collection */
+    size_t external = gc->stats.external_bytes;
+    gc->external_limit = external > BGC_EXTERNAL_LIMIT / 2 ? 2 * external : BGC_EXTERNAL_LIMIT;
+}
+
+PUBLIC size_t bgc_sweep(bgc_GC *gc) {
+    LOG_DEBUG("Initiating GC sweep (gc@%p)", (void *) gc);
+    BGC_EVENT_BEGIN(&gc->tracer, BGC_PHASE_SWEEP, 0);
+    size_t objects = gc->stats.collected_objects;
+    /* Continues a pending lazy sweep from its cursor */
+    size_t total = bgc_sweep_buckets(gc, gc->allocs->capacity);
+    bgc_sweep_finish(gc);
+    BGC_EVENT_END(&gc->tracer, BGC_PHASE_SWEEP, gc->stats.collected_objects - objects);
     return total;
 }
 
@@ -609,6 +3215,7 @@ PUBLIC size_t bgc_sweep(bgc_GC *gc) {
  */
 PUBLIC void bgc_unroot_roots(bgc_GC *gc) {
     LOG_DEBUG("Unmarking roots%s", "");
+    bgc_allocation_map_finish_resize(gc->allocs);
     for (size_t i = 0; i < gc->allocs->capacity; ++i) {
         bgc_Allocation *chunk = gc->allocs->allocs[i];
         while (chunk) {
@@ -620,17 +3227,436 @@ PUBLIC void bgc_unroot_roots(bgc_GC *gc) {
     }
 }
 
+/**
+ * Free the root set, shadow stack, profiler, recorder and blacklist of a stopped collector.
+ *
+ * @param gc A pointer to a garbage collector instance whose allocation map is deleted.
+ */
+PRIVATE void bgc_release(bgc_GC *gc) {
+    free(gc->roots);
+    gc->roots = NULL;
+    gc->root_count = 0;
+    gc->root_capacity = 0;
+    free(gc->shadow_stack);
+    gc->shadow_stack = NULL;
+    gc->shadow_depth = 0;
+    gc->shadow_capacity = 0;
+    free(gc->profiler.sites);
+    free(gc->profiler.site_slots);
+    free(gc->profiler.samples);
+    memset(&gc->profiler, 0, sizeof(bgc_Profiler));
+    bgc_record_stop(gc);
+    bgc_blacklist_release(gc, true);
+    free(gc->blacklist.entries);
+    free(gc->blacklist.held);
+    memset(&gc->blacklist, 0, sizeof(bgc_Blacklist));
+}
+
+/** Whether `dtor` releases resources of the collector itself rather than the caller's. */
+PRIVATE bool bgc_owns_dtor(bgc_Deconstructor dtor) {
+#if defined(BGC_HAVE_MMAP)
+    if (dtor == bgc_mapped_buffer_delete) {
+        return true;
+    }
+#endif
+    return dtor == bgc_weak_map_delete;
+}
+
 PUBLIC size_t bgc_stop(bgc_GC *gc) {
+    /* Buckets behind the cursor of a pending lazy sweep are unmarked already, unmark the rest */
+    size_t collected = gc->sweeping ? bgc_sweep(gc) : 0;
     bgc_unroot_roots(gc);
-    size_t collected = bgc_sweep(gc);
+    /* Everything is freed, so there are no weak references or interned strings left to clear */
+    bgc_weak_registry_delete(&gc->weak);
+    free(gc->interned.entries);
+    memset(&gc->interned, 0, sizeof(bgc_InternTable));
+    collected += bgc_sweep(gc);
     bgc_allocation_map_delete(gc->allocs);
+    bgc_release(gc);
     return collected;
 }
 
+PUBLIC size_t bgc_stop_ext(bgc_GC *gc, int flags) {
+    if (!flags) {
+        return bgc_stop(gc);
+    }
+    bgc_AllocationMap *am = gc->allocs;
+    if (am->finalizable_count) {
+        /* Nothing is reachability-checked, every registered deconstructor runs.
+         * Skipping them leaves out the caller's only: the collector's own still
+         * unmap mapped buffers and free weak map entries. Walking down keeps
+         * the skipped ones, which an untrack swaps into place, behind us. */
+        size_t dtors = gc->stats.dtors_run;
+        BGC_EVENT_BEGIN(&gc->tracer, BGC_PHASE_DTOR_BATCH, 0);
+        for (size_t i = am->finalizable_count; i-- > 0;) {
+            bgc_Allocation *alloc = am->finalizable[i];
+            bgc_Deconstructor dtor = alloc->dtor;
+            if ((flags & BGC_STOP_SKIP_DTORS) && !bgc_owns_dtor(dtor)) {
+                continue;
+            }
+            bgc_allocation_map_set_dtor(am, alloc, NULL);
+            dtor(alloc->ptr);
+            gc->stats.dtors_run++;
+        }
+        BGC_EVENT_END(&gc->tracer, BGC_PHASE_DTOR_BATCH, gc->stats.dtors_run - dtors);
+    }
+    size_t total = 0;
+    if (!(flags & BGC_STOP_KEEP_MEMORY)) {
+        /* Free the memory without unlinking: the map goes away as a whole */
+        bgc_allocation_map_finish_resize(am);
+        for (size_t i = 0; i < am->capacity; ++i) {
+            for (bgc_Allocation *chunk = am->allocs[i]; chunk; chunk = chunk->next) {
+                total += chunk->size;
+                bgc_heap_free(gc, chunk->ptr, chunk->size, chunk->tag);
+            }
+        }
+    }
+    bgc_weak_registry_delete(&gc->weak);
+    free(gc->interned.entries);
+    memset(&gc->interned, 0, sizeof(bgc_InternTable));
+    bgc_allocation_map_delete(am);
+    gc->sweeping = false;
+    gc->sweep_cursor = 0;
+    bgc_release(gc);
+    return total;
+}
+
 PUBLIC size_t bgc_collect(bgc_GC *gc) {
     LOG_DEBUG("Initiating GC run (gc@%p)", (void *) gc);
+    /* Marking needs every mark bit cleared, so a pending lazy sweep is finished first */
+    size_t pending = gc->sweeping ? bgc_sweep(gc) : 0;
+    BGC_EVENT_BEGIN(&gc->tracer, BGC_PHASE_COLLECT, 0);
+    BGC_RECORD(gc, BGC_RECORD_COLLECT, 1, gc->recorder.implicit, 0, 0);
+    uint64_t start = bgc_now_ns();
     bgc_mark(gc);
-    return bgc_sweep(gc);
+    bgc_process_weak(gc);
+    uint64_t marked = bgc_now_ns();
+    size_t total = bgc_sweep(gc);
+    uint64_t swept = bgc_now_ns();
+    BGC_EVENT_END(&gc->tracer, BGC_PHASE_COLLECT, total);
+    /* Account for the pause */
+    bgc_Stats *stats = &gc->stats;
+    stats->collections++;
+    stats->mark_time_ns += marked - start;
+    stats->sweep_time_ns += swept - marked;
+    if (marked - start > stats->max_mark_time_ns) stats->max_mark_time_ns = marked - start;
+    if (swept - marked > stats->max_sweep_time_ns) stats->max_sweep_time_ns = swept - marked;
+    if (swept - start > stats->max_pause_ns) stats->max_pause_ns = swept - start;
+    return pending + total;
+}
+
+/** The number of buckets swept between two looks at the clock in `bgc_collect_step`. */
+#define BGC_SWEEP_STEP_BUCKETS 256
+
+PUBLIC bgc_StepResult bgc_collect_step(bgc_GC *gc, uint64_t budget_ns) {
+    bgc_StepResult result = { false, false, 0.0, 0, 0 };
+    bgc_Stats *stats = &gc->stats;
+    uint64_t start = bgc_now_ns();
+    uint64_t deadline = start + budget_ns;
+    BGC_EVENT_BEGIN(&gc->tracer, BGC_PHASE_COLLECT_STEP, 0);
+    if (!gc->sweeping) {
+        /* Marking is not incremental: the mutator could hide pointers between two steps */
+        LOG_DEBUG("Initiating GC step run (gc@%p)", (void *) gc);
+        BGC_RECORD(gc, BGC_RECORD_COLLECT, 1, gc->recorder.implicit, 0, 0);
+        bgc_mark(gc);
+        bgc_process_weak(gc);
+        uint64_t marked = bgc_now_ns();
+        stats->mark_time_ns += marked - start;
+        if (marked - start > stats->max_mark_time_ns) stats->max_mark_time_ns = marked - start;
+        /* Freeze the bucket array until the sweep reaches its end */
+        gc->sweeping = true;
+        gc->sweep_cursor = 0;
+        gc->allocs->frozen = true;
+        result.marked = true;
+    }
+    uint64_t sweep_start = bgc_now_ns();
+    BGC_EVENT_BEGIN(&gc->tracer, BGC_PHASE_SWEEP, 0);
+    size_t objects = stats->collected_objects;
+    size_t capacity = gc->allocs->capacity;
+    while (gc->sweep_cursor < capacity && bgc_now_ns() < deadline) {
+        size_t end = capacity - gc->sweep_cursor > BGC_SWEEP_STEP_BUCKETS
+                     ? gc->sweep_cursor + BGC_SWEEP_STEP_BUCKETS : capacity;
+        result.freed_bytes += bgc_sweep_buckets(gc, end);
+    }
+    result.progress = (double) gc->sweep_cursor / (double) capacity;
+    if (gc->sweep_cursor == capacity) {
+        bgc_sweep_finish(gc);
+        stats->collections++;
+        result.finished = true;
+        result.progress = 1.0;
+    }
+    BGC_EVENT_END(&gc->tracer, BGC_PHASE_SWEEP, stats->collected_objects - objects);
+    uint64_t end = bgc_now_ns();
+    stats->sweep_time_ns += end - sweep_start;
+    if (end - sweep_start > stats->max_sweep_time_ns) stats->max_sweep_time_ns = end - sweep_start;
+    if (end - start > stats->max_pause_ns) stats->max_pause_ns = end - start;
+    stats->collection_steps++;
+    result.time_ns = end - start;
+    BGC_EVENT_END(&gc->tracer, BGC_PHASE_COLLECT_STEP, result.freed_bytes);
+    return result;
+}
+
+PUBLIC bgc_StepResult bgc_idle_hint(bgc_GC *gc, uint64_t deadline) {
+    bgc_StepResult result = { false, false, 0.0, 0, 0 };
+    uint64_t now = bgc_now_ns();
+    if (gc->disabled || now >= deadline) {
+        return result;
+    }
+    if (!gc->sweeping) {
+        bgc_AllocationMap *am = gc->allocs;
+        bgc_Stats *stats = &gc->stats;
+        /* Collect early once half of the allocations allowed until the sweep limit are made */
+        size_t allocated = am->size > gc->survivors ? am->size - gc->survivors : 0;
+        size_t headroom = am->sweep_limit > gc->survivors ? am->sweep_limit - gc->survivors : 0;
+        bool due = (allocated && 2 * allocated >= headroom) || 2 * stats->external_bytes > gc->external_limit;
+        /* A mark cannot be cut short, only start one if the average mark fits */
+        uint64_t mark_ns = stats->collections ? stats->mark_time_ns / stats->collections : 0;
+        if (!due || now + mark_ns > deadline) {
+            return result;
+        }
+    }
+    return bgc_collect_step(gc, deadline - now);
+}
+
+PUBLIC void bgc_get_stats(bgc_GC *gc, bgc_Stats *stats) {
+    *stats = gc->stats;
+    stats->live_objects = gc->allocs->size;
+    stats->map_capacity = gc->allocs->capacity;
+    stats->map_load_factor = bgc_allocation_map_load_factor(gc->allocs);
+    stats->map_resize_count = gc->allocs->resize_count;
+    stats->blacklisted_addresses = gc->blacklist.size;
+}
+
+/*
+ * Heap snapshots.
+ *
+ * A snapshot is a sequence of native-endian 64-bit words:
+ *
+ *     BGC_SNAPSHOT_MAGIC node_count root_count
+ *     root_count x address
+ *     node_count x (address size dtor tag edge_count edge_count x address)
+ *
+ * Roots are the allocations referenced from tagged roots, root ranges, the
+ * shadow stack and (unless in precise-roots mode) the C stack. Edges are the
+ * allocations an allocation references, found by the same conservative scan
+ * that `bgc_mark_alloc` uses.
+ */
+typedef struct bgc_AddressList {
+    uint64_t *items;
+    size_t size;
+    size_t capacity;
+} bgc_AddressList;
+
+PRIVATE bool bgc_address_list_push(bgc_AddressList *list, void *ptr) {
+    if (list->size == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+        uint64_t *items = (uint64_t *) realloc(list->items, new_capacity * sizeof(uint64_t));
+        if (!items) {
+            return false;
+        }
+        list->items = items;
+        list->capacity = new_capacity;
+    }
+    list->items[list->size++] = (uint64_t) (uintptr_t) ptr;
+    return true;
+}
+
+/**
+ * Collect the allocations referenced from the memory range `[begin, end)`.
+ *
+ * Skips the collector itself, like `bgc_mark_stack` and `bgc_mark_root_ranges`.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param begin The first byte to scan.
+ * @param end One past the last byte to scan.
+ * @param step The distance between two candidate pointers.
+ * @param out The list to append the referenced addresses to.
+ * @returns `false` if `out` could not grow.
+ */
+PRIVATE bool bgc_snapshot_scan(bgc_GC *gc, char *begin, char *end, size_t step, bgc_AddressList *out) {
+    for (char *p = begin; p + BGC_PTRSIZE <= end; p += step) {
+        void *candidate = *(void **)p;
+        if (bgc_in_collector(gc, p)) {
+            continue;
+        }
+        if (bgc_allocation_map_get(gc->allocs, candidate) && !bgc_address_list_push(out, candidate)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+PRIVATE bool bgc_snapshot_scan_stack(bgc_GC *gc, bgc_AddressList *out) {
+    char *sp = (char *) __builtin_frame_address(0);
+    char *bp = (char *) gc->stack_bp;
+    return bgc_snapshot_scan(gc, sp, bp, 1, out);
+}
+
+PRIVATE bool bgc_snapshot_write(FILE *out, const uint64_t *words, size_t count) {
+    return fwrite(words, sizeof(uint64_t), count, out) == count;
+}
+
+PUBLIC size_t bgc_heap_snapshot(bgc_GC *gc, FILE *out) {
+    bgc_AddressList roots = { NULL, 0, 0 };
+    bgc_AddressList edges = { NULL, 0, 0 };
+    bgc_AllocationMap *am = gc->allocs;
+    bgc_allocation_map_finish_resize(am);
+    /* A snapshot with missing roots or edges would be misleading, fail instead */
+    bool ok = true;
+
+    /* Find the roots, in the same order as bgc_mark() */
+    for (size_t i = 0; ok && i < am->capacity; ++i) {
+        for (bgc_Allocation *chunk = am->allocs[i]; ok && chunk; chunk = chunk->next) {
+            if (chunk->tag & BGC_TAG_ROOT) {
+                ok = bgc_address_list_push(&roots, chunk->ptr);
+            }
+        }
+    }
+    for (size_t i = 0; ok && i < gc->root_count; ++i) {
+        uintptr_t begin = ((uintptr_t) gc->roots[i].begin + BGC_PTRSIZE - 1) & ~(uintptr_t) (BGC_PTRSIZE - 1);
+        ok = bgc_snapshot_scan(gc, (char *) begin, (char *) gc->roots[i].end, BGC_PTRSIZE, &roots);
+    }
+    for (size_t i = 0; ok && i < gc->shadow_depth; ++i) {
+        ok = bgc_snapshot_scan(gc, (char *) gc->shadow_stack[i], (char *) (gc->shadow_stack[i] + 1), BGC_PTRSIZE, &roots);
+    }
+    if (ok && !gc->precise_roots) {
+        /* Dump registers onto stack and scan the stack */
+        bool (*volatile _scan_stack)(bgc_GC*, bgc_AddressList*) = bgc_snapshot_scan_stack;
+        jmp_buf ctx;
+        memset(&ctx, 0, sizeof(jmp_buf));
+        setjmp(ctx);
+        ok = _scan_stack(gc, &roots);
+    }
+
+    uint64_t header[3];
+    memcpy(&header[0], BGC_SNAPSHOT_MAGIC, sizeof(uint64_t));
+    header[1] = am->size;
+    header[2] = roots.size;
+    ok = ok && bgc_snapshot_write(out, header, 3) && bgc_snapshot_write(out, roots.items, roots.size);
+
+    /* Write every allocation with its outgoing edges */
+    size_t count = 0;
+    for (size_t i = 0; ok && i < am->capacity; ++i) {
+        for (bgc_Allocation *chunk = am->allocs[i]; ok && chunk; chunk = chunk->next) {
+            edges.size = 0;
+            if (chunk->layout) {
+                for (size_t w = 0; ok && w < chunk->size / BGC_PTRSIZE; ++w) {
+                    if (bgc_layout_has_pointer(chunk->layout, w)) {
+                        char *slot = (char *) chunk->ptr + w * BGC_PTRSIZE;
+                        ok = bgc_snapshot_scan(gc, slot, slot + BGC_PTRSIZE, 1, &edges);
+                    }
+                }
+            } else if (chunk->size >= BGC_PTRSIZE && !(chunk->tag & BGC_TAG_ATOMIC)) {
+                ok = bgc_snapshot_scan(gc, (char *) chunk->ptr, (char *) chunk->ptr + chunk->size, 1, &edges);
+            }
+            if (!ok) {
+                break;
+            }
+            uint64_t record[5];
+            record[0] = (uint64_t) (uintptr_t) chunk->ptr;
+            record[1] = chunk->size;
+            record[2] = (uint64_t) (uintptr_t) chunk->dtor;
+            record[3] = (uint64_t) (unsigned char) chunk->tag;
+            record[4] = edges.size;
+            ok = bgc_snapshot_write(out, record, 5) && bgc_snapshot_write(out, edges.items, edges.size);
+            count++;
+        }
+    }
+    free(roots.items);
+    free(edges.items);
+    LOG_DEBUG("Wrote heap snapshot of %zu allocations", count);
+    return ok ? count : (size_t) -1;
+}
+
+PRIVATE int bgc_profile_compare_sites(const void *a, const void *b) {
+    const bgc_ProfileSite *x = *(const bgc_ProfileSite * const *) a;
+    const bgc_ProfileSite *y = *(const bgc_ProfileSite * const *) b;
+    if (x->live_bytes != y->live_bytes) {
+        return x->live_bytes < y->live_bytes ? 1 : -1;
+    }
+    if (x->allocated_bytes != y->allocated_bytes) {
+        return x->allocated_bytes < y->allocated_bytes ? 1 : -1;
+    }
+    return 0;
+}
+
+/**
+ * Write a profile in the legacy heap profile format of gperftools, which
+ * `pprof` reads. The counts are already unsampled, hence the `heapprofile`
+ * header which tells `pprof` not to scale them again.
+ */
+PRIVATE bool bgc_profile_dump_pprof(bgc_Profiler *profiler, bgc_ProfileSite **sites, FILE *out) {
+    size_t live_bytes = 0, live_objects = 0, allocated_bytes = 0, allocated_objects = 0;
+    for (size_t i = 0; i < profiler->site_count; ++i) {
+        live_bytes += sites[i]->live_bytes;
+        live_objects += sites[i]->live_objects;
+        allocated_bytes += sites[i]->allocated_bytes;
+        allocated_objects += sites[i]->allocated_objects;
+    }
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heapprofile\n",
+            live_objects, live_bytes, allocated_objects, allocated_bytes);
+    for (size_t i = 0; i < profiler->site_count; ++i) {
+        fprintf(out, "%zu: %zu [%zu: %zu] @", sites[i]->live_objects, sites[i]->live_bytes,
+                sites[i]->allocated_objects, sites[i]->allocated_bytes);
+        for (size_t f = 0; f < sites[i]->depth; ++f) {
+            fprintf(out, " %p", sites[i]->stack[f]);
+        }
+        fputc('\n', out);
+    }
+    /* The memory map lets pprof symbolize the addresses */
+    fputs("\nMAPPED_LIBRARIES:\n", out);
+#if defined(__linux__)
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        char line[512];
+        while (fgets(line, sizeof(line), maps)) {
+            fputs(line, out);
+        }
+        fclose(maps);
+    }
+#endif
+    return !ferror(out);
+}
+
+PRIVATE bool bgc_profile_dump_text(bgc_Profiler *profiler, bgc_ProfileSite **sites, FILE *out) {
+    fprintf(out, "bgc allocation profile: interval=%zu sites=%zu samples=%zu\n",
+            profiler->interval, profiler->site_count, profiler->sample_count);
+    for (size_t i = 0; i < profiler->site_count; ++i) {
+        bgc_ProfileSite *site = sites[i];
+        fprintf(out, "\n%zu live bytes (%zu objects), %zu allocated bytes (%zu objects)\n",
+                site->live_bytes, site->live_objects, site->allocated_bytes, site->allocated_objects);
+#if defined(BGC_HAVE_BACKTRACE)
+        char **symbols = backtrace_symbols(site->stack, (int) site->depth);
+#else
+        char **symbols = NULL;
+#endif
+        for (size_t f = 0; f < site->depth; ++f) {
+            if (symbols) {
+                fprintf(out, "    #%zu %s\n", f, symbols[f]);
+            } else {
+                fprintf(out, "    #%zu %p\n", f, site->stack[f]);
+            }
+        }
+        free(symbols);
+    }
+    return !ferror(out);
+}
+
+PUBLIC bool bgc_profile_dump(bgc_GC *gc, FILE *out, bgc_ProfileFormat format) {
+    bgc_Profiler *profiler = &gc->profiler;
+    bgc_ProfileSite **sites = malloc((profiler->site_count + 1) * sizeof(bgc_ProfileSite *));
+    if (!sites) {
+        return false;
+    }
+    for (size_t i = 0; i < profiler->site_count; ++i) {
+        sites[i] = &profiler->sites[i];
+    }
+    qsort(sites, profiler->site_count, sizeof(bgc_ProfileSite *), bgc_profile_compare_sites);
+    bool ok = format == BGC_PROFILE_PPROF
+        ? bgc_profile_dump_pprof(profiler, sites, out)
+        : bgc_profile_dump_text(profiler, sites, out);
+    free(sites);
+    return ok;
 }
 
 PUBLIC char * bgc_strdup (bgc_GC *gc, const char *str1) {
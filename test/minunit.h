@@ -9,7 +9,7 @@
 #define MINUNIT_H
 
 #define mu_assert(test, message) do { if (!(test)) return message; } while (0)
-#define mu_run_test(test) do { char *message = test(); tests_run++; \
+#define mu_run_test(test) do { const char *message = test(); tests_run++; \
                                if (message) return message; } while (0)
 
 extern int tests_run;
@@ -10,6 +10,23 @@
 
 static size_t DTOR_COUNT = 0;
 
+/*
+ * Zero the stack that the next test's frame will occupy. Tests that count
+ * what a conservative stack scan retains run on a zeroed stack, stale words
+ * of earlier tests could otherwise point to new allocations at reused
+ * addresses.
+ */
+static void _scrub_stack(void)
+{
+    volatile char scratch[16384];
+    for (size_t i=0; i<sizeof(scratch); ++i) {
+        scratch[i] = 0;
+    }
+}
+
+#define mu_run_scrubbed_test(test) do { void (*volatile scrub)(void) = _scrub_stack; scrub(); \
+                                        mu_run_test(test); } while (0)
+
 static char* test_primes()
 {
     /*
@@ -34,14 +51,17 @@ void dtor(void* ptr)
 static char* test_gc_allocation_new_delete()
 {
     int* ptr = malloc(sizeof(int));
-    bgc_Allocation* a = bgc_allocation_new(ptr, sizeof(int), dtor);
+    bgc_AllocationMap* am = bgc_allocation_map_new(8, 16, 0.5, 0.2, 0.8);
+    bgc_Allocation* a = bgc_allocation_new(am, ptr, sizeof(int), dtor);
     mu_assert(a != NULL, "bgc_Allocation should return non-NULL");
     mu_assert(a->ptr == ptr, "bgc_Allocation should contain original pointer");
     mu_assert(a->size == sizeof(int), "Size of mem pointed to should not change");
     mu_assert(a->tag == BGC_TAG_NONE, "Annotation should initially be untagged");
     mu_assert(a->dtor == dtor, "Destructor pointer should not change");
     mu_assert(a->next == NULL, "Annotation should initilally be unlinked");
-    bgc_allocation_delete(a);
+    bgc_allocation_delete(am, a);
+    mu_assert(bgc_allocation_new(am, ptr, sizeof(int), NULL) == a, "Deleted allocation objects should be reused");
+    bgc_allocation_map_delete(am);
     free(ptr);
     return NULL;
 }
@@ -154,6 +174,129 @@ static char* test_gc_allocation_map_put_get_remove()
     return NULL;
 }
 
+
+static char* test_gc_allocation_map_incremental_resize()
+{
+    /* The map never dereferences its keys */
+    char* base = (char*) 0x10000000;
+    bgc_AllocationMap* am = bgc_allocation_map_new(11, 11, 0.5, 0.2, 0.8);
+    size_t n = 0;
+    while (!am->old_allocs) {
+        bgc_allocation_map_put(am, base + 16 * n++, 16, NULL);
+    }
+    mu_assert(am->capacity == 23 && am->old_capacity == 11, "Upsize should keep the old table");
+    mu_assert(am->resize_count == 1, "Upsize should count as a resize");
+
+    /* Entries in either table are found, updated, moved and removed */
+    for (size_t i=0; i<n; ++i) {
+        mu_assert(bgc_allocation_map_get(am, base + 16 * i), "Entries should be found during the migration");
+    }
+    bgc_Allocation* a = bgc_allocation_map_put(am, base, 16, dtor);
+    mu_assert(a == bgc_allocation_map_get(am, base) && a->dtor == dtor, "Upsert should find the old entry");
+    bgc_allocation_map_rekey(am, a, base + 16 * 1000);
+    mu_assert(bgc_allocation_map_get(am, base + 16 * 1000) == a && !bgc_allocation_map_get(am, base), "Rekey should move the entry");
+    bgc_allocation_map_remove(am, base + 16, true);
+    mu_assert(!bgc_allocation_map_get(am, base + 16) && am->size == n - 1, "Remove should find the old entry");
+
+    /* Every put and remove moves a few buckets until the old table is gone */
+    while (am->old_allocs) {
+        bgc_allocation_map_put(am, base + 16 * n++, 16, NULL);
+    }
+    mu_assert(am->migrate_cursor == 0 && am->size == n - 1, "Migration should finish");
+    for (size_t i=2; i<n; ++i) {
+        mu_assert(bgc_allocation_map_get(am, base + 16 * i), "Entries should survive the migration");
+    }
+
+    /* Walking the buckets needs the migration to finish at once */
+    bgc_allocation_map_resize(am, 47);
+    mu_assert(am->old_allocs, "Resize should be incremental");
+    bgc_allocation_map_finish_resize(am);
+    size_t entries = 0;
+    for (size_t i=0; i<am->capacity; ++i) {
+        for (bgc_Allocation* chunk = am->allocs[i]; chunk; chunk = chunk->next) {
+            entries++;
+        }
+    }
+    mu_assert(!am->old_allocs && entries == am->size, "Finished migration should hold every entry");
+
+    bgc_allocation_map_delete(am);
+    return NULL;
+}
+
+#if !defined(BGC_NO_THREADS)
+
+typedef struct {
+    bgc_ShardedAllocationMap* sam;
+    int** ints;
+    size_t count;
+} _ShardedPutArgs;
+
+static void* _sharded_put(void* arg)
+{
+    _ShardedPutArgs* args = arg;
+    for (size_t i=0; i<args->count; ++i) {
+        bgc_sharded_allocation_map_put(args->sam, args->ints[i], sizeof(int), NULL);
+    }
+    return NULL;
+}
+
+static char* test_gc_sharded_allocation_map()
+{
+    /* Shard counts are rounded up to powers of two */
+    bgc_ShardedAllocationMap* sam = bgc_sharded_allocation_map_new(5, 8, 16, 0.5, 0.2, 0.8);
+    mu_assert(sam->shard_count == 8, "Shard count should be rounded up to a power of two");
+    mu_assert((uintptr_t) sam->shards % BGC_CACHE_LINE == 0, "Shards should start on a cache line");
+    bgc_sharded_allocation_map_delete(sam);
+
+    /* Insert from several threads at once */
+    size_t T = 4, N = 256;
+    int** ints = malloc(T*N*sizeof(int*));
+    for (size_t i=0; i<T*N; ++i) {
+        ints[i] = malloc(sizeof(int));
+    }
+    sam = bgc_sharded_allocation_map_new(BGC_DEFAULT_SHARD_COUNT, 8, 16, 0.5, 0.2, 0.8);
+    pthread_t threads[4];
+    _ShardedPutArgs args[4];
+    for (size_t t=0; t<T; ++t) {
+        args[t].sam = sam;
+        args[t].ints = ints + t*N;
+        args[t].count = N;
+        pthread_create(&threads[t], NULL, _sharded_put, &args[t]);
+    }
+    for (size_t t=0; t<T; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    mu_assert(bgc_sharded_allocation_map_size(sam) == T*N, "Concurrent puts must not be lost");
+
+    /* Lock-free lookups while frozen */
+    bgc_sharded_allocation_map_lock_all(sam);
+    for (size_t i=0; i<T*N; ++i) {
+        bgc_Allocation* a = bgc_sharded_allocation_map_get(sam, ints[i]);
+        mu_assert(a && a->ptr == ints[i], "Frozen lookup should find every allocation");
+    }
+    bgc_sharded_allocation_map_unlock_all(sam);
+
+    /* Locked lookups copy the allocation out */
+    bgc_Allocation copy;
+    mu_assert(bgc_sharded_allocation_map_find(sam, ints[0], &copy), "Locked lookup should find the allocation");
+    mu_assert(copy.ptr == ints[0] && copy.size == sizeof(int) && copy.next == NULL, "Lookup should copy the allocation");
+
+    for (size_t i=0; i<T*N; ++i) {
+        bgc_sharded_allocation_map_remove(sam, ints[i], true);
+        mu_assert(!bgc_sharded_allocation_map_find(sam, ints[i], NULL), "Removed allocation should be gone");
+    }
+    mu_assert(bgc_sharded_allocation_map_size(sam) == 0, "Empty sharded map must have size 0");
+    bgc_sharded_allocation_map_delete(sam);
+
+    for (size_t i=0; i<T*N; ++i) {
+        free(ints[i]);
+    }
+    free(ints);
+    return NULL;
+}
+
+#endif // BGC_NO_THREADS
+
 static char* test_gc_allocation_map_cleanup()
 {
     /* Make sure that the entries in the allocation map get reset
@@ -396,6 +539,28 @@ static char* test_gc_realloc()
         mu_assert(a->size == 42*sizeof(int*), "Wrong allocation size");
     }
 
+    /* growing reuses the allocation metadata and moves the block rarely */
+    {
+        char* bytes = bgc_malloc(&gc, 1);
+        bytes[0] = 'x';
+        bgc_Allocation* a = bgc_allocation_map_get(gc.allocs, bytes);
+        size_t map_size = gc.allocs->size, moves = 0;
+        for (size_t i=2; i<=4096; ++i) {
+            char* grown = bgc_realloc(&gc, bytes, i);
+            moves += grown != bytes;
+            bytes = grown;
+            bytes[i-1] = 'x';
+        }
+        mu_assert(bgc_allocation_map_get(gc.allocs, bytes) == a, "Allocation metadata should be reused");
+        mu_assert(a->size == 4096 && gc.allocs->size == map_size, "Wrong allocation after growing");
+        mu_assert(bytes[0] == 'x' && bytes[4095] == 'x', "Contents should survive growing");
+#if defined(BGC_HAVE_USABLE_SIZE)
+        mu_assert(moves < 64, "Appending should grow in place most of the time");
+#else
+        (void) moves;
+#endif
+    }
+
     bgc_stop(&gc);
     return NULL;
 }
@@ -435,6 +600,906 @@ static char* test_gc_disable_enable()
     return NULL;
 }
 
+static void* STATIC_ROOT = NULL;
+
+static void _store_managed(bgc_GC* gc, void** slot)
+{
+    *slot = bgc_malloc_ext(gc, 64, dtor);
+}
+
+static char* test_gc_root_ranges()
+{
+    DTOR_COUNT = 0;
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+
+    /* Ranges are kept sorted, merged and split */
+    char* base = malloc(256);
+    bgc_add_roots(&gc, base + 128, base + 192);
+    bgc_add_roots(&gc, base, base + 64);
+    mu_assert(gc.root_count == 2, "Disjoint root ranges should not be merged");
+    mu_assert(gc.roots[0].begin == base, "Root ranges should be sorted");
+    bgc_add_roots(&gc, base + 32, base + 128);
+    mu_assert(gc.root_count == 1, "Overlapping and touching root ranges should be merged");
+    mu_assert(gc.roots[0].begin == base && gc.roots[0].end == base + 192, "Wrong merged root range");
+    bgc_remove_roots(&gc, base + 64, base + 96);
+    mu_assert(gc.root_count == 2, "Removing the middle of a root range should split it");
+    mu_assert(gc.roots[0].end == base + 64 && gc.roots[1].begin == base + 96, "Wrong split root ranges");
+    bgc_remove_roots(&gc, base, base + 256);
+    mu_assert(gc.root_count == 0, "All root ranges should be removed");
+    free(base);
+
+    /* A pointer held only in malloc'ed memory keeps its target alive */
+    void** holder = malloc(sizeof(void*));
+    _store_managed(&gc, holder);
+    mu_assert(bgc_add_roots(&gc, holder, holder + 1), "Root range should be added");
+    bgc_collect(&gc);
+    mu_assert(bgc_allocation_map_get(gc.allocs, *holder) != NULL, "Allocation referenced from a root range was collected");
+    mu_assert(DTOR_COUNT == 0, "Allocation referenced from a root range was finalized");
+    bgc_remove_roots(&gc, holder, holder + 1);
+    free(holder);
+
+    /* A collector inside a root range does not retain what its heap bounds point to */
+    bgc_GC inner;
+    bgc_start(&inner, stack_bp);
+    bgc_set_precise_roots(&inner, true);
+    bgc_add_roots(&inner, &inner, &inner + 1);
+    bgc_malloc(&inner, 16);
+    mu_assert(inner.heap_min == inner.heap_max, "The heap bounds should hold the only allocation");
+    bgc_collect(&inner);
+    mu_assert(inner.allocs->size == 0, "The collector's own fields should not be roots");
+    bgc_stop(&inner);
+
+    /* A pointer held only in a static variable keeps its target alive */
+#if defined(__linux__) || defined(__APPLE__)
+    mu_assert(bgc_add_static_roots(&gc), "Failed to locate the data and BSS segments");
+    _store_managed(&gc, &STATIC_ROOT);
+    bgc_collect(&gc);
+    mu_assert(bgc_allocation_map_get(gc.allocs, STATIC_ROOT) != NULL, "Allocation referenced from BSS was collected");
+    STATIC_ROOT = NULL;
+#endif
+
+    bgc_stop(&gc);
+    mu_assert(gc.roots == NULL, "Stopping the GC should release the root ranges");
+    DTOR_COUNT = 0;
+    return NULL;
+}
+
+static char* test_gc_precise_roots()
+{
+    DTOR_COUNT = 0;
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+
+    /* Only the rooted allocation survives, even though both are on the stack */
+    void* rooted = bgc_calloc_ext(&gc, 1, 32, dtor);
+    void* unrooted = bgc_malloc_ext(&gc, 32, dtor);
+    size_t depth = bgc_get_root_depth(&gc);
+    mu_assert(bgc_push_root(&gc, &rooted), "Pushing a root should succeed");
+    mu_assert(bgc_get_root_depth(&gc) == depth + 1, "Pushing a root should grow the shadow stack");
+    size_t collected = bgc_collect(&gc);
+    mu_assert(collected == 32, "Unrooted allocation should be collected in precise mode");
+    mu_assert(DTOR_COUNT == 1, "Unrooted allocation should be finalized in precise mode");
+    mu_assert(bgc_allocation_map_get(gc.allocs, rooted) != NULL, "Rooted allocation was collected");
+    mu_assert(bgc_allocation_map_get(gc.allocs, unrooted) == NULL, "Unrooted allocation was not collected");
+
+    /* Roots follow the variable, not the value it held when pushed */
+    rooted = NULL;
+    collected = bgc_collect(&gc);
+    mu_assert(collected == 32, "Allocation dropped from a root slot should be collected");
+
+    /* Deep pushes grow the shadow stack and scopes pop them all */
+    void* slots[100];
+    for (size_t i=0; i<100; ++i) {
+        slots[i] = NULL;
+        bgc_push_root(&gc, &slots[i]);
+    }
+    mu_assert(bgc_get_root_depth(&gc) == depth + 101, "Shadow stack lost slots while growing");
+    bgc_pop_roots(&gc, 1);
+    bgc_set_root_depth(&gc, depth);
+    mu_assert(bgc_get_root_depth(&gc) == depth, "Restoring the depth should pop all slots");
+
+    bgc_stop(&gc);
+    DTOR_COUNT = 0;
+    return NULL;
+}
+
+/* Reads the first word of the object the finalized object points to */
+static size_t FINALIZED_VALUE = 0;
+
+static void read_dtor(void* ptr)
+{
+    FINALIZED_VALUE = **(size_t**) ptr;
+}
+
+static char* test_gc_finalizable()
+{
+    DTOR_COUNT = 0;
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+
+    /* Only allocations with a deconstructor are finalizable */
+    void* kept = bgc_malloc_ext(&gc, 16, dtor);
+    bgc_push_root(&gc, &kept);
+    for (size_t i=0; i<100; ++i) {
+        bgc_malloc_ext(&gc, 16, i % 2 ? dtor : NULL);
+    }
+    mu_assert(gc.allocs->finalizable_count == 51, "Allocations with dtor should be finalizable");
+    void* p = bgc_malloc(&gc, 16);
+    mu_assert(bgc_set_dtor(&gc, p, dtor) && gc.allocs->finalizable_count == 52, "Setting a dtor should track");
+    mu_assert(bgc_set_dtor(&gc, p, NULL) && gc.allocs->finalizable_count == 51, "Clearing a dtor should untrack");
+    bgc_set_dtor(&gc, p, dtor);
+    bgc_free(&gc, p);
+    mu_assert(gc.allocs->finalizable_count == 51 && DTOR_COUNT == 1, "Free should untrack");
+    kept = bgc_realloc(&gc, kept, 4096);
+    memset(kept, 0, 4096);
+    mu_assert(gc.allocs->finalizable[bgc_allocation_map_get(gc.allocs, kept)->final_index]->ptr == kept, "Realloc should keep the entry");
+
+    bgc_collect(&gc);
+    mu_assert(DTOR_COUNT == 51 && gc.stats.collected_objects == 100, "Only dead dtors should run");
+    mu_assert(gc.allocs->finalizable_count == 1 && gc.allocs->finalizable[0]->ptr == kept, "Finalized entries should leave the list");
+
+    /* Deconstructors run before anything is freed */
+    size_t** holder = bgc_malloc_ext(&gc, sizeof(size_t*), read_dtor);
+    *holder = bgc_malloc(&gc, sizeof(size_t));
+    **holder = 42;
+    holder = NULL;
+    bgc_collect(&gc);
+    mu_assert(FINALIZED_VALUE == 42, "Dtor should read unreachable objects");
+
+    bgc_stop(&gc);
+    mu_assert(DTOR_COUNT == 52, "Stop should finalize everything");
+    return NULL;
+}
+
+static char* test_gc_stats()
+{
+    DTOR_COUNT = 0;
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start_ext(&gc, stack_bp, 32, 32, 0.2, 0.8, 0.5);
+    bgc_set_precise_roots(&gc, true);
+    bgc_disable(&gc);
+
+    bgc_Stats stats;
+    bgc_get_stats(&gc, &stats);
+    mu_assert(stats.live_bytes == 0 && stats.live_objects == 0, "A new GC should be empty");
+    mu_assert(stats.map_capacity == 37, "Wrong map capacity");
+
+    /* Keep one allocation alive, drop the rest */
+    void* kept = bgc_malloc(&gc, 100);
+    bgc_push_root(&gc, &kept);
+    for (size_t i=0; i<64; ++i) {
+        bgc_malloc_ext(&gc, 10, dtor);
+    }
+    kept = bgc_realloc(&gc, kept, 200);
+    /* The kept allocation is scanned, stale words in it must not retain the others */
+    memset(kept, 0, 200);
+    bgc_get_stats(&gc, &stats);
+    mu_assert(stats.total_objects == 65, "Wrong number of allocated objects");
+    mu_assert(stats.total_bytes == 740, "Wrong number of allocated bytes");
+    mu_assert(stats.live_bytes == 840, "Wrong number of live bytes after realloc");
+    mu_assert(stats.live_objects == 65, "Wrong number of live objects");
+    mu_assert(stats.map_resize_count >= 1, "Map should have been resized");
+    mu_assert(stats.map_load_factor > 0.0 && stats.map_load_factor <= 0.8, "Wrong load factor");
+
+    bgc_collect(&gc);
+    bgc_get_stats(&gc, &stats);
+    mu_assert(stats.collections == 1, "Wrong number of collections");
+    mu_assert(stats.collected_objects == 64, "Wrong number of collected objects");
+    mu_assert(stats.collected_bytes == 640, "Wrong number of collected bytes");
+    mu_assert(stats.dtors_run == 64, "Wrong number of dtors run");
+    mu_assert(stats.live_bytes == 200 && stats.live_objects == 1, "Wrong live heap after collection");
+    mu_assert(stats.max_pause_ns >= stats.max_mark_time_ns, "Pause must include the mark phase");
+    mu_assert(stats.mark_time_ns + stats.sweep_time_ns >= stats.max_pause_ns, "Pause times must add up");
+
+    bgc_free(&gc, kept);
+    bgc_get_stats(&gc, &stats);
+    mu_assert(stats.live_bytes == 0 && stats.live_objects == 0, "Explicit free should update live heap");
+    bgc_stop(&gc);
+    DTOR_COUNT = 0;
+    return NULL;
+}
+
+static bgc_TraceEvent TRACE_EVENTS[64];
+static size_t TRACE_EVENT_COUNT = 0;
+
+static void _record_event(const bgc_TraceEvent* event, void* ctx)
+{
+    UNUSED(ctx);
+    if (TRACE_EVENT_COUNT < 64) {
+        TRACE_EVENTS[TRACE_EVENT_COUNT++] = *event;
+    }
+}
+
+static bool _has_event(bgc_Phase phase, bool begin)
+{
+    for (size_t i=0; i<TRACE_EVENT_COUNT; ++i) {
+        if (TRACE_EVENTS[i].phase == phase && TRACE_EVENTS[i].begin == begin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static char* test_gc_tracing()
+{
+    DTOR_COUNT = 0;
+    TRACE_EVENT_COUNT = 0;
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start_ext(&gc, stack_bp, 8, 8, 0.2, 0.8, 0.5);
+    bgc_set_precise_roots(&gc, true);
+    bgc_disable(&gc);
+    bgc_set_tracer(&gc, _record_event, NULL);
+
+    /* Grow the map and create some finalizable garbage */
+    for (size_t i=0; i<32; ++i) {
+        bgc_malloc_ext(&gc, 8, dtor);
+    }
+    mu_assert(_has_event(BGC_PHASE_MAP_RESIZE, true), "Map resize should be traced");
+    mu_assert(_has_event(BGC_PHASE_MAP_RESIZE, false), "Map resize should be traced");
+    TRACE_EVENT_COUNT = 0;
+
+    size_t collected = bgc_collect(&gc);
+    mu_assert(TRACE_EVENTS[0].phase == BGC_PHASE_COLLECT && TRACE_EVENTS[0].begin, "Collection should open the trace");
+    mu_assert(TRACE_EVENTS[TRACE_EVENT_COUNT - 1].phase == BGC_PHASE_COLLECT, "Collection should close the trace");
+    mu_assert(TRACE_EVENTS[TRACE_EVENT_COUNT - 1].count == collected, "Collection should report the bytes freed");
+    mu_assert(_has_event(BGC_PHASE_MARK_ROOTS, true) && _has_event(BGC_PHASE_MARK_ROOTS, false), "Root marking should be traced");
+    mu_assert(!_has_event(BGC_PHASE_MARK_STACK, true), "Precise mode should not scan the stack");
+    mu_assert(_has_event(BGC_PHASE_SWEEP, true) && _has_event(BGC_PHASE_SWEEP, false), "Sweeping should be traced");
+    mu_assert(_has_event(BGC_PHASE_DTOR_BATCH, true) && _has_event(BGC_PHASE_DTOR_BATCH, false), "Dtors should be traced");
+    for (size_t i=1; i<TRACE_EVENT_COUNT; ++i) {
+        mu_assert(TRACE_EVENTS[i].timestamp_ns >= TRACE_EVENTS[i-1].timestamp_ns, "Timestamps must be monotonic");
+    }
+
+    /* The Chrome trace sink writes a JSON array of duration events */
+    FILE* out = tmpfile();
+    bgc_ChromeTrace trace;
+    bgc_chrome_trace_open(&trace, out);
+    bgc_set_tracer(&gc, bgc_chrome_trace_callback, &trace);
+    bgc_collect(&gc);
+    bgc_chrome_trace_close(&trace);
+    bgc_set_tracer(&gc, NULL, NULL);
+    char json[4096];
+    rewind(out);
+    size_t n = fread(json, 1, sizeof(json) - 1, out);
+    json[n] = '\0';
+    fclose(out);
+    mu_assert(json[0] == '[' && strstr(json, "\n]\n"), "Chrome trace should be a JSON array");
+    mu_assert(strstr(json, "{\"name\":\"collect\",\"cat\":\"bgc\",\"ph\":\"B\""), "Chrome trace should contain the collection");
+    mu_assert(trace.events >= 4, "Chrome trace should contain begin and end events");
+
+    bgc_stop(&gc);
+    DTOR_COUNT = 0;
+    return NULL;
+}
+
+static char* test_gc_heap_snapshot()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+
+    /* A rooted parent pointing to a child, plus an unreachable orphan */
+    void** parent = bgc_malloc(&gc, 2 * sizeof(void*));
+    void* child = bgc_malloc(&gc, 64);
+    bgc_malloc(&gc, 32);
+    parent[0] = child;
+    parent[1] = NULL;
+    bgc_push_root(&gc, (void**) &parent);
+
+    FILE* out = tmpfile();
+    size_t count = bgc_heap_snapshot(&gc, out);
+    mu_assert(count == 3, "Snapshot should contain every allocation");
+    rewind(out);
+    uint64_t words[64];
+    size_t n = fread(words, sizeof(uint64_t), 64, out);
+    fclose(out);
+    mu_assert(n > 3 && memcmp(&words[0], BGC_SNAPSHOT_MAGIC, sizeof(uint64_t)) == 0, "Snapshot should start with the magic");
+    mu_assert(words[1] == gc.allocs->size, "Wrong node count");
+    mu_assert(words[2] == 1 && words[3] == (uint64_t) (uintptr_t) parent, "Parent should be the only root");
+
+    /* Walk the node records and find the parent -> child edge */
+    bool found_edge = false;
+    size_t pos = 4;
+    for (size_t i=0; i<words[1] && pos + 5 <= n; ++i) {
+        uint64_t edge_count = words[pos + 4];
+        if (words[pos] == (uint64_t) (uintptr_t) parent) {
+            mu_assert(words[pos + 1] == 2 * sizeof(void*), "Wrong parent size");
+            for (size_t e=0; e<edge_count; ++e) {
+                found_edge |= words[pos + 5 + e] == (uint64_t) (uintptr_t) child;
+            }
+        }
+        pos += 5 + edge_count;
+    }
+    mu_assert(pos == n, "Snapshot has trailing or missing data");
+    mu_assert(found_edge, "Snapshot should contain the parent -> child edge");
+
+    bgc_stop(&gc);
+    return NULL;
+}
+
+static char* test_gc_profiler()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+    bgc_disable(&gc);
+
+    /* A one byte interval samples every allocation with its exact size */
+    bgc_profile_start(&gc, 1);
+    void* kept = NULL;
+    for (size_t i=0; i<10; ++i) {
+        void* ptr = bgc_calloc(&gc, 1, 64);
+        if (i == 0) kept = ptr;
+    }
+    bgc_push_root(&gc, &kept);
+    mu_assert(gc.profiler.sample_count == 10, "Every allocation should be sampled");
+    mu_assert(bgc_allocation_map_get(gc.allocs, kept)->tag & BGC_TAG_SAMPLED, "Sampled allocation should be tagged");
+    bgc_profile_stop(&gc);
+    bgc_malloc(&gc, 64);
+    mu_assert(gc.profiler.sample_count == 10, "Stopped profiler should not sample");
+
+    /* Collected samples are no longer live, their allocations are still reported */
+    bgc_collect(&gc);
+    size_t allocated = 0, live = 0, live_objects = 0;
+    for (size_t i=0; i<gc.profiler.site_count; ++i) {
+        allocated += gc.profiler.sites[i].allocated_bytes;
+        live += gc.profiler.sites[i].live_bytes;
+        live_objects += gc.profiler.sites[i].live_objects;
+    }
+    mu_assert(allocated == 640, "Wrong number of allocated bytes");
+    mu_assert(live == 64 && live_objects == 1, "Only the rooted sample should be live");
+    mu_assert(gc.profiler.sample_count == 1, "Collected samples should be dropped");
+
+    /* Samples follow their allocation when it is moved */
+    kept = bgc_realloc(&gc, kept, 1 << 20);
+    mu_assert(bgc_profile_find_sample(&gc, kept) != NULL, "Sample should follow realloc");
+    mu_assert(bgc_allocation_map_get(gc.allocs, kept)->tag & BGC_TAG_SAMPLED, "Moved allocation lost its sample tag");
+
+    FILE* out = tmpfile();
+    mu_assert(bgc_profile_dump(&gc, out, BGC_PROFILE_PPROF), "Profile should be written");
+    char text[256];
+    rewind(out);
+    size_t n = fread(text, 1, sizeof(text) - 1, out);
+    text[n] = '\0';
+    fclose(out);
+    mu_assert(strstr(text, "heap profile: 1: 64 [10: 640] @ heapprofile\n") == text, "Wrong pprof header");
+
+    bgc_free(&gc, kept);
+    mu_assert(gc.profiler.sample_count == 0, "Freed sample should be dropped");
+    bgc_stop(&gc);
+    return NULL;
+}
+
+static char* test_gc_record()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+    bgc_disable(&gc);
+
+    FILE* out = tmpfile();
+    mu_assert(bgc_record_start(&gc, out), "Recording should start");
+    void** node = bgc_calloc(&gc, 2, sizeof(void*));
+    bgc_push_root(&gc, (void**) &node);
+    void* child = bgc_malloc(&gc, 16);
+    size_t field = 1;
+    bgcx_store_ext(&gc, node, node[field++], child);
+    mu_assert(field == 2 && node[1] == child, "The field should be evaluated once");
+    node = bgc_realloc(&gc, node, 1 << 20);
+    void* freed = bgc_malloc(&gc, 8);
+    bgc_free(&gc, freed);
+    bgc_malloc(&gc, 8);
+    bgc_collect(&gc);
+    size_t events = gc.recorder.events;
+    mu_assert(events >= 9, "Wrong number of recorded events");
+    bgc_record_stop(&gc);
+    bgc_malloc(&gc, 8);
+    mu_assert(gc.recorder.events == events, "Stopped recorder should not record");
+
+    /* Magic, then the opcode of every event followed by its varint arguments */
+    unsigned char data[256];
+    rewind(out);
+    size_t n = fread(data, 1, sizeof(data), out);
+    fclose(out);
+    mu_assert(n > 8 && memcmp(data, BGC_RECORDING_MAGIC, 8) == 0, "Wrong recording magic");
+    const char* expected = "AAWRAFAC";
+    size_t pos = 8;
+    for (size_t i=0; expected[i]; ++i) {
+        mu_assert(pos < n && data[pos] == expected[i], "Wrong recorded event");
+        size_t argc = expected[i] == 'F' || expected[i] == 'C' ? 1 : 3;
+        pos++;
+        for (size_t j=0; j<argc; ++j) {
+            while (pos < n && data[pos] & 0x80) pos++;
+            pos++;
+        }
+    }
+    mu_assert(pos < n && data[pos] == 'D', "Collected allocation should be recorded as dead");
+    bgc_stop(&gc);
+    return NULL;
+}
+
+static char* test_gc_vector()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+
+    bgc_Vector* vector = bgc_vector(&gc, sizeof(size_t), 0);
+    mu_assert(vector && vector->size == 0 && vector->data == NULL, "New vector should be empty");
+    for (size_t i=0; i<1000; ++i) {
+        mu_assert(bgc_vector_push(&gc, vector, &i), "Push failed");
+    }
+    mu_assert(vector->size == 1000 && vector->capacity == 1024, "Capacity should double");
+    bgc_collect(&gc);
+    mu_assert(bgc_allocation_map_get(gc.allocs, vector->data), "Vector data should survive collection");
+
+    size_t item = 42;
+    bgc_vector_insert(&gc, vector, 1, &item);
+    mu_assert(bgcx_vector_get(vector, 0, size_t) == 0, "Insert should keep earlier items");
+    mu_assert(bgcx_vector_get(vector, 1, size_t) == 42, "Insert should place the item");
+    mu_assert(bgcx_vector_get(vector, 2, size_t) == 1, "Insert should move later items");
+    mu_assert(bgc_vector_erase(vector, 1) && bgcx_vector_get(vector, 1, size_t) == 1, "Erase should move later items");
+    mu_assert(!bgc_vector_insert(&gc, vector, 5000, &item), "Insert out of range should fail");
+
+    /* Appending the vector to itself reads the items before they move */
+    bgc_vector_append(&gc, vector, vector->data, vector->size);
+    mu_assert(vector->size == 2000, "Wrong size after append");
+    mu_assert(bgcx_vector_get(vector, 1999, size_t) == 999, "Wrong item after append");
+
+    mu_assert(bgc_vector_pop(vector, &item) && item == 999, "Pop should return the last item");
+    mu_assert(bgc_vector_shrink_to_fit(&gc, vector) && vector->capacity == 1999, "Shrink should drop spare capacity");
+    bgc_Vector* copy = bgc_vector_copy(&gc, vector);
+    mu_assert(copy->size == 1999 && copy->data != vector->data, "Copy should own its items");
+    mu_assert(memcmp(copy->data, vector->data, 1999 * sizeof(size_t)) == 0, "Copy should have the same items");
+    while (bgc_vector_pop(copy, NULL)) {}
+    mu_assert(bgc_vector_shrink_to_fit(&gc, copy) && copy->data == NULL, "Empty vector should release its data");
+
+    bgc_stop(&gc);
+    return NULL;
+}
+
+static char* test_gc_array()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+
+    /* By default the array, its buffer and its slots are separate allocations */
+    size_t allocations = gc.allocs->size;
+    bgc_Array* plain = bgc_array(&gc, sizeof(int), 4);
+    mu_assert(gc.allocs->size == allocations + 3, "Array, buffer and slots should be separate allocations");
+    mu_assert(bgc_allocation_map_get(gc.allocs, plain->buffer->address), "Slots should be their own allocation");
+    void* slots = bgc_realloc(&gc, plain->buffer->address, 8 * sizeof(int));
+    mu_assert(slots != NULL, "Slots should be reallocatable");
+    bgc_free(&gc, slots);
+    mu_assert(gc.allocs->size == allocations + 2, "Slots should be freeable");
+    bgc_Buffer* plain_buffer = bgc_buffer(&gc, 24);
+    mu_assert(bgc_allocation_map_get(gc.allocs, plain_buffer->address), "Buffer data should be its own allocation");
+    bgc_collect(&gc);
+    mu_assert(gc.allocs->size == allocations, "Unreferenced arrays and buffers should be collected");
+
+    /* An inline array, its buffer and its slots are one allocation */
+    bgc_Array* array = bgc_array_inline(&gc, sizeof(double), 100, NULL);
+    bgc_push_root(&gc, (void**) &array);
+    mu_assert(gc.allocs->size == allocations + 1, "Inline array should be a single allocation");
+    mu_assert(array->slot_count == 100 && array->slot_size == sizeof(double), "Wrong array shape");
+    mu_assert(array->buffer->length == 100 * sizeof(double), "Wrong buffer length");
+    mu_assert((uintptr_t) array->buffer->address % _Alignof(max_align_t) == 0, "Slots should be aligned for any type");
+    mu_assert(bgcx_array_data(array, double) == array->buffer->address, "Fast accessor should find the slots");
+    for (size_t i=0; i<100; ++i) {
+        bgcx_array_set(array, i, double, (double) i);
+    }
+    mu_assert(bgcx_array_at(array, 99, double) == 99.0, "Fast accessor should read the slots");
+
+    /* Slots referencing other managed memory keep it alive */
+    bgc_Array* refs = bgc_array_inline(&gc, sizeof(void*), 1, NULL);
+    bgc_push_root(&gc, (void**) &refs);
+    bgcx_array_at(refs, 0, void*) = bgc_calloc(&gc, 1, 16);
+    bgc_Buffer* buffer = bgc_buffer_inline(&gc, 24);
+    mu_assert(bgcx_buffer_data(buffer, char) == buffer->address && buffer->length == 24, "Wrong buffer layout");
+    buffer = NULL;
+    bgc_collect(&gc);
+    mu_assert(bgc_allocation_map_get(gc.allocs, bgcx_array_at(refs, 0, void*)), "Referenced memory should survive");
+    mu_assert(gc.allocs->size == allocations + 3, "Unreferenced buffer should be collected");
+
+    bgc_stop(&gc);
+    return NULL;
+}
+
+typedef struct LayoutNode {
+    struct LayoutNode* next;
+    uintptr_t hidden;
+} LayoutNode;
+
+static char* test_gc_layout()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+
+    /* Only `next` is a pointer slot, in every item of an array */
+    static const uintptr_t bitmap[] = { 0x1 };
+    static const bgc_Layout layout = { sizeof(LayoutNode), bitmap };
+    LayoutNode* nodes = bgc_malloc_typed(&gc, 2 * sizeof(LayoutNode), &layout, NULL);
+    bgc_push_root(&gc, (void**) &nodes);
+    mu_assert(bgc_allocation_map_get(gc.allocs, nodes)->layout == &layout, "Allocation should keep its layout");
+    void* next0 = bgc_malloc(&gc, 8);
+    void* next1 = bgc_malloc(&gc, 8);
+    void* hidden = bgc_malloc(&gc, 8);
+    nodes[0].next = next0;
+    nodes[1].next = next1;
+    nodes[1].hidden = (uintptr_t) hidden;
+    bgc_collect(&gc);
+    mu_assert(bgc_allocation_map_get(gc.allocs, next0), "Pointer slot of the first item should be marked");
+    mu_assert(bgc_allocation_map_get(gc.allocs, next1), "Pointer slot of the second item should be marked");
+    mu_assert(!bgc_allocation_map_get(gc.allocs, hidden), "Words outside the layout should not be scanned");
+
+    /* Atomic allocations are never scanned */
+    void** atomic = bgc_malloc_atomic(&gc, sizeof(void*));
+    bgc_push_root(&gc, (void**) &atomic);
+    *atomic = bgc_malloc(&gc, 8);
+    hidden = *atomic;
+    bgc_collect(&gc);
+    mu_assert(bgc_allocation_map_get(gc.allocs, atomic)->tag & BGC_TAG_ATOMIC, "Atomic allocation should be tagged");
+    mu_assert(!bgc_allocation_map_get(gc.allocs, hidden), "Atomic allocation should not be scanned");
+
+    bgc_stop(&gc);
+    return NULL;
+}
+
+static char* test_gc_weak()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+
+    /* Weak references are cleared once their target is unreachable */
+    void* strong = bgc_malloc(&gc, 8);
+    bgc_push_root(&gc, &strong);
+    bgc_Weak* live = bgc_weak(&gc, strong);
+    bgc_push_root(&gc, (void**) &live);
+    bgc_Weak* dead = bgc_weak(&gc, bgc_malloc(&gc, 8));
+    bgc_push_root(&gc, (void**) &dead);
+    bgc_collect(&gc);
+    mu_assert(bgc_weak_get(live) == strong, "Weak reference to a reachable target should be kept");
+    mu_assert(bgc_weak_get(dead) == NULL, "Weak reference to an unreachable target should be cleared");
+    mu_assert(gc.stats.weak_cleared == 1, "Cleared weak references should be counted");
+
+    /* Values are kept only while their key is reachable, also through other values */
+    bgc_WeakMap* map = bgc_weak_map(&gc, 0);
+    bgc_push_root(&gc, (void**) &map);
+    void** chained = bgc_malloc(&gc, sizeof(void*));
+    *chained = bgc_malloc(&gc, 8);
+    mu_assert(bgc_weak_map_put(map, strong, chained), "Put should succeed");
+    void* chained_value = bgc_malloc(&gc, 8);
+    mu_assert(bgc_weak_map_put(map, *chained, chained_value), "Put should succeed");
+    mu_assert(bgc_weak_map_put(map, bgc_malloc(&gc, 8), bgc_malloc(&gc, 8)), "Put should succeed");
+    chained = NULL;
+    bgc_collect(&gc);
+    mu_assert(map->size == 2, "Entry of an unreachable key should be dropped");
+    chained = bgc_weak_map_get(map, strong);
+    mu_assert(bgc_weak_map_get(map, *chained) == chained_value, "Value of a key kept alive by a value should survive");
+    mu_assert(bgc_allocation_map_get(gc.allocs, chained_value), "Values of reachable keys should be marked");
+    chained = NULL;
+    chained_value = NULL;
+
+    /* Dropping the last strong reference empties the map and clears the weak reference */
+    strong = NULL;
+    bgc_collect(&gc);
+    mu_assert(map->size == 0, "Entries of collected keys should be dropped");
+    mu_assert(bgc_weak_get(live) == NULL, "Weak reference to a collected target should be cleared");
+
+    /* Growing and removing keep every entry reachable */
+    void** keys = bgc_calloc(&gc, 64, sizeof(void*));
+    bgc_push_root(&gc, (void**) &keys);
+    for (size_t i=0; i<64; ++i) {
+        keys[i] = bgc_malloc(&gc, 8);
+        mu_assert(bgc_weak_map_put(map, keys[i], (void*) (i + 1)), "Put should succeed");
+    }
+    mu_assert(map->size == 64 && map->capacity >= 64, "Map should grow");
+    for (size_t i=0; i<64; i+=2) {
+        mu_assert(bgc_weak_map_remove(map, keys[i]), "Remove should find the key");
+        keys[i + 1] = i < 32 ? keys[i + 1] : NULL;
+    }
+    mu_assert(!bgc_weak_map_remove(map, keys[0]), "Removed key should be gone");
+    bgc_collect(&gc);
+    mu_assert(map->size == 16, "Only reachable keys should stay");
+    for (size_t i=1; i<32; i+=2) {
+        mu_assert(bgc_weak_map_get(map, keys[i]) == (void*) (i + 1), "Surviving entries should be found");
+    }
+
+    /* Freeing a target or key clears the reference at once, before its address can be reused */
+    void* freed = bgc_malloc(&gc, 8);
+    bgc_Weak* to_freed = bgc_weak(&gc, freed);
+    bgc_push_root(&gc, (void**) &to_freed);
+    mu_assert(bgc_weak_map_put(map, freed, (void*) 1), "Put should succeed");
+    size_t cleared = gc.stats.weak_cleared;
+    bgc_free(&gc, freed);
+    mu_assert(bgc_weak_get(to_freed) == NULL, "Weak reference to a freed target should be cleared");
+    mu_assert(bgc_weak_map_get(map, freed) == NULL && map->size == 16, "Entry of a freed key should be dropped");
+    mu_assert(gc.stats.weak_cleared == cleared + 2, "Cleared references should be counted");
+    bgc_free(&gc, keys[1]);
+    mu_assert(map->size == 15, "Entry of a freed surviving key should be dropped");
+    to_freed = NULL;
+
+    /* Moving a target or key with bgc_realloc takes the reference and the entry along */
+    void* moved = bgc_malloc(&gc, 8);
+    bgc_Weak* to_moved = bgc_weak(&gc, moved);
+    bgc_push_root(&gc, (void**) &to_moved);
+    mu_assert(bgc_weak_map_put(map, moved, (void*) 2), "Put should succeed");
+    uintptr_t old = (uintptr_t) moved;
+    moved = bgc_realloc(&gc, moved, 1 << 20);
+    mu_assert((uintptr_t) moved != old, "Growing to 1 MB should move the allocation");
+    mu_assert(bgc_weak_get(to_moved) == moved, "Weak reference should follow its target");
+    mu_assert(bgc_weak_map_get(map, moved) == (void*) 2 && bgc_weak_map_get(map, (void*) old) == NULL,
+              "Entry should follow its key");
+    mu_assert(map->size == 16, "Moving a key should not add entries");
+    bgc_free(&gc, moved);
+    mu_assert(bgc_weak_get(to_moved) == NULL && map->size == 15, "Freeing the moved target should clear both");
+    to_moved = NULL;
+
+    /* Unreachable and freed weak objects leave the registry */
+    bgc_free(&gc, live);
+    live = NULL;
+    dead = NULL;
+    map = NULL;
+    bgc_collect(&gc);
+    mu_assert(gc.weak.ref_count == 0 && gc.weak.map_count == 0, "Weak objects should be unregistered");
+
+    bgc_stop(&gc);
+    return NULL;
+}
+
+static char* test_gc_intern()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+
+    /* Equal strings share one managed copy */
+    const char* hello = bgc_intern(&gc, "hello", 5);
+    bgc_push_root(&gc, (void**) &hello);
+    mu_assert(strcmp(hello, "hello") == 0, "Interned string should be a null-terminated copy");
+    mu_assert(bgc_intern(&gc, "hello world", 5) == hello, "Equal strings should be interned once");
+    const char* world = bgc_intern(&gc, "world", 5);
+    bgc_push_root(&gc, (void**) &world);
+    mu_assert(world != hello, "Different strings should have different copies");
+    mu_assert(bgc_intern(&gc, "a\0b", 3) != bgc_intern(&gc, "a", 1), "Embedded null bytes should be compared");
+    mu_assert(bgc_allocation_map_get(gc.allocs, (void*) hello)->tag & BGC_TAG_ATOMIC, "Strings should not be scanned");
+
+    /* The table grows and keeps every reachable string */
+    const char** names = bgc_calloc(&gc, 1000, sizeof(char*));
+    bgc_push_root(&gc, (void**) &names);
+    char name[32];
+    for (size_t i=0; i<1000; ++i) {
+        int len = snprintf(name, sizeof(name), "name%zu", i);
+        names[i] = bgc_intern(&gc, name, (size_t) len);
+    }
+    bgc_collect(&gc);
+    mu_assert(gc.interned.size == 1002, "Unreachable strings should leave the table");
+    for (size_t i=0; i<1000; ++i) {
+        int len = snprintf(name, sizeof(name), "name%zu", i);
+        mu_assert(bgc_intern(&gc, name, (size_t) len) == names[i], "Reachable strings should stay canonical");
+    }
+
+    /* Collected and freed strings leave the table */
+    names = NULL;
+    bgc_collect(&gc);
+    mu_assert(gc.interned.size == 2, "Collected strings should leave the table");
+    bgc_free(&gc, (void*) world);
+    world = NULL;
+    mu_assert(gc.interned.size == 1, "Freed strings should leave the table");
+    mu_assert(bgc_intern(&gc, "hello", 5) == hello, "Remaining strings should still be found");
+
+    /* A reallocated string is no longer canonical, moved or not */
+    char* grown = bgc_realloc(&gc, (void*) hello, 1 << 20);
+    mu_assert(gc.interned.size == 0, "Reallocated strings should leave the table");
+    mu_assert(bgc_intern(&gc, "hello", 5) != grown, "Reallocated strings should not be found");
+
+    bgc_stop(&gc);
+    return NULL;
+}
+
+#if defined(BGC_HAVE_MMAP)
+static char* test_gc_map_file()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+
+    FILE* file = tmpfile();
+    for (size_t i=0; i<10000; ++i) {
+        fputc((int) (i % 251), file);
+    }
+    fflush(file);
+    int fd = fileno(file);
+
+    /* The buffer points into a mapping that starts at the page of the offset */
+    bgc_Buffer* buffer = bgc_buffer_map_file(&gc, fd, 5000, 3000, PROT_READ);
+    bgc_push_root(&gc, (void**) &buffer);
+    mu_assert(buffer && buffer->length == 3000, "File should be mapped");
+    const unsigned char* data = buffer->address;
+    mu_assert(data[0] == 5000 % 251 && data[2999] == 7999 % 251, "Buffer should show the file contents");
+    mu_assert(gc.stats.external_bytes == 3000 + 5000 % (size_t) sysconf(_SC_PAGESIZE), "Mapping should count as external memory");
+    mu_assert(bgc_allocation_map_get(gc.allocs, buffer)->tag & BGC_TAG_ATOMIC, "Mapped buffer should not be scanned");
+    mu_assert(!bgc_buffer_map_file(&gc, fd, 0, 0, PROT_READ) && errno == EINVAL, "Empty mappings should be rejected");
+
+    buffer = NULL;
+    bgc_collect(&gc);
+    mu_assert(gc.stats.external_bytes == 0, "Unreachable mapping should be unmapped");
+
+    /* External memory paces collections */
+    size_t length = BGC_EXTERNAL_LIMIT / 2;
+    mu_assert(ftruncate(fd, (off_t) length) == 0, "File should grow");
+    size_t collections = gc.stats.collections;
+    for (size_t i=0; i<4; ++i) {
+        mu_assert(bgc_buffer_map_file(&gc, fd, 0, length, PROT_READ), "File should be mapped");
+    }
+    mu_assert(gc.stats.collections == collections + 1, "Mapping past the limit should collect");
+    mu_assert(gc.stats.external_bytes == length, "Collection should unmap unreachable mappings");
+
+    bgc_stop(&gc);
+    mu_assert(gc.stats.external_bytes == 0, "Stopping should unmap everything");
+    fclose(file);
+    return NULL;
+}
+#endif
+
+static char* test_gc_huge_pages()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+    bool supported = bgc_set_huge_pages(&gc, true);
+
+    /* Small allocations stay with malloc */
+    char* small = bgc_malloc(&gc, 64);
+    bgc_push_root(&gc, (void**) &small);
+    mu_assert(!(bgc_allocation_map_get(gc.allocs, small)->tag & BGC_TAG_HUGE), "Small allocation should not be huge");
+
+    unsigned char* large = bgc_calloc(&gc, 1, BGC_HUGE_PAGE_SIZE + 1);
+    bgc_push_root(&gc, (void**) &large);
+    mu_assert(large && large[BGC_HUGE_PAGE_SIZE] == 0, "Large allocation should be zeroed");
+    bgc_Allocation* alloc = bgc_allocation_map_get(gc.allocs, large);
+    mu_assert(supported || !(alloc->tag & BGC_TAG_HUGE), "Huge pages should only be used where supported");
+    if (alloc->tag & BGC_TAG_HUGE) {
+        mu_assert((uintptr_t) large % BGC_HUGE_PAGE_SIZE == 0, "Huge-page region should be aligned");
+        mu_assert(gc.stats.huge_page_bytes == 2 * BGC_HUGE_PAGE_SIZE, "Region should be rounded to huge pages");
+    }
+
+    /* Resizing within the region keeps the address, outside of it moves the contents */
+    large[0] = 1;
+    large[BGC_HUGE_PAGE_SIZE] = 2;
+    unsigned char* resized = bgc_realloc(&gc, large, 2 * BGC_HUGE_PAGE_SIZE);
+    mu_assert(!(alloc->tag & BGC_TAG_HUGE) || resized == large, "Resizing within the region should not move");
+    large = bgc_realloc(&gc, resized, 3 * BGC_HUGE_PAGE_SIZE);
+    mu_assert(large[0] == 1 && large[BGC_HUGE_PAGE_SIZE] == 2, "Resizing should keep the contents");
+    mu_assert(bgc_allocation_map_get(gc.allocs, large)->size == 3 * BGC_HUGE_PAGE_SIZE, "Allocation should be resized");
+    large = bgc_realloc(&gc, large, 16);
+    mu_assert(large[0] == 1, "Shrinking should keep the contents");
+    mu_assert(!(bgc_allocation_map_get(gc.allocs, large)->tag & BGC_TAG_HUGE), "Small allocation should not be huge");
+    mu_assert(gc.stats.huge_page_bytes == 0, "Shrunk allocation should leave its region");
+
+    large = bgc_malloc(&gc, BGC_HUGE_PAGE_SIZE);
+    large = NULL;
+    bgc_collect(&gc);
+    mu_assert(gc.stats.huge_page_bytes == 0, "Unreachable regions should be unmapped");
+    mu_assert(gc.allocs->size == 1, "Only the small allocation should survive");
+
+    bgc_set_huge_pages(&gc, false);
+    large = bgc_malloc(&gc, BGC_HUGE_PAGE_SIZE);
+    mu_assert(!(bgc_allocation_map_get(gc.allocs, large)->tag & BGC_TAG_HUGE), "Disabled huge pages should not be used");
+
+    bgc_stop(&gc);
+    return NULL;
+}
+
+static char* test_gc_collect_step()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start_ext(&gc, stack_bp, 1024, 1024, 0.2, 0.8, 0.5);
+    bgc_set_precise_roots(&gc, true);
+
+    void** kept = bgc_calloc(&gc, 100, sizeof(void*));
+    bgc_push_root(&gc, (void**) &kept);
+    for (size_t i=0; i<400; ++i) {
+        void* p = bgc_malloc(&gc, 16);
+        if (i % 4 == 0) {
+            kept[i / 4] = p;
+        }
+    }
+
+    /* A step without budget only marks */
+    bgc_StepResult step = bgc_collect_step(&gc, 0);
+    mu_assert(step.marked && !step.finished && step.progress == 0.0, "First step should mark");
+    mu_assert(gc.sweeping && gc.allocs->frozen, "Map should be frozen while sweeping");
+
+    /* Allocations ahead of the sweep cursor are black, behind it they are white */
+    size_t capacity = gc.allocs->capacity;
+    bgc_sweep_buckets(&gc, capacity / 2);
+    for (size_t i=0; i<100; ++i) {
+        void* p = bgc_malloc(&gc, 16);
+        bool ahead = bgc_hash(p) % capacity >= capacity / 2;
+        mu_assert(!(bgc_allocation_map_get(gc.allocs, p)->tag & BGC_TAG_MARK) == !ahead, "Wrong allocation color");
+    }
+    mu_assert(gc.allocs->capacity == capacity, "Map should not resize while sweeping");
+
+    size_t freed = 0;
+    TRACE_EVENT_COUNT = 0;
+    bgc_set_tracer(&gc, _record_event, NULL);
+    do {
+        step = bgc_collect_step(&gc, 1000000);
+        freed += step.freed_bytes;
+        mu_assert(!step.marked, "Pending sweep should be continued");
+    } while (!step.finished);
+    bgc_set_tracer(&gc, NULL, NULL);
+    mu_assert(TRACE_EVENTS[0].phase == BGC_PHASE_COLLECT_STEP && TRACE_EVENTS[0].begin, "Step should open the trace");
+    mu_assert(TRACE_EVENTS[TRACE_EVENT_COUNT - 1].phase == BGC_PHASE_COLLECT_STEP
+              && TRACE_EVENTS[TRACE_EVENT_COUNT - 1].count == step.freed_bytes, "Step should close the trace");
+    mu_assert(step.progress == 1.0 && !gc.sweeping && !gc.allocs->frozen, "Sweep should finish");
+    mu_assert(gc.stats.collections == 1 && gc.stats.collection_steps >= 2, "Wrong number of collections");
+    mu_assert(((bgc_Allocation*) bgc_allocation_map_get(gc.allocs, kept[99]))->tag == BGC_TAG_NONE, "Survivors should be unmarked");
+    mu_assert(gc.allocs->size == 201, "Reachable and new allocations should survive");
+
+    /* The next collection frees what was allocated during the sweep */
+    mu_assert(bgc_collect(&gc) == 100 * 16, "Unreachable allocations should be freed");
+
+    bgc_stop(&gc);
+    return NULL;
+}
+
+static char* test_gc_idle_hint()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start_ext(&gc, stack_bp, 1024, 1024, 0.2, 0.8, 0.5);
+    bgc_set_precise_roots(&gc, true);
+    uint64_t deadline = bgc_now_ns() + 1000000000;
+
+    /* Far from the sweep limit an idle period is not worth a collection */
+    bgc_malloc(&gc, 16);
+    bgc_StepResult step = bgc_idle_hint(&gc, deadline);
+    mu_assert(!step.marked && step.freed_bytes == 0 && gc.stats.collection_steps == 0, "Idle hint should do nothing");
+
+    size_t limit = gc.allocs->sweep_limit;
+    while (2 * gc.allocs->size < limit) {
+        bgc_malloc(&gc, 16);
+    }
+    size_t allocated = gc.allocs->size;
+    mu_assert(!bgc_idle_hint(&gc, bgc_now_ns()).marked, "Idle hint should respect the deadline");
+    step = bgc_idle_hint(&gc, deadline);
+    mu_assert(step.marked && step.finished && step.freed_bytes == allocated * 16, "Idle hint should collect");
+    mu_assert(gc.stats.collections == 1 && gc.stats.allocation_collections == 0, "Wrong number of collections");
+
+    /* Crossing the sweep limit collects during allocation */
+    limit = gc.allocs->sweep_limit;
+    for (size_t i=0; i<limit + 2; ++i) {
+        bgc_malloc(&gc, 16);
+    }
+    mu_assert(gc.stats.allocation_collections == 1, "Allocation should trigger a collection");
+
+    bgc_stop(&gc);
+    return NULL;
+}
+
 static char* duplicate_string(bgc_GC* gc, char* str)
 {
     char* copy = (char*) bgc_strdup(gc, str);
@@ -456,33 +1521,191 @@ char* test_gc_strdup()
     return NULL;
 }
 
+static char* test_gc_stop_ext()
+{
+    /* A fast stop runs every deconstructor, reachable or not */
+    DTOR_COUNT = 0;
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+    void* kept = bgc_malloc_ext(&gc, 16, dtor);
+    bgc_push_root(&gc, &kept);
+    for (size_t i=0; i<100; ++i) {
+        bgc_malloc_ext(&gc, 16, i % 2 ? dtor : NULL);
+    }
+    bgc_collect_step(&gc, 0);
+    mu_assert(gc.sweeping, "Sweep should be pending");
+    size_t live = gc.stats.live_bytes;
+    size_t freed = bgc_stop_ext(&gc, BGC_STOP_FAST);
+    mu_assert(DTOR_COUNT == 51, "Fast stop should run every dtor once");
+    mu_assert(freed == live, "Fast stop should free what the sweep left");
+
+    DTOR_COUNT = 0;
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+    for (size_t i=0; i<100; ++i) {
+        bgc_malloc_ext(&gc, 16, dtor);
+    }
+    bgc_WeakMap* map = bgc_weak_map(&gc, 4);
+    mu_assert(bgc_weak_map_put(map, bgc_malloc(&gc, 16), NULL), "Weak map entry should be put");
+    size_t skipped_dtors = gc.stats.dtors_run;
+    bgc_stop_ext(&gc, BGC_STOP_SKIP_DTORS);
+    mu_assert(DTOR_COUNT == 0, "Skipped dtors should not run");
+    mu_assert(gc.stats.dtors_run == skipped_dtors + 1, "The weak map should still be released");
+
+    /* Slabs emptied by a collection are released, only one spare slab stays */
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+    bgc_disable(&gc);
+    for (size_t i=0; i<3 * BGC_SLAB_ALLOCATIONS; ++i) {
+        bgc_malloc(&gc, 8);
+    }
+    mu_assert(gc.allocs->full_slabs != NULL, "Full slabs should be in use");
+    bgc_enable(&gc);
+    bgc_collect(&gc);
+    mu_assert(gc.allocs->full_slabs == NULL && gc.allocs->spare_slabs != NULL
+              && gc.allocs->spare_slabs->next == NULL, "Empty slabs should be freed");
+    bgc_stop(&gc);
+
+    /* Kept memory stays valid and belongs to the caller */
+    bgc_start(&gc, stack_bp);
+    char* s = bgc_strdup(&gc, "kept");
+    mu_assert(bgc_stop_ext(&gc, BGC_STOP_KEEP_MEMORY) == 0 && DTOR_COUNT == 0, "Kept memory should not be freed");
+    mu_assert(strcmp(s, "kept") == 0, "Kept memory should stay valid");
+    free(s);
+    return NULL;
+}
+
+static char* test_gc_blacklisting()
+{
+    bgc_GC gc;
+    void *stack_bp = __builtin_frame_address(0);
+    bgc_start(&gc, stack_bp);
+    bgc_set_precise_roots(&gc, true);
+    mu_assert(!gc.blacklisting, "Blacklisting should be off by default");
+    bgc_set_blacklisting(&gc, true);
+
+    /* Words outside the heap bounds are never looked up */
+    char* a = bgc_malloc(&gc, 64);
+    mu_assert(gc.heap_min <= (uintptr_t) a && (uintptr_t) a <= gc.heap_max, "Allocations should be within the heap bounds");
+    bgc_mark_alloc(&gc, (void*) (gc.heap_max + 16));
+    mu_assert(gc.blacklist.size == 0, "Words outside the heap should not be blacklisted");
+
+    /* A stale word in a root range blacklists the address it holds */
+    static void* stale[1];
+    bgc_add_roots(&gc, stale, stale + 1);
+    void* b = bgc_malloc(&gc, 64);
+    bgc_free(&gc, b);
+    stale[0] = b;
+    bgc_collect(&gc);
+    bgc_Stats stats;
+    bgc_get_stats(&gc, &stats);
+    mu_assert(stats.blacklisted_addresses == 1 && bgc_blacklist_contains(&gc.blacklist, b), "Near misses should be blacklisted");
+    mu_assert(!bgc_blacklist_contains(&gc.blacklist, a + 1), "Misaligned words should not be blacklisted");
+
+    /* The allocator holds a blacklisted block back instead of handing it out */
+    /* Another size than `b`, so that malloc offers the block just freed */
+    uintptr_t next = (uintptr_t) malloc(96);
+    free((void*) next);
+    bgc_blacklist_add(&gc.blacklist, next);
+    void* block = bgc_malloc(&gc, 96);
+    mu_assert((uintptr_t) block != next, "Blacklisted addresses should not be handed out");
+    mu_assert(gc.blacklist.held_count == 1 && (uintptr_t) gc.blacklist.held[0].ptr == next, "The blacklisted block should be held");
+    mu_assert(gc.stats.blacklisted_bytes == 96 && gc.stats.blacklist_avoided == 1, "The avoided block should be counted");
+    mu_assert(!bgc_blacklist_hold(&gc, block, BGC_BLACKLIST_HELD_BYTES + 1), "Held blocks should stay within the byte budget");
+
+    /* Once no word holds its address any more, the block is released */
+    stale[0] = NULL;
+    bgc_collect(&gc);
+    mu_assert(gc.blacklist.held_count == 0 && gc.stats.blacklisted_bytes == 0, "Held blocks should be released");
+
+    /* Only what misaligned stack words retain counts as misaligned-stack retention */
+    void* c = bgc_malloc(&gc, 48);
+    bgc_push_root(&gc, &c);
+    bgc_mark(&gc);
+    mu_assert(gc.stats.misaligned_retained_bytes == 0, "Roots should not count as misaligned-stack retention");
+    bgc_sweep(&gc);
+    bgc_pop_roots(&gc, 1);
+    /* Keep the address of the new allocation off the stack but for one misaligned copy */
+    volatile uintptr_t hidden = ~(uintptr_t) bgc_malloc(&gc, 48);
+    _Alignas(uintptr_t) volatile unsigned char words[2 * sizeof(uintptr_t)] = { 0 };
+    for (size_t i=0; i<sizeof(uintptr_t); ++i) {
+        words[1 + i] = (unsigned char) (~hidden >> (8 * i));
+    }
+    gc.stats.misaligned_retained_bytes = 0;
+    bgc_mark_stack(&gc);
+    mu_assert(gc.stats.misaligned_retained_bytes == 48, "Misaligned stack words should count as misaligned-stack retention");
+    /* Read the copy back, so the stores into it stay live until the scan ran */
+    uintptr_t copy = 0;
+    for (size_t i=0; i<sizeof(uintptr_t); ++i) {
+        copy |= (uintptr_t) words[1 + i] << (8 * i);
+    }
+    mu_assert(copy == ~hidden, "The misaligned copy should hold the address");
+    bgc_sweep(&gc);
+
+    bgc_set_blacklisting(&gc, false);
+    stale[0] = (char*) block + 16;
+    bgc_collect(&gc);
+    mu_assert(gc.blacklist.size == 0, "Disabled blacklisting should record nothing");
+    bgc_stop(&gc);
+    return NULL;
+}
+
 /*
  * Test runner
  */
 
 int tests_run = 0;
 
-static char* test_suite()
+static const char* test_suite()
 {
     printf("---=[ GC tests\n");
     mu_run_test(test_gc_allocation_new_delete);
     mu_run_test(test_gc_allocation_map_new_delete);
     mu_run_test(test_gc_allocation_map_basic_get);
     mu_run_test(test_gc_allocation_map_put_get_remove);
-    mu_run_test(test_gc_mark_stack);
-    mu_run_test(test_gc_basic_alloc_free);
+    mu_run_test(test_gc_allocation_map_incremental_resize);
+#if !defined(BGC_NO_THREADS)
+    mu_run_test(test_gc_sharded_allocation_map);
+#endif
+    mu_run_scrubbed_test(test_gc_mark_stack);
+    mu_run_scrubbed_test(test_gc_basic_alloc_free);
     mu_run_test(test_gc_allocation_map_cleanup);
     mu_run_test(test_gc_static_allocation);
     mu_run_test(test_primes);
     mu_run_test(test_gc_realloc);
-    mu_run_test(test_gc_disable_enable);
-    mu_run_test(test_gc_strdup);
+    mu_run_scrubbed_test(test_gc_disable_enable);
+    mu_run_scrubbed_test(test_gc_strdup);
+    mu_run_test(test_gc_root_ranges);
+    mu_run_test(test_gc_precise_roots);
+    mu_run_test(test_gc_stats);
+    mu_run_test(test_gc_finalizable);
+#if !defined(BGC_NO_TRACING)
+    mu_run_test(test_gc_tracing);
+#endif
+    mu_run_test(test_gc_heap_snapshot);
+    mu_run_test(test_gc_profiler);
+    mu_run_test(test_gc_record);
+    mu_run_test(test_gc_vector);
+    mu_run_test(test_gc_array);
+    mu_run_test(test_gc_layout);
+    mu_run_test(test_gc_weak);
+    mu_run_test(test_gc_intern);
+#if defined(BGC_HAVE_MMAP)
+    mu_run_test(test_gc_map_file);
+#endif
+    mu_run_test(test_gc_huge_pages);
+    mu_run_test(test_gc_collect_step);
+    mu_run_test(test_gc_idle_hint);
+    mu_run_test(test_gc_stop_ext);
+    mu_run_test(test_gc_blacklisting);
     return 0;
 }
 
 int main()
 {
-    char *result = test_suite();
+    const char *result = test_suite();
     if (result) {
         printf("%s\n", result);
     } else {
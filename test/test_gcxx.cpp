@@ -0,0 +1,273 @@
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include <bgc.hpp>
+#include "minunit.h"
+
+static std::size_t DTOR_COUNT = 0;
+
+struct Node {
+    explicit Node(int value = 0, Node *next = nullptr) noexcept : value(value), next(next) {}
+    ~Node() { DTOR_COUNT++; }
+
+    int value;
+    Node *next;
+};
+
+/* Holds an address as an integer; declared pointer-free so it is never scanned */
+struct Handle {
+    std::uintptr_t bits;
+};
+
+template <>
+struct bgc::is_pointer_free<Handle> : std::true_type {};
+
+/* The same layout, scanned conservatively */
+struct Box {
+    std::uintptr_t bits;
+};
+
+struct Throwing {
+    explicit Throwing(bool fail) {
+        if (fail) {
+            throw std::runtime_error("constructor failed");
+        }
+    }
+    ~Throwing() { DTOR_COUNT++; }
+};
+
+struct Owner {
+    explicit Owner(std::unique_ptr<int> value) : value(std::move(value)) {}
+
+    std::unique_ptr<int> value;
+};
+
+/* Only `next` and `children` are scanned, `disguised` is not */
+struct TracedNode {
+    TracedNode *next;
+    std::uintptr_t disguised;
+    bgc::gc_ptr<TracedNode> children[2];
+    int value;
+};
+
+BGC_TRACE(TracedNode, next, children);
+
+static std::size_t live_objects(bgc_GC *gc)
+{
+    bgc_Stats stats;
+    bgc_get_stats(gc, &stats);
+    return stats.live_objects;
+}
+
+static const char* test_gcxx_deconstructor()
+{
+    mu_assert(bgc::deconstructor<Node>() == bgc::deconstructor<Node>(), "Every Node should share one trampoline");
+    mu_assert(bgc::deconstructor<Node>() != bgc::deconstructor<Throwing>(), "Types should have their own trampoline");
+    mu_assert(bgc::deconstructor<int>() == nullptr, "Trivial types need no deconstructor");
+    mu_assert(bgc::deconstructor<Handle>() == nullptr, "Trivial types need no deconstructor");
+    return 0;
+}
+
+static const char* test_gcxx_make_gc()
+{
+    bgc_GC gc;
+    bgc_start(&gc, __builtin_frame_address(0));
+    bgc_set_precise_roots(&gc, true);
+    DTOR_COUNT = 0;
+
+    bgc::gc_ptr<Node> head = bgc::make_gc_ext<Node>(&gc, 1);
+    bgc::root_guard guard(head.root_slot(), &gc);
+    head->next = bgc::make_gc_ext<Node>(&gc, 2, nullptr).get();
+    bgc::make_gc_ext<Node>(&gc, 3);
+    mu_assert(head->value == 1 && head->next->value == 2, "Arguments should be forwarded");
+
+    auto owner = bgc::make_gc_ext<Owner>(&gc, std::make_unique<int>(42));
+    mu_assert(*owner->value == 42, "Move-only arguments should be forwarded");
+    owner = nullptr;
+
+    bgc_collect(&gc);
+    mu_assert(DTOR_COUNT == 1, "Only the unreachable Node should be destroyed");
+    mu_assert(live_objects(&gc) == 2, "Wrong number of live objects");
+
+    /* A throwing constructor frees its memory without destroying the object */
+    std::size_t live = live_objects(&gc);
+    bool thrown = false;
+    try {
+        bgc::make_gc_ext<Throwing>(&gc, true);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    mu_assert(thrown, "Constructor exception should propagate");
+    mu_assert(live_objects(&gc) == live && DTOR_COUNT == 1, "Failed construction should be freed without dtor");
+    bgc::make_gc_ext<Throwing>(&gc, false);
+    bgc_collect(&gc);
+    mu_assert(DTOR_COUNT == 2, "Constructed object should get its dtor");
+
+    bgc_stop(&gc);
+    return 0;
+}
+
+static const char* test_gcxx_atomic()
+{
+    bgc_GC gc;
+    bgc_start(&gc, __builtin_frame_address(0));
+    bgc_set_precise_roots(&gc, true);
+    DTOR_COUNT = 0;
+
+    /* A pointer hidden in a pointer-free object does not keep its target alive */
+    auto handle = bgc::make_gc_ext<Handle>(&gc);
+    auto box = bgc::make_gc_ext<Box>(&gc);
+    bgc::root_guard handle_guard(handle.root_slot(), &gc);
+    bgc::root_guard box_guard(box.root_slot(), &gc);
+    handle->bits = reinterpret_cast<std::uintptr_t>(bgc::make_gc_ext<Node>(&gc, 1).get());
+    box->bits = reinterpret_cast<std::uintptr_t>(bgc::make_gc_ext<Node>(&gc, 2).get());
+    bgc_collect(&gc);
+    mu_assert(DTOR_COUNT == 1, "Pointer-free objects should not be scanned");
+    mu_assert(reinterpret_cast<Node *>(box->bits)->value == 2, "Scanned object should keep its target alive");
+
+    bgc_stop(&gc);
+    return 0;
+}
+
+static const char* test_gcxx_trace()
+{
+    const bgc_Layout *layout = bgc::traced<TracedNode>::layout();
+    mu_assert(layout && layout->size == sizeof(TracedNode), "Traced type should have a layout");
+    mu_assert(layout == bgc::traced<TracedNode>::layout(), "Every TracedNode should share one layout");
+    mu_assert(layout->bitmap[0] == 0xd, "Layout should mark next and both children");
+    mu_assert(bgc::traced<Node>::layout() == nullptr, "Untraced types should be scanned conservatively");
+
+    bgc_GC gc;
+    bgc_start(&gc, __builtin_frame_address(0));
+    bgc_set_precise_roots(&gc, true);
+    bgc_GC *previous = BGC_GLOBAL_GC;
+    BGC_GLOBAL_GC = &gc;
+    DTOR_COUNT = 0;
+
+    auto root = bgc::make_gc<TracedNode>();
+    bgc::root_guard guard(root.root_slot(), &gc);
+    TracedNode *created = bgcxx_new(TracedNode)();
+    root->next = created;
+    root->children[1] = bgc::make_gc<TracedNode>();
+    root->disguised = reinterpret_cast<std::uintptr_t>(bgc::make_gc<Node>(1).get());
+    created->next = bgcxx_new(TracedNode)();
+    bgc_collect(&gc);
+    mu_assert(DTOR_COUNT == 1, "Only the untraced field should be ignored");
+    mu_assert(live_objects(&gc) == 4, "Traced fields should keep their objects alive");
+
+    BGC_GLOBAL_GC = previous;
+    bgc_stop(&gc);
+    return 0;
+}
+
+static const char* test_gcxx_allocator()
+{
+    bgc_GC gc;
+    bgc_start(&gc, __builtin_frame_address(0));
+    bgc_set_precise_roots(&gc, true);
+    bgc_GC *previous = BGC_GLOBAL_GC;
+    BGC_GLOBAL_GC = &gc;
+    DTOR_COUNT = 0;
+    {
+        /* Container storage is scanned, so objects only referenced from it survive */
+        std::vector<bgc::gc_ptr<Node>, bgc::allocator<bgc::gc_ptr<Node>>> nodes;
+        std::unordered_map<int, bgc::gc_ptr<Node>, std::hash<int>, std::equal_to<int>,
+                           bgc::allocator<std::pair<const int, bgc::gc_ptr<Node>>>> index;
+        for (int i = 0; i < 100; ++i) {
+            nodes.push_back(bgc::make_gc<Node>(i));
+            index.emplace(i, bgc::make_gc<Node>(-i));
+        }
+        bgc_collect(&gc);
+        mu_assert(DTOR_COUNT == 0, "Objects referenced from containers should survive");
+        mu_assert(nodes[99]->value == 99 && index.at(99)->value == -99, "Container contents should survive");
+
+        std::vector<double, bgc::allocator<double>> numbers(1000, 1.0);
+        mu_assert(numbers.get_allocator() == bgc::allocator<int>(&gc), "Allocators of one collector should be equal");
+
+        nodes.clear();
+        nodes.shrink_to_fit();
+        index.clear();
+        bgc_collect(&gc);
+        mu_assert(DTOR_COUNT == 200, "Objects dropped by containers should be collected");
+    }
+    BGC_GLOBAL_GC = previous;
+    bgc_stop(&gc);
+    return 0;
+}
+
+static const char* test_gcxx_vector()
+{
+    bgc_GC gc;
+    bgc_start(&gc, __builtin_frame_address(0));
+    bgc_set_precise_roots(&gc, true);
+
+    {
+        bgc::vector<int> numbers(2, &gc);
+        bgc::root_guard guard(numbers.root_slot(), &gc);
+        numbers.push_back(1);
+        numbers.push_back(3);
+        mu_assert(*numbers.insert(1, 2) == 2 && numbers[1] == 2 && numbers.size() == 3, "Item should be inserted");
+        mu_assert(*numbers.insert(3, 4) == 4 && numbers.back() == 4, "Item should be inserted at the end");
+
+        bool thrown = false;
+        try {
+            numbers.insert(5, 6);
+        } catch (const std::out_of_range &) {
+            thrown = true;
+        }
+        mu_assert(thrown && numbers.size() == 4, "Inserting past the end should throw out_of_range");
+    }
+
+    bgc_stop(&gc);
+    return 0;
+}
+
+static const char* test_gcxx_new()
+{
+    bgc_GC gc;
+    bgc_start(&gc, __builtin_frame_address(0));
+    bgc_set_precise_roots(&gc, true);
+    bgc_GC *previous = BGC_GLOBAL_GC;
+    BGC_GLOBAL_GC = &gc;
+    DTOR_COUNT = 0;
+
+    Node *node = bgcxx_new(Node)(7);
+    mu_assert(node->value == 7, "bgcxx_new should construct the object");
+    bgc_collect(&gc);
+    mu_assert(DTOR_COUNT == 1, "bgcxx_new objects should be destroyed when collected");
+
+    BGC_GLOBAL_GC = previous;
+    bgc_stop(&gc);
+    return 0;
+}
+
+int tests_run = 0;
+
+static const char* test_suite()
+{
+    printf("---=[ GC C++ tests\n");
+    mu_run_test(test_gcxx_deconstructor);
+    mu_run_test(test_gcxx_make_gc);
+    mu_run_test(test_gcxx_atomic);
+    mu_run_test(test_gcxx_trace);
+    mu_run_test(test_gcxx_allocator);
+    mu_run_test(test_gcxx_vector);
+    mu_run_test(test_gcxx_new);
+    return 0;
+}
+
+int main()
+{
+    const char *result = test_suite();
+    if (result) {
+        printf("%s\n", result);
+    } else {
+        printf("ALL TESTS PASSED\n");
+    }
+    printf("Tests run: %d\n", tests_run);
+    return result != 0;
+}
@@ -0,0 +1,382 @@
+/*
+ * bgc_heap_analyze - Offline analysis of bgc heap snapshots.
+ *
+ * Reads a snapshot written by `bgc_heap_snapshot()` and computes the
+ * dominator tree of the object graph, rooted at a virtual node that points
+ * to every root. The retained size of an allocation is the total size of the
+ * allocations it dominates, i.e. the memory that would be freed if the
+ * allocation became unreachable.
+ *
+ * Snapshot format (native-endian 64-bit words):
+ *
+ *     "BGCSNAP1" node_count root_count
+ *     root_count x address
+ *     node_count x (address size dtor tag edge_count edge_count x address)
+ *
+ * Usage: bgc_heap_analyze [-n top] snapshot
+ */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAPSHOT_MAGIC "BGCSNAP1"
+#define UNDEFINED SIZE_MAX
+
+typedef struct Node {
+    uint64_t address;
+    uint64_t size;
+    uint64_t dtor;
+    uint64_t tag;
+    size_t edge_begin;
+    size_t edge_count;
+} Node;
+
+typedef struct Snapshot {
+    size_t node_count;
+    size_t root_count;
+    uint64_t *roots;
+    /* Node 0 is the virtual root, allocations are 1..node_count */
+    Node *nodes;
+    /* Edge targets as node indices (UNDEFINED for dangling edges) */
+    size_t *edges;
+    size_t edge_count;
+} Snapshot;
+
+static void die(const char *message)
+{
+    fprintf(stderr, "bgc_heap_analyze: %s\n", message);
+    exit(1);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        die("out of memory");
+    }
+    return ptr;
+}
+
+static uint64_t *read_words(FILE *in, size_t *count)
+{
+    size_t capacity = 1 << 16;
+    size_t size = 0;
+    uint64_t *words = xmalloc(capacity * sizeof(uint64_t));
+    size_t n;
+    while ((n = fread(words + size, sizeof(uint64_t), capacity - size, in)) > 0) {
+        size += n;
+        if (size == capacity) {
+            capacity *= 2;
+            words = realloc(words, capacity * sizeof(uint64_t));
+            if (!words) {
+                die("out of memory");
+            }
+        }
+    }
+    *count = size;
+    return words;
+}
+
+static const Node *SORT_NODES;
+
+static int compare_by_address(const void *a, const void *b)
+{
+    uint64_t x = SORT_NODES[*(const size_t *) a].address;
+    uint64_t y = SORT_NODES[*(const size_t *) b].address;
+    return x < y ? -1 : x > y;
+}
+
+/* Find the node index of an address using the address-sorted index */
+static size_t find_node(const Snapshot *snapshot, const size_t *by_address, uint64_t address)
+{
+    size_t lo = 0, hi = snapshot->node_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint64_t a = snapshot->nodes[by_address[mid]].address;
+        if (a == address) {
+            return by_address[mid];
+        }
+        if (a < address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return UNDEFINED;
+}
+
+static void load_snapshot(const char *path, Snapshot *snapshot)
+{
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        die("cannot open snapshot");
+    }
+    size_t word_count;
+    uint64_t *words = read_words(in, &word_count);
+    fclose(in);
+
+    if (word_count < 3 || memcmp(&words[0], SNAPSHOT_MAGIC, sizeof(uint64_t)) != 0) {
+        die("not a bgc heap snapshot");
+    }
+    snapshot->node_count = (size_t) words[1];
+    snapshot->root_count = (size_t) words[2];
+    size_t pos = 3;
+    if (pos + snapshot->root_count > word_count) {
+        die("truncated snapshot");
+    }
+    snapshot->roots = words + pos;
+    pos += snapshot->root_count;
+
+    /* First pass: node records */
+    snapshot->nodes = xmalloc((snapshot->node_count + 1) * sizeof(Node));
+    memset(&snapshot->nodes[0], 0, sizeof(Node));
+    snapshot->edge_count = 0;
+    for (size_t i = 1; i <= snapshot->node_count; ++i) {
+        if (pos + 5 > word_count) {
+            die("truncated snapshot");
+        }
+        Node *node = &snapshot->nodes[i];
+        node->address = words[pos];
+        node->size = words[pos + 1];
+        node->dtor = words[pos + 2];
+        node->tag = words[pos + 3];
+        node->edge_count = (size_t) words[pos + 4];
+        node->edge_begin = pos + 5;
+        pos += 5 + node->edge_count;
+        if (pos > word_count) {
+            die("truncated snapshot");
+        }
+        snapshot->edge_count += node->edge_count;
+    }
+
+    /* Second pass: resolve edge addresses to node indices */
+    size_t *by_address = xmalloc(snapshot->node_count * sizeof(size_t));
+    for (size_t i = 0; i < snapshot->node_count; ++i) {
+        by_address[i] = i + 1;
+    }
+    SORT_NODES = snapshot->nodes;
+    qsort(by_address, snapshot->node_count, sizeof(size_t), compare_by_address);
+
+    /* The virtual root's edges are the roots */
+    snapshot->edges = xmalloc((snapshot->edge_count + snapshot->root_count) * sizeof(size_t));
+    size_t e = 0;
+    snapshot->nodes[0].edge_begin = e;
+    snapshot->nodes[0].edge_count = snapshot->root_count;
+    for (size_t r = 0; r < snapshot->root_count; ++r) {
+        snapshot->edges[e++] = find_node(snapshot, by_address, snapshot->roots[r]);
+    }
+    for (size_t i = 1; i <= snapshot->node_count; ++i) {
+        Node *node = &snapshot->nodes[i];
+        size_t begin = node->edge_begin;
+        node->edge_begin = e;
+        for (size_t k = 0; k < node->edge_count; ++k) {
+            snapshot->edges[e++] = find_node(snapshot, by_address, words[begin + k]);
+        }
+    }
+    free(by_address);
+    /* Keep the roots, drop the rest of the raw words */
+    uint64_t *roots = xmalloc(snapshot->root_count * sizeof(uint64_t));
+    memcpy(roots, snapshot->roots, snapshot->root_count * sizeof(uint64_t));
+    snapshot->roots = roots;
+    free(words);
+}
+
+/*
+ * Compute the reverse postorder of the nodes reachable from the virtual root
+ * with an iterative depth-first search. Returns the number of reachable nodes.
+ */
+static size_t reverse_postorder(const Snapshot *snapshot, size_t *order, size_t *rpo_index)
+{
+    size_t n = snapshot->node_count + 1;
+    size_t *stack = xmalloc(n * sizeof(size_t));
+    size_t *next_edge = xmalloc(n * sizeof(size_t));
+    bool *visited = calloc(n, sizeof(bool));
+    size_t postorder = 0, depth = 0;
+
+    stack[depth++] = 0;
+    visited[0] = true;
+    next_edge[0] = 0;
+    while (depth) {
+        size_t v = stack[depth - 1];
+        const Node *node = &snapshot->nodes[v];
+        if (next_edge[v] < node->edge_count) {
+            size_t w = snapshot->edges[node->edge_begin + next_edge[v]++];
+            if (w != UNDEFINED && !visited[w]) {
+                visited[w] = true;
+                next_edge[w] = 0;
+                stack[depth++] = w;
+            }
+        } else {
+            order[postorder++] = v;
+            --depth;
+        }
+    }
+    /* Reverse the postorder in place */
+    for (size_t i = 0; i < postorder / 2; ++i) {
+        size_t tmp = order[i];
+        order[i] = order[postorder - 1 - i];
+        order[postorder - 1 - i] = tmp;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        rpo_index[i] = UNDEFINED;
+    }
+    for (size_t i = 0; i < postorder; ++i) {
+        rpo_index[order[i]] = i;
+    }
+    free(stack);
+    free(next_edge);
+    free(visited);
+    return postorder;
+}
+
+/*
+ * Cooper, Harvey & Kennedy, "A Simple, Fast Dominance Algorithm".
+ */
+static void dominators(const Snapshot *snapshot, const size_t *order, size_t reachable,
+                       const size_t *rpo_index, size_t *idom)
+{
+    size_t n = snapshot->node_count + 1;
+
+    /* Build the predecessor lists (CSR) restricted to reachable nodes */
+    size_t *pred_count = calloc(n + 1, sizeof(size_t));
+    for (size_t v = 0; v < n; ++v) {
+        if (rpo_index[v] == UNDEFINED) continue;
+        const Node *node = &snapshot->nodes[v];
+        for (size_t k = 0; k < node->edge_count; ++k) {
+            size_t w = snapshot->edges[node->edge_begin + k];
+            if (w != UNDEFINED) pred_count[w + 1]++;
+        }
+    }
+    for (size_t v = 0; v < n; ++v) {
+        pred_count[v + 1] += pred_count[v];
+    }
+    size_t *preds = xmalloc(pred_count[n] * sizeof(size_t));
+    size_t *fill = xmalloc(n * sizeof(size_t));
+    memcpy(fill, pred_count, n * sizeof(size_t));
+    for (size_t v = 0; v < n; ++v) {
+        if (rpo_index[v] == UNDEFINED) continue;
+        const Node *node = &snapshot->nodes[v];
+        for (size_t k = 0; k < node->edge_count; ++k) {
+            size_t w = snapshot->edges[node->edge_begin + k];
+            if (w != UNDEFINED) preds[fill[w]++] = v;
+        }
+    }
+
+    for (size_t v = 0; v < n; ++v) {
+        idom[v] = UNDEFINED;
+    }
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < reachable; ++i) {
+            size_t b = order[i];
+            size_t new_idom = UNDEFINED;
+            for (size_t k = pred_count[b]; k < pred_count[b + 1]; ++k) {
+                size_t p = preds[k];
+                if (idom[p] == UNDEFINED) continue;
+                if (new_idom == UNDEFINED) {
+                    new_idom = p;
+                    continue;
+                }
+                /* intersect */
+                size_t f1 = p, f2 = new_idom;
+                while (f1 != f2) {
+                    while (rpo_index[f1] > rpo_index[f2]) f1 = idom[f1];
+                    while (rpo_index[f2] > rpo_index[f1]) f2 = idom[f2];
+                }
+                new_idom = f1;
+            }
+            if (idom[b] != new_idom) {
+                idom[b] = new_idom;
+                changed = true;
+            }
+        }
+    }
+    free(pred_count);
+    free(preds);
+    free(fill);
+}
+
+static const uint64_t *SORT_RETAINED;
+
+static int compare_by_retained(const void *a, const void *b)
+{
+    uint64_t x = SORT_RETAINED[*(const size_t *) a];
+    uint64_t y = SORT_RETAINED[*(const size_t *) b];
+    return x > y ? -1 : x < y;
+}
+
+int main(int argc, char **argv)
+{
+    size_t top = 20;
+    const char *path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            top = strtoul(argv[++i], NULL, 10);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "Usage: %s [-n top] snapshot\n", argv[0]);
+        return 2;
+    }
+
+    Snapshot snapshot;
+    load_snapshot(path, &snapshot);
+    size_t n = snapshot.node_count + 1;
+
+    size_t *order = xmalloc(n * sizeof(size_t));
+    size_t *rpo_index = xmalloc(n * sizeof(size_t));
+    size_t *idom = xmalloc(n * sizeof(size_t));
+    size_t reachable = reverse_postorder(&snapshot, order, rpo_index);
+    dominators(&snapshot, order, reachable, rpo_index, idom);
+
+    /* Accumulate retained sizes bottom-up along the dominator tree */
+    uint64_t *retained = calloc(n, sizeof(uint64_t));
+    uint64_t total_bytes = 0, reachable_bytes = 0;
+    for (size_t v = 1; v < n; ++v) {
+        total_bytes += snapshot.nodes[v].size;
+    }
+    for (size_t i = reachable; i > 1; --i) {
+        size_t v = order[i - 1];
+        retained[v] += snapshot.nodes[v].size;
+        retained[idom[v]] += retained[v];
+        reachable_bytes += snapshot.nodes[v].size;
+    }
+
+    printf("allocations:        %zu\n", snapshot.node_count);
+    printf("roots:              %zu\n", snapshot.root_count);
+    printf("edges:              %zu\n", snapshot.edge_count);
+    printf("total bytes:        %" PRIu64 "\n", total_bytes);
+    printf("reachable bytes:    %" PRIu64 " (%zu allocations)\n", reachable_bytes, reachable ? reachable - 1 : 0);
+    printf("unreachable bytes:  %" PRIu64 " (awaiting collection)\n", total_bytes - reachable_bytes);
+    printf("\n%-18s %12s %14s %8s %-18s %s\n", "address", "size", "retained", "edges", "dtor", "tag");
+
+    size_t *ranked = xmalloc(n * sizeof(size_t));
+    size_t ranked_count = 0;
+    for (size_t v = 1; v < n; ++v) {
+        if (rpo_index[v] != UNDEFINED) ranked[ranked_count++] = v;
+    }
+    SORT_RETAINED = retained;
+    qsort(ranked, ranked_count, sizeof(size_t), compare_by_retained);
+    for (size_t i = 0; i < ranked_count && i < top; ++i) {
+        const Node *node = &snapshot.nodes[ranked[i]];
+        printf("0x%016" PRIx64 " %12" PRIu64 " %14" PRIu64 " %8zu 0x%016" PRIx64 " %" PRIu64 "\n",
+               node->address, node->size, retained[ranked[i]], node->edge_count, node->dtor, node->tag);
+    }
+
+    free(ranked);
+    free(retained);
+    free(order);
+    free(rpo_index);
+    free(idom);
+    free(snapshot.nodes);
+    free(snapshot.edges);
+    free(snapshot.roots);
+    return 0;
+}
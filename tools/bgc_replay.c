@@ -0,0 +1,408 @@
+/*
+ * bgc_replay - Replay an allocation recording against a bgc build.
+ *
+ * Reads a recording written by `bgc_record_start()` and re-runs its
+ * allocations, reallocations, frees, explicit collections and pointer writes
+ * against the collector it is compiled with, then reports the run time, the
+ * collector statistics and the memory used.
+ *
+ * Recording format: "BGCREC01", then one event per operation, a
+ * `bgc_RecordOp` byte followed by its arguments as unsigned LEB128 varints:
+ *
+ *     'A' address size has_dtor       allocation
+ *     'R' address new_address size    reallocation
+ *     'F' address                     bgc_free
+ *     'D' address                     freed by the collector
+ *     'C' implicit                    collection (1 if allocation-triggered)
+ *     'W' address offset value        pointer stored into an allocation
+ *
+ * Every allocation that is alive in the recording is referenced from a root
+ * table registered with `bgc_add_roots()`. An allocation is dropped from the
+ * table when the recording frees it or when the recorded collector freed it,
+ * so the replayed collector can reclaim it from then on. Pointer writes are
+ * replayed so the collector traces the recorded object graph. Only explicit
+ * collections are replayed; the replayed collector decides itself when an
+ * allocation triggers a collection. Allocations are zero-filled so that
+ * their contents do not retain other allocations by accident.
+ *
+ * Usage: bgc_replay [--initial-capacity N] [--min-capacity N]
+ *                   [--downsize-load-factor F] [--upsize-load-factor F]
+ *                   [--sweep-factor F] [--precise] recording
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "../src/bgc.c"
+
+#define EMPTY UINT64_MAX
+
+/* Recorded address -> root table slot, open addressing with linear probing */
+typedef struct AddressTable {
+    uint64_t *keys;
+    size_t *slots;
+    size_t capacity;
+    size_t size;
+} AddressTable;
+
+typedef struct Replay {
+    bgc_GC gc;
+    AddressTable table;
+    /* Root table of the allocations alive in the recording */
+    void **roots;
+    size_t root_capacity;
+    size_t *free_slots;
+    size_t free_count;
+    size_t next_slot;
+    /* Counters */
+    size_t events;
+    size_t allocations;
+    size_t frees;
+    size_t deaths;
+    size_t writes;
+    size_t explicit_collections;
+    size_t implicit_collections;
+    size_t unknown_addresses;
+    size_t peak_live_bytes;
+} Replay;
+
+static void die(const char *message)
+{
+    fprintf(stderr, "bgc_replay: %s\n", message);
+    exit(1);
+}
+
+static size_t hash_address(uint64_t address, size_t capacity)
+{
+    return (size_t) ((address >> 3) * 0x9e3779b97f4a7c15ULL >> 20) & (capacity - 1);
+}
+
+static void table_init(AddressTable *table, size_t capacity)
+{
+    table->capacity = capacity;
+    table->size = 0;
+    table->keys = malloc(capacity * sizeof(uint64_t));
+    table->slots = malloc(capacity * sizeof(size_t));
+    if (!table->keys || !table->slots) {
+        die("out of memory");
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        table->keys[i] = EMPTY;
+    }
+}
+
+static void table_put(AddressTable *table, uint64_t key, size_t slot);
+
+static void table_grow(AddressTable *table)
+{
+    AddressTable old = *table;
+    table_init(table, old.capacity * 2);
+    for (size_t i = 0; i < old.capacity; ++i) {
+        if (old.keys[i] != EMPTY) {
+            table_put(table, old.keys[i], old.slots[i]);
+        }
+    }
+    free(old.keys);
+    free(old.slots);
+}
+
+static void table_put(AddressTable *table, uint64_t key, size_t slot)
+{
+    if (2 * (table->size + 1) > table->capacity) {
+        table_grow(table);
+    }
+    size_t i = hash_address(key, table->capacity);
+    while (table->keys[i] != EMPTY && table->keys[i] != key) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    table->size += table->keys[i] == EMPTY;
+    table->keys[i] = key;
+    table->slots[i] = slot;
+}
+
+static size_t table_find(const AddressTable *table, uint64_t key)
+{
+    size_t i = hash_address(key, table->capacity);
+    while (table->keys[i] != EMPTY) {
+        if (table->keys[i] == key) {
+            return i;
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return SIZE_MAX;
+}
+
+/* Remove the entry at index `i` with backward-shift deletion */
+static void table_remove_at(AddressTable *table, size_t i)
+{
+    size_t mask = table->capacity - 1;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (table->keys[j] == EMPTY) {
+            break;
+        }
+        size_t home = hash_address(table->keys[j], table->capacity);
+        /* Move the entry at j into the hole at i unless its home lies in (i, j] */
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            table->keys[i] = table->keys[j];
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+    table->keys[i] = EMPTY;
+    table->size--;
+}
+
+static size_t acquire_slot(Replay *replay)
+{
+    if (replay->free_count) {
+        return replay->free_slots[--replay->free_count];
+    }
+    if (replay->next_slot == replay->root_capacity) {
+        size_t capacity = replay->root_capacity ? 2 * replay->root_capacity : 4096;
+        void **roots = calloc(capacity, sizeof(void *));
+        size_t *free_slots = realloc(replay->free_slots, capacity * sizeof(size_t));
+        if (!roots || !free_slots) {
+            die("out of memory");
+        }
+        /* Move the root range; the old table stays registered until the new one is */
+        if (replay->roots) {
+            memcpy(roots, replay->roots, replay->root_capacity * sizeof(void *));
+        }
+        if (!bgc_add_roots(&replay->gc, roots, roots + capacity)) {
+            die("out of memory");
+        }
+        if (replay->roots) {
+            bgc_remove_roots(&replay->gc, replay->roots, replay->roots + replay->root_capacity);
+            free(replay->roots);
+        }
+        replay->roots = roots;
+        replay->free_slots = free_slots;
+        replay->root_capacity = capacity;
+    }
+    return replay->next_slot++;
+}
+
+static void release(Replay *replay, size_t index)
+{
+    size_t slot = replay->table.slots[index];
+    replay->roots[slot] = NULL;
+    replay->free_slots[replay->free_count++] = slot;
+    table_remove_at(&replay->table, index);
+}
+
+static void *lookup(Replay *replay, uint64_t address)
+{
+    size_t index = table_find(&replay->table, address);
+    return index == SIZE_MAX ? NULL : replay->roots[replay->table.slots[index]];
+}
+
+static void noop_dtor(void *ptr)
+{
+    (void) ptr;
+}
+
+static bool read_varint(FILE *in, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        int c = getc(in);
+        if (c == EOF) {
+            return false;
+        }
+        result |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void replay_event(Replay *replay, int op, const uint64_t *args)
+{
+    bgc_GC *gc = &replay->gc;
+    switch (op) {
+    case BGC_RECORD_ALLOC: {
+        void *ptr = bgc_calloc_ext(gc, 1, (size_t) args[1], args[2] ? noop_dtor : NULL);
+        if (!ptr) {
+            die("allocation failed");
+        }
+        /* A stale entry means the recorded address was reused without an event */
+        size_t index = table_find(&replay->table, args[0]);
+        if (index != SIZE_MAX) {
+            release(replay, index);
+        }
+        size_t slot = acquire_slot(replay);
+        replay->roots[slot] = ptr;
+        table_put(&replay->table, args[0], slot);
+        replay->allocations++;
+        break;
+    }
+    case BGC_RECORD_REALLOC: {
+        size_t index = table_find(&replay->table, args[0]);
+        if (index == SIZE_MAX) {
+            replay->unknown_addresses++;
+            break;
+        }
+        size_t slot = replay->table.slots[index];
+        void *ptr = bgc_realloc(gc, replay->roots[slot], (size_t) args[2]);
+        if (!ptr) {
+            die("reallocation failed");
+        }
+        replay->roots[slot] = ptr;
+        table_remove_at(&replay->table, index);
+        table_put(&replay->table, args[1], slot);
+        break;
+    }
+    case BGC_RECORD_FREE:
+    case BGC_RECORD_DIE: {
+        size_t index = table_find(&replay->table, args[0]);
+        if (index == SIZE_MAX) {
+            replay->unknown_addresses++;
+            break;
+        }
+        if (op == BGC_RECORD_FREE) {
+            bgc_free(gc, replay->roots[replay->table.slots[index]]);
+            replay->frees++;
+        } else {
+            replay->deaths++;
+        }
+        release(replay, index);
+        break;
+    }
+    case BGC_RECORD_COLLECT:
+        if (args[0]) {
+            replay->implicit_collections++;
+        } else {
+            bgc_collect(gc);
+            replay->explicit_collections++;
+        }
+        break;
+    case BGC_RECORD_WRITE: {
+        char *obj = lookup(replay, args[0]);
+        if (!obj) {
+            replay->unknown_addresses++;
+            break;
+        }
+        void *value = args[2] ? lookup(replay, args[2]) : NULL;
+        bgc_Allocation *alloc = bgc_allocation_map_get(gc->allocs, obj);
+        if (alloc && args[1] + sizeof(void *) <= alloc->size) {
+            memcpy(obj + args[1], &value, sizeof(void *));
+        }
+        replay->writes++;
+        break;
+    }
+    default:
+        die("corrupt recording");
+    }
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [--initial-capacity N] [--min-capacity N] [--downsize-load-factor F]\n"
+                    "       [--upsize-load-factor F] [--sweep-factor F] [--precise] recording\n", program);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    size_t initial_capacity = 1024, min_capacity = 1024;
+    double downsize = 0.2, upsize = 0.8, sweep_factor = 0.5;
+    bool precise = false;
+    const char *path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--precise") == 0) {
+            precise = true;
+        } else if (arg[0] != '-') {
+            path = arg;
+        } else if (i + 1 >= argc) {
+            usage(argv[0]);
+        } else if (strcmp(arg, "--initial-capacity") == 0) {
+            initial_capacity = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--min-capacity") == 0) {
+            min_capacity = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--downsize-load-factor") == 0) {
+            downsize = strtod(argv[++i], NULL);
+        } else if (strcmp(arg, "--upsize-load-factor") == 0) {
+            upsize = strtod(argv[++i], NULL);
+        } else if (strcmp(arg, "--sweep-factor") == 0) {
+            sweep_factor = strtod(argv[++i], NULL);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (!path) {
+        usage(argv[0]);
+    }
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        die("cannot open recording");
+    }
+    char magic[8];
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, BGC_RECORDING_MAGIC, 8) != 0) {
+        die("not a bgc recording");
+    }
+
+    static Replay replay;
+    table_init(&replay.table, 1 << 16);
+    bgc_start_ext(&replay.gc, __builtin_frame_address(0), initial_capacity, min_capacity,
+                  downsize, upsize, sweep_factor);
+    bgc_set_precise_roots(&replay.gc, precise);
+
+    uint64_t start = bgc_now_ns();
+    int op;
+    while ((op = getc(in)) != EOF) {
+        size_t argc_for_op = op == BGC_RECORD_FREE || op == BGC_RECORD_DIE || op == BGC_RECORD_COLLECT ? 1 : 3;
+        uint64_t args[3] = { 0, 0, 0 };
+        for (size_t i = 0; i < argc_for_op; ++i) {
+            if (!read_varint(in, &args[i])) {
+                die("truncated recording");
+            }
+        }
+        replay_event(&replay, op, args);
+        replay.events++;
+        if (replay.gc.stats.live_bytes > replay.peak_live_bytes) {
+            replay.peak_live_bytes = replay.gc.stats.live_bytes;
+        }
+    }
+    double seconds = (double) (bgc_now_ns() - start) * 1e-9;
+    fclose(in);
+
+    bgc_Stats stats;
+    bgc_get_stats(&replay.gc, &stats);
+    printf("{\"replay\":\"%s\",\"events\":%zu,\"allocations\":%zu,\"frees\":%zu,\"deaths\":%zu,"
+           "\"writes\":%zu,\"unknown_addresses\":%zu,\"seconds\":%.6f,"
+           "\"recorded_collections\":%zu,\"explicit_collections\":%zu,\"collections\":%zu,"
+           "\"total_pause_ms\":%.3f,\"max_pause_ms\":%.3f,\"peak_live_bytes\":%zu,"
+           "\"live_bytes\":%zu,\"peak_rss_kb\":%ld}\n",
+           path, replay.events, replay.allocations, replay.frees, replay.deaths, replay.writes,
+           replay.unknown_addresses, seconds,
+           replay.explicit_collections + replay.implicit_collections, replay.explicit_collections,
+           stats.collections, (double) (stats.mark_time_ns + stats.sweep_time_ns) * 1e-6,
+           (double) stats.max_pause_ns * 1e-6, replay.peak_live_bytes, stats.live_bytes, peak_rss_kb());
+
+    bgc_stop(&replay.gc);
+    free(replay.roots);
+    free(replay.free_slots);
+    free(replay.table.keys);
+    free(replay.table.slots);
+    return 0;
+}